@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "adaptive_timeout.h"
+#include "log.h"
+
+#define ADAPTIVE_TIMEOUT_MAX_PROFILES 8
+#define ADAPTIVE_TIMEOUT_MAX_SAMPLES 64
+/* don't trust the percentile any sooner */
+#define ADAPTIVE_TIMEOUT_MIN_SAMPLES 8
+#define ADAPTIVE_TIMEOUT_PERCENTILE 99
+/* the deadline is the percentile times this, in percent, plus the slack */
+#define ADAPTIVE_TIMEOUT_MARGIN 200
+#define ADAPTIVE_TIMEOUT_SLACK_MS 2000
+
+struct adaptive_timeout_samples {
+    unsigned duration_ms[ADAPTIVE_TIMEOUT_MAX_SAMPLES];
+    unsigned count;
+    unsigned next;
+};
+
+struct adaptive_timeout_profile {
+    char resolution[16];
+    char color_mode[16];
+    /* for replacing the least recently used profile */
+    unsigned long last_used;
+    struct adaptive_timeout_samples samples[ADAPTIVE_TIMEOUT_MAX_TYPES];
+};
+
+struct adaptive_timeout {
+    struct adaptive_timeout_profile profiles[ADAPTIVE_TIMEOUT_MAX_PROFILES];
+    struct adaptive_timeout_profile *profile;
+    unsigned long use_count;
+};
+
+struct adaptive_timeout *
+adaptive_timeout_create(void)
+{
+    struct adaptive_timeout *timeout;
+
+    timeout = calloc(1, sizeof(*timeout));
+    if (timeout == NULL) {
+        LOG_ERR("Failed to calloc adaptive timeouts.\n");
+        return NULL;
+    }
+
+    /* an unnamed profile until the scan params are known */
+    timeout->profile = &timeout->profiles[0];
+    return timeout;
+}
+
+void
+adaptive_timeout_free(struct adaptive_timeout *timeout)
+{
+    free(timeout);
+}
+
+void
+adaptive_timeout_select(struct adaptive_timeout *timeout,
+                        const char *resolution, const char *color_mode)
+{
+    struct adaptive_timeout_profile *profile, *lru = NULL;
+    unsigned i;
+
+    for (i = 0; i < ADAPTIVE_TIMEOUT_MAX_PROFILES; ++i) {
+        profile = &timeout->profiles[i];
+        if (strncmp(profile->resolution, resolution, sizeof(profile->resolution) - 1) == 0 &&
+            strncmp(profile->color_mode, color_mode, sizeof(profile->color_mode) - 1) == 0) {
+            goto out;
+        }
+
+        if (lru == NULL || profile->last_used < lru->last_used) {
+            lru = profile;
+        }
+    }
+
+    profile = lru;
+    memset(profile, 0, sizeof(*profile));
+    strncpy(profile->resolution, resolution, sizeof(profile->resolution) - 1);
+    strncpy(profile->color_mode, color_mode, sizeof(profile->color_mode) - 1);
+
+out:
+    profile->last_used = ++timeout->use_count;
+    timeout->profile = profile;
+}
+
+void
+adaptive_timeout_add_sample(struct adaptive_timeout *timeout,
+                            enum adaptive_timeout_type type,
+                            unsigned duration_ms)
+{
+    struct adaptive_timeout_samples *samples = &timeout->profile->samples[type];
+
+    samples->duration_ms[samples->next] = duration_ms;
+    samples->next = (samples->next + 1) % ADAPTIVE_TIMEOUT_MAX_SAMPLES;
+    if (samples->count < ADAPTIVE_TIMEOUT_MAX_SAMPLES) {
+        samples->count++;
+    }
+}
+
+static int
+compare_durations(const void *a, const void *b)
+{
+    unsigned x = *(const unsigned *) a, y = *(const unsigned *) b;
+
+    return (x > y) - (x < y);
+}
+
+unsigned
+adaptive_timeout_get(struct adaptive_timeout *timeout,
+                     enum adaptive_timeout_type type, unsigned max_ms)
+{
+    struct adaptive_timeout_samples *samples = &timeout->profile->samples[type];
+    unsigned sorted[ADAPTIVE_TIMEOUT_MAX_SAMPLES];
+    unsigned long deadline_ms;
+    unsigned rank;
+
+    if (samples->count < ADAPTIVE_TIMEOUT_MIN_SAMPLES) {
+        return max_ms;
+    }
+
+    memcpy(sorted, samples->duration_ms, samples->count * sizeof(sorted[0]));
+    qsort(sorted, samples->count, sizeof(sorted[0]), compare_durations);
+
+    /* nearest rank */
+    rank = (samples->count * ADAPTIVE_TIMEOUT_PERCENTILE + 99) / 100;
+    deadline_ms = (unsigned long) sorted[rank - 1] * ADAPTIVE_TIMEOUT_MARGIN / 100 +
+                  ADAPTIVE_TIMEOUT_SLACK_MS;
+
+    return deadline_ms < max_ms ? (unsigned) deadline_ms : max_ms;
+}
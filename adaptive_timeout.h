@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#ifndef BROTHER_ADAPTIVE_TIMEOUT_H
+#define BROTHER_ADAPTIVE_TIMEOUT_H
+
+/*
+ * Per-device deadlines learned from the previous scans. Durations are
+ * kept separately for each resolution and color mode, as a 600 dpi color
+ * page takes much longer than a 100 dpi gray one.
+ */
+struct adaptive_timeout;
+
+enum adaptive_timeout_type {
+    /* from the end of a page to the start of the next one */
+    ADAPTIVE_TIMEOUT_PAGE_GAP,
+    ADAPTIVE_TIMEOUT_MAX_TYPES
+};
+
+struct adaptive_timeout *adaptive_timeout_create(void);
+void adaptive_timeout_free(struct adaptive_timeout *timeout);
+
+/**
+ * Record and look up the durations of scans with the given
+ * scan params from now on. Both are the raw 'R' and 'M' values.
+ */
+void adaptive_timeout_select(struct adaptive_timeout *timeout,
+                             const char *resolution, const char *color_mode);
+
+void adaptive_timeout_add_sample(struct adaptive_timeout *timeout,
+                                 enum adaptive_timeout_type type,
+                                 unsigned duration_ms);
+
+/**
+ * Get the deadline for the next wait of the given type, derived from the
+ * 99th percentile of the recent samples. Returns max_ms if there's not
+ * enough samples yet, and never anything greater than max_ms.
+ */
+unsigned adaptive_timeout_get(struct adaptive_timeout *timeout,
+                              enum adaptive_timeout_type type, unsigned max_ms);
+
+#endif //BROTHER_ADAPTIVE_TIMEOUT_H
@@ -4,41 +4,141 @@
  * that can be found in the LICENSE file.
  */
 
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
 #include "con_queue.h"
 
-static size_t
-con_queue_next(struct con_queue *queue, size_t num)
+#define CON_QUEUE_CACHE_LINE 64
+
+/*
+ * Each slot has a sequence number telling whose turn it is. A slot at
+ * position pos can be written when seq == pos, and read when seq ==
+ * pos + 1. Reading it makes it writable again one lap later.
+ */
+struct con_queue_slot {
+    atomic_size_t seq;
+    max_align_t data[];
+};
+
+struct con_queue {
+    /* claimed by the producers */
+    _Alignas(CON_QUEUE_CACHE_LINE) atomic_size_t tail;
+    /* owned by the consumer */
+    _Alignas(CON_QUEUE_CACHE_LINE) size_t head;
+
+    _Alignas(CON_QUEUE_CACHE_LINE) size_t mask;
+    size_t elem_size;
+    size_t slot_size;
+    uint8_t *slots;
+};
+
+static struct con_queue_slot *
+con_queue_slot(struct con_queue *queue, size_t pos)
 {
-    return ++num % queue->size;
+    return (struct con_queue_slot *) (void *) (queue->slots + (pos & queue->mask) *
+            queue->slot_size);
 }
 
-int
-con_queue_push(struct con_queue *queue, void *element)
+struct con_queue *
+con_queue_create(size_t capacity, size_t elem_size)
 {
-    size_t currentTail = atomic_load(&queue->tail);
-    size_t newTail = con_queue_next(queue, currentTail);
+    struct con_queue *queue;
+    size_t size = 2, i;
 
-    if (newTail == atomic_load(&queue->head)) {
-        return -1;
+    while (size < capacity) {
+        size <<= 1;
     }
 
-    queue->data[currentTail] = element;
-    atomic_store(&queue->tail, newTail);
+    queue = aligned_alloc(CON_QUEUE_CACHE_LINE, sizeof(*queue));
+    if (queue == NULL) {
+        return NULL;
+    }
+
+    memset(queue, 0, sizeof(*queue));
+    queue->mask = size - 1;
+    queue->elem_size = elem_size;
+    queue->slot_size = sizeof(struct con_queue_slot) +
+                       (elem_size + sizeof(max_align_t) - 1) / sizeof(max_align_t) *
+                       sizeof(max_align_t);
+    queue->slots = calloc(size, queue->slot_size);
+    if (queue->slots == NULL) {
+        free(queue);
+        return NULL;
+    }
+
+    atomic_init(&queue->tail, 0);
+    for (i = 0; i < size; ++i) {
+        atomic_init(&con_queue_slot(queue, i)->seq, i);
+    }
+
+    return queue;
+}
 
+void
+con_queue_free(struct con_queue *queue)
+{
+    free(queue->slots);
+    free(queue);
+}
+
+int
+con_queue_push(struct con_queue *queue, const void *element)
+{
+    struct con_queue_slot *slot;
+    size_t pos, seq;
+
+    pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    while (true) {
+        slot = con_queue_slot(queue, pos);
+        seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+        if (seq == pos) {
+            if (atomic_compare_exchange_weak_explicit(&queue->tail, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if ((intptr_t) (seq - pos) < 0) {
+            /* the slot from the previous lap wasn't consumed yet */
+            return -1;
+        } else {
+            pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        }
+    }
+
+    memcpy(slot->data, element, queue->elem_size);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
     return 0;
 }
 
 int
-con_queue_pop(struct con_queue *queue, void **element)
+con_queue_pop(struct con_queue *queue, void *element)
 {
-    size_t currentHead = atomic_load(&queue->head);
+    struct con_queue_slot *slot = con_queue_slot(queue, queue->head);
 
-    if (currentHead == atomic_load(&queue->tail)) {
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != queue->head + 1) {
+        /* empty, or the next element is still being written */
         return -1;
     }
 
-    *element = queue->data[currentHead];
-    atomic_store(&queue->head, con_queue_next(queue, currentHead));
-
+    memcpy(element, slot->data, queue->elem_size);
+    atomic_store_explicit(&slot->seq, queue->head + queue->mask + 1,
+                          memory_order_release);
+    queue->head++;
     return 0;
 }
+
+size_t
+con_queue_pop_bulk(struct con_queue *queue, void *elements, size_t max)
+{
+    uint8_t *out = elements;
+    size_t count = 0;
+
+    while (count < max && con_queue_pop(queue, out + count * queue->elem_size) == 0) {
+        ++count;
+    }
+
+    return count;
+}
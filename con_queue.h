@@ -7,16 +7,30 @@
 #ifndef BROTHER_CONQUEUE_H
 #define BROTHER_CONQUEUE_H
 
-#include <stdatomic.h>
 #include <stddef.h>
 
-struct con_queue {
-    atomic_size_t head, tail;
-    size_t size;
-    void *data[];
-};
+/*
+ * Bounded lock-free queue for any number of producers and a single
+ * consumer. Elements are copied in and out, so nothing is allocated
+ * past con_queue_create().
+ */
+struct con_queue;
+
+/**
+ * Create a queue of at least capacity elements of elem_size bytes.
+ */
+struct con_queue *con_queue_create(size_t capacity, size_t elem_size);
+void con_queue_free(struct con_queue *queue);
 
-int con_queue_push(struct con_queue *queue, void *element);
-int con_queue_pop(struct con_queue *queue, void **element);
+/**
+ * Returns -1 if the queue is full.
+ */
+int con_queue_push(struct con_queue *queue, const void *element);
+int con_queue_pop(struct con_queue *queue, void *element);
+
+/**
+ * Pop up to max elements at once. Returns the number of elements popped.
+ */
+size_t con_queue_pop_bulk(struct con_queue *queue, void *elements, size_t max);
 
 #endif //BROTHER_CONQUEUE_H
@@ -30,6 +30,7 @@ init_default_device_config(struct device_config *dev_config)
     dev_config->timeout = CONFIG_NETWORK_DEFAULT_TIMEOUT_SEC;
     dev_config->page_init_timeout = CONFIG_NETWORK_DEFAULT_PAGE_INIT_TIMEOUT;
     dev_config->page_finish_timeout = CONFIG_NETWORK_DEFAULT_PAGE_FINISH_TIMEOUT;
+    dev_config->buffer_size = CONFIG_NETWORK_DEFAULT_BUFFER_SIZE;
 
 #define ADD_SCAN_PARAM(ID, VAL) \
     param = &dev_config->scan_params[i++]; \
@@ -68,6 +69,14 @@ config_init(const char *config_path)
     TAILQ_INIT(&g_config.devices);
 
     strcpy(g_config.hostname, "brother-open");
+    g_config.button_threads = 1;
+    g_config.workers = 1;
+    g_config.startup_timeout = CONFIG_DEFAULT_STARTUP_TIMEOUT_SEC;
+    g_config.hook_queue_size = CONFIG_HOOK_DEFAULT_QUEUE_SIZE;
+    g_config.spool_memory_budget = CONFIG_SPOOL_DEFAULT_MEMORY_BUDGET;
+    for (i = 0; i < CONFIG_SCAN_MAX_FUNCS; ++i) {
+        g_config.hook_concurrency[i] = CONFIG_HOOK_DEFAULT_CONCURRENCY;
+    }
 
     config = fopen(config_path, "r");
     if (config == NULL) {
@@ -78,6 +87,60 @@ config_init(const char *config_path)
     while (fgets((char *) buf, sizeof(buf), config)) {
         if (sscanf((char *) buf, "hostname %15s", var_str) == 1) {
             memcpy(g_config.hostname, var_str, sizeof(g_config.hostname));
+        } else if (sscanf((char *) buf, "reactor.threads %u", &var_uint) == 1) {
+            g_config.reactor_threads = var_uint;
+        } else if (sscanf((char *) buf, "reactor.io.threads %u", &var_uint) == 1) {
+            g_config.reactor_io_threads = var_uint;
+        } else if (sscanf((char *) buf, "button.threads %u", &var_uint) == 1) {
+            if (var_uint == 0 || var_uint > CONFIG_BUTTON_MAX_THREADS) {
+                fprintf(stderr, "Error: button.threads must be within 1-%d.\n",
+                        CONFIG_BUTTON_MAX_THREADS);
+                goto out;
+            }
+
+            g_config.button_threads = var_uint;
+        } else if (sscanf((char *) buf, "workers %u", &var_uint) == 1) {
+            if (var_uint == 0 || var_uint > CONFIG_MAX_WORKERS) {
+                fprintf(stderr, "Error: workers must be within 1-%d.\n",
+                        CONFIG_MAX_WORKERS);
+                goto out;
+            }
+
+            g_config.workers = var_uint;
+        } else if (sscanf((char *) buf, "hook.queue.size %u", &var_uint) == 1) {
+            if (var_uint == 0) {
+                fprintf(stderr, "Error: hook.queue.size must be positive.\n");
+                goto out;
+            }
+
+            g_config.hook_queue_size = var_uint;
+        } else if (sscanf((char *) buf, "hook.queue.drop %u", &var_uint) == 1) {
+            g_config.hook_queue_drop = var_uint != 0;
+        } else if (sscanf((char *) buf, "hook.concurrency %6s %u", var_str, &var_uint) == 2) {
+            for (i = 0; i < CONFIG_SCAN_MAX_FUNCS; ++i) {
+                if (strcmp(var_str, g_scan_func_str[i]) == 0) {
+                    break;
+                }
+            }
+
+            if (i == CONFIG_SCAN_MAX_FUNCS || var_uint == 0) {
+                fprintf(stderr, "Error: invalid hook.concurrency '%s %u'.\n",
+                        var_str, var_uint);
+                goto out;
+            }
+
+            g_config.hook_concurrency[i] = var_uint;
+        } else if (sscanf((char *) buf, "startup.timeout %u", &var_uint) == 1) {
+            g_config.startup_timeout = var_uint;
+        } else if (sscanf((char *) buf, "spool.memory.budget %u", &var_uint) == 1) {
+            g_config.spool_memory_budget = var_uint;
+        } else if (sscanf((char *) buf, "spool.writer.buffers %u", &var_uint) == 1) {
+            g_config.spool_writer_buffers = var_uint;
+        } else if (sscanf((char *) buf, "spool.writer.sync %u", &var_uint) == 1) {
+            g_config.spool_writer_sync = var_uint;
+        } else if (sscanf((char *) buf, "profile.cache %1023s", var_str) == 1) {
+            free(g_config.profile_cache);
+            g_config.profile_cache = strdup(var_str);
         } else if (sscanf((char *) buf, "ip %64s", var_str) == 1) {
             dev_config = calloc(1, sizeof(*dev_config));
             if (dev_config == NULL) {
@@ -116,6 +179,40 @@ config_init(const char *config_path)
             }
 
             dev_config->page_finish_timeout = var_uint;
+        } else if (sscanf((char *) buf, "network.timeout.adaptive %u", &var_uint) == 1) {
+            if (dev_config == NULL) {
+                fprintf(stderr, "Error: network.timeout.adaptive specified without a device.\n");
+                goto out;
+            }
+
+            dev_config->adaptive_timeout = var_uint != 0;
+        } else if (sscanf((char *) buf, "network.buffer.size %u", &var_uint) == 1) {
+            if (dev_config == NULL) {
+                fprintf(stderr, "Error: network.buffer.size specified without a device.\n");
+                goto out;
+            }
+
+            if (var_uint < CONFIG_NETWORK_MIN_BUFFER_SIZE) {
+                var_uint = CONFIG_NETWORK_MIN_BUFFER_SIZE;
+            } else if (var_uint > CONFIG_NETWORK_MAX_BUFFER_SIZE) {
+                var_uint = CONFIG_NETWORK_MAX_BUFFER_SIZE;
+            }
+
+            dev_config->buffer_size = var_uint;
+        } else if (sscanf((char *) buf, "network.splice %u", &var_uint) == 1) {
+            if (dev_config == NULL) {
+                fprintf(stderr, "Error: network.splice specified without a device.\n");
+                goto out;
+            }
+
+            dev_config->splice = var_uint != 0;
+        } else if (sscanf((char *) buf, "spool.memory.limit %u", &var_uint) == 1) {
+            if (dev_config == NULL) {
+                fprintf(stderr, "Error: spool.memory.limit specified without a device.\n");
+                goto out;
+            }
+
+            dev_config->spool_memory_limit = var_uint;
         } else if (sscanf((char *) buf, "scan.param %c %15s", &var_char, var_str) == 2) {
             if (dev_config == NULL) {
                 fprintf(stderr, "Error: scan.param specified without a device.\n");
@@ -141,7 +238,102 @@ config_init(const char *config_path)
             }
 
             ++param_count;
-        } else if (sscanf((char *) buf, "scan.func %6s %1016s", var_str, var_str + 7) == 2) {
+        } else if (sscanf((char *) buf, "scan.plugin %6s %1016s", var_str, var_str + 7) == 2) {
+            if (dev_config == NULL) {
+                fprintf(stderr, "Error: scan.plugin specified without a device.\n");
+                goto out;
+            }
+
+            for (i = 0; i < CONFIG_SCAN_MAX_FUNCS; ++i) {
+                if (strcmp(var_str, g_scan_func_str[i]) == 0) {
+                    break;
+                }
+            }
+
+            if (i == CONFIG_SCAN_MAX_FUNCS) {
+                fprintf(stderr, "Error: invalid scan.plugin type '%s'.\n", var_str);
+                goto out;
+            }
+
+            dev_config->scan_plugins[i] = strdup(var_str + 7);
+        } else if (sscanf((char *) buf, "scan.blank %6s %u %15s", var_str, &var_uint,
+                          var_str + 7) == 3) {
+            if (dev_config == NULL) {
+                fprintf(stderr, "Error: scan.blank specified without a device.\n");
+                goto out;
+            }
+
+            for (i = 0; i < CONFIG_SCAN_MAX_FUNCS; ++i) {
+                if (strcmp(var_str, g_scan_func_str[i]) == 0) {
+                    break;
+                }
+            }
+
+            if (i == CONFIG_SCAN_MAX_FUNCS || var_uint > 1000) {
+                fprintf(stderr, "Error: invalid scan.blank '%s %u'.\n", var_str, var_uint);
+                goto out;
+            }
+
+            if (strcmp(var_str + 7, "flag") == 0) {
+                dev_config->scan_blank_actions[i] = CONFIG_SCAN_BLANK_FLAG;
+            } else if (strcmp(var_str + 7, "drop") == 0) {
+                dev_config->scan_blank_actions[i] = CONFIG_SCAN_BLANK_DROP;
+            } else {
+                fprintf(stderr, "Error: invalid scan.blank action '%s'.\n", var_str + 7);
+                goto out;
+            }
+
+            dev_config->scan_blank_thresholds[i] = var_uint;
+        } else if (sscanf((char *) buf, "scan.hash %15s", var_str) == 1) {
+            if (dev_config == NULL) {
+                fprintf(stderr, "Error: scan.hash specified without a device.\n");
+                goto out;
+            }
+
+            if (strcmp(var_str, "xxh64") == 0) {
+                dev_config->scan_hash = CONFIG_SCAN_HASH_XXH64;
+            } else if (strcmp(var_str, "sha256") == 0) {
+                dev_config->scan_hash = CONFIG_SCAN_HASH_SHA256;
+            } else {
+                fprintf(stderr, "Error: invalid scan.hash '%s'.\n", var_str);
+                goto out;
+            }
+        } else if (sscanf((char *) buf, "scan.dedup.dir %1023s", var_str) == 1) {
+            if (dev_config == NULL) {
+                fprintf(stderr, "Error: scan.dedup.dir specified without a device.\n");
+                goto out;
+            }
+
+            dev_config->dedup_dir = strdup(var_str);
+            if (dev_config->scan_hash == CONFIG_SCAN_HASH_NONE) {
+                dev_config->scan_hash = CONFIG_SCAN_HASH_XXH64;
+            }
+        } else if (sscanf((char *) buf, "scan.output %6s %15s", var_str, var_str + 7) == 2) {
+            if (dev_config == NULL) {
+                fprintf(stderr, "Error: scan.output specified without a device.\n");
+                goto out;
+            }
+
+            for (i = 0; i < CONFIG_SCAN_MAX_FUNCS; ++i) {
+                if (strcmp(var_str, g_scan_func_str[i]) == 0) {
+                    break;
+                }
+            }
+
+            if (i == CONFIG_SCAN_MAX_FUNCS) {
+                fprintf(stderr, "Error: invalid scan.output type '%s'.\n", var_str);
+                goto out;
+            }
+
+            if (strcmp(var_str + 7, "jpeg") == 0) {
+                dev_config->scan_outputs[i] = CONFIG_SCAN_OUTPUT_JPEG;
+            } else if (strcmp(var_str + 7, "pdf") == 0) {
+                dev_config->scan_outputs[i] = CONFIG_SCAN_OUTPUT_PDF;
+            } else {
+                fprintf(stderr, "Error: invalid scan.output format '%s'.\n", var_str + 7);
+                goto out;
+            }
+        } else if (sscanf((char *) buf, "scan.func %6s %1016[^\n]", var_str, var_str + 7) == 2) {
             if (dev_config == NULL) {
                 fprintf(stderr, "Error: scan.param specified without a device.\n");
                 goto out;
@@ -7,6 +7,7 @@
 #ifndef BROTHER_CONFIG_H
 #define BROTHER_CONFIG_H
 
+#include <stdbool.h>
 #include <sys/queue.h>
 
 #define CONFIG_HOSTNAME_LENGTH 16
@@ -16,9 +17,26 @@
 #define CONFIG_SCAN_FUNC_OCR 1
 #define CONFIG_SCAN_FUNC_EMAIL 2
 #define CONFIG_SCAN_FUNC_FILE 3
+#define CONFIG_SCAN_OUTPUT_JPEG 0
+#define CONFIG_SCAN_OUTPUT_PDF 1
+#define CONFIG_SCAN_HASH_NONE 0
+#define CONFIG_SCAN_HASH_XXH64 1
+#define CONFIG_SCAN_HASH_SHA256 2
+#define CONFIG_SCAN_BLANK_NONE 0
+#define CONFIG_SCAN_BLANK_FLAG 1
+#define CONFIG_SCAN_BLANK_DROP 2
 #define CONFIG_NETWORK_DEFAULT_TIMEOUT_SEC 3
 #define CONFIG_NETWORK_DEFAULT_PAGE_INIT_TIMEOUT 5
 #define CONFIG_NETWORK_DEFAULT_PAGE_FINISH_TIMEOUT 20
+#define CONFIG_NETWORK_DEFAULT_BUFFER_SIZE (128 * 1024)
+#define CONFIG_NETWORK_MIN_BUFFER_SIZE (64 * 1024)
+#define CONFIG_NETWORK_MAX_BUFFER_SIZE (1024 * 1024)
+#define CONFIG_HOOK_DEFAULT_CONCURRENCY 1
+#define CONFIG_HOOK_DEFAULT_QUEUE_SIZE 16
+#define CONFIG_SPOOL_DEFAULT_MEMORY_BUDGET (64 * 1024 * 1024)
+#define CONFIG_BUTTON_MAX_THREADS 16
+#define CONFIG_MAX_WORKERS 32
+#define CONFIG_DEFAULT_STARTUP_TIMEOUT_SEC 10
 
 struct scan_param {
     char id;
@@ -31,13 +49,41 @@ struct device_config {
     unsigned timeout;
     unsigned page_init_timeout;
     unsigned page_finish_timeout;
+    /* cut the page timeouts down to what the device needed before */
+    bool adaptive_timeout;
+    unsigned buffer_size;
+    /* move chunk payload from the socket to the spool with splice() */
+    bool splice;
+    unsigned spool_memory_limit;
     struct scan_param scan_params[CONFIG_SCAN_MAX_PARAMS];
     char *scan_funcs[CONFIG_SCAN_MAX_FUNCS];
+    char *scan_plugins[CONFIG_SCAN_MAX_FUNCS];
+    unsigned scan_outputs[CONFIG_SCAN_MAX_FUNCS];
+    unsigned scan_blank_actions[CONFIG_SCAN_MAX_FUNCS];
+    /* max. per mille of the page with any content for it to be blank */
+    unsigned scan_blank_thresholds[CONFIG_SCAN_MAX_FUNCS];
+    unsigned scan_hash;
+    char *dedup_dir;
     TAILQ_ENTRY(device_config) tailq;
 };
 
 struct brother_config {
     char hostname[CONFIG_HOSTNAME_LENGTH];
+    unsigned reactor_threads;
+    /* threads doing the page file work for the above, 0 for as many */
+    unsigned reactor_io_threads;
+    unsigned button_threads;
+    unsigned workers;
+    unsigned startup_timeout;
+    unsigned hook_concurrency[CONFIG_SCAN_MAX_FUNCS];
+    unsigned hook_queue_size;
+    /* drop the hooks that don't fit in the queue instead of keeping them */
+    bool hook_queue_drop;
+    unsigned spool_memory_budget;
+    unsigned spool_writer_buffers;
+    unsigned spool_writer_sync;
+    /* NULL if the negotiated scan params aren't remembered */
+    char *profile_cache;
     TAILQ_HEAD(, device_config) devices;
 };
 
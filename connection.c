@@ -4,6 +4,7 @@
  * that can be found in the LICENSE file.
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdatomic.h>
 #include <stdio.h>
@@ -11,8 +12,11 @@
 #include <stdbool.h>
 #include <memory.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <poll.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
 
 #include "connection.h"
 #include "log.h"
@@ -32,10 +36,11 @@ create_socket(struct brother_conn *conn, unsigned timeout_sec)
 {
     int one = 1;
 
+    /* the hooks mustn't keep our connections open */
     if (conn->type == BROTHER_CONNECTION_TYPE_UDP) {
-        conn->fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        conn->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
     } else {
-        conn->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+        conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_IP);
         conn->is_stream = true;
     }
 
@@ -102,7 +107,7 @@ int
 brother_conn_reconnect(struct brother_conn *conn, in_addr_t dest_addr,
                   in_port_t dest_port)
 {
-    int retries;
+    int flags, rc;
 
     if (conn->connected) {
         close(conn->fd);
@@ -122,21 +127,29 @@ brother_conn_reconnect(struct brother_conn *conn, in_addr_t dest_addr,
     conn->sin_oth.sin_addr.s_addr = dest_addr;
     conn->sin_oth.sin_family = AF_INET;
     conn->sin_oth.sin_port = dest_port;
+    /* even a failed connect leaves the socket unusable for another one */
+    conn->connected = true;
 
-    for (retries = 0; retries < 3; ++retries) {
-        usleep(1000 * 25);
-        if (connect(conn->fd, (struct sockaddr *)&conn->sin_oth,
-                    sizeof(conn->sin_oth)) == 0) {
-            break;
+    if (conn->type == BROTHER_CONNECTION_TYPE_UDP) {
+        rc = connect(conn->fd, (struct sockaddr *)&conn->sin_oth,
+                     sizeof(conn->sin_oth));
+    } else {
+        /* don't wait for the handshake, the fd gets readable once it's done */
+        flags = fcntl(conn->fd, F_GETFL);
+        fcntl(conn->fd, F_SETFL, flags | O_NONBLOCK);
+        rc = connect(conn->fd, (struct sockaddr *)&conn->sin_oth,
+                     sizeof(conn->sin_oth));
+        if (rc != 0 && errno == EINPROGRESS) {
+            rc = 0;
         }
+        fcntl(conn->fd, F_SETFL, flags);
     }
 
-    if (retries == 3) {
+    if (rc != 0) {
         perror("connect");
         return -1;
     }
 
-    conn->connected = true;
     return 0;
 }
 
@@ -176,7 +189,7 @@ brother_conn_sendto(struct brother_conn *conn, const void *buf, size_t len,
 int
 brother_conn_poll(struct brother_conn *conn, unsigned timeout_sec)
 {
-    struct pollfd pfd = {};
+    struct pollfd pfd = { 0 };
     int rc;
 
     pfd.fd = conn->fd;
@@ -254,6 +267,152 @@ brother_conn_receive(struct brother_conn *conn, void *buf, size_t len)
     return (int) recv_bytes;
 }
 
+/**
+ * Non-blocking scatter receive for bulk data. Returns -1 with errno set
+ * to EAGAIN if there's nothing to read.
+ */
+int
+brother_conn_receive_iov(struct brother_conn *conn, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg = { 0 };
+    ssize_t recv_bytes;
+
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (size_t) iovcnt;
+
+    do {
+        recv_bytes = recvmsg(conn->fd, &msg, MSG_DONTWAIT);
+    } while (recv_bytes < 0 && errno == EINTR);
+
+    if (recv_bytes < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("recvmsg");
+        }
+        return -1;
+    }
+
+    return (int) recv_bytes;
+}
+
+int
+brother_conn_receive_batch(struct brother_conn *conn, struct brother_datagram *msgs,
+                           unsigned count)
+{
+    struct mmsghdr hdrs[BROTHER_CONN_MAX_BATCH] = { 0 };
+    struct sockaddr_in addrs[BROTHER_CONN_MAX_BATCH];
+    struct iovec iovs[BROTHER_CONN_MAX_BATCH];
+    unsigned i;
+    int rc;
+
+    if (count > BROTHER_CONN_MAX_BATCH) {
+        count = BROTHER_CONN_MAX_BATCH;
+    }
+
+    for (i = 0; i < count; ++i) {
+        iovs[i].iov_base = msgs[i].buf;
+        iovs[i].iov_len = msgs[i].len;
+        hdrs[i].msg_hdr.msg_iov = &iovs[i];
+        hdrs[i].msg_hdr.msg_iovlen = 1;
+        hdrs[i].msg_hdr.msg_name = &addrs[i];
+        hdrs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+    }
+
+    do {
+        rc = recvmmsg(conn->fd, hdrs, count, MSG_DONTWAIT, NULL);
+    } while (rc < 0 && errno == EINTR);
+
+    if (rc < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("recvmmsg");
+            return -1;
+        }
+        return 0;
+    }
+
+    for (i = 0; i < (unsigned) rc; ++i) {
+        msgs[i].len = hdrs[i].msg_len;
+        msgs[i].addr = addrs[i].sin_addr.s_addr;
+        msgs[i].port = addrs[i].sin_port;
+    }
+
+    return rc;
+}
+
+int
+brother_conn_send_batch(struct brother_conn *conn, const struct brother_datagram *msgs,
+                        unsigned count)
+{
+    struct mmsghdr hdrs[BROTHER_CONN_MAX_BATCH] = { 0 };
+    struct sockaddr_in addrs[BROTHER_CONN_MAX_BATCH] = { 0 };
+    struct iovec iovs[BROTHER_CONN_MAX_BATCH];
+    unsigned i, sent = 0;
+    int rc;
+
+    if (count > BROTHER_CONN_MAX_BATCH) {
+        count = BROTHER_CONN_MAX_BATCH;
+    }
+
+    for (i = 0; i < count; ++i) {
+        iovs[i].iov_base = msgs[i].buf;
+        iovs[i].iov_len = msgs[i].len;
+        addrs[i].sin_family = AF_INET;
+        addrs[i].sin_addr.s_addr = msgs[i].addr;
+        addrs[i].sin_port = msgs[i].port;
+        hdrs[i].msg_hdr.msg_iov = &iovs[i];
+        hdrs[i].msg_hdr.msg_iovlen = 1;
+        hdrs[i].msg_hdr.msg_name = &addrs[i];
+        hdrs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+    }
+
+    while (sent < count) {
+        rc = sendmmsg(conn->fd, hdrs + sent, count - sent, 0);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("sendmmsg");
+            break;
+        }
+
+        sent += (unsigned) rc;
+    }
+
+    return (int) sent;
+}
+
+int
+brother_conn_set_reuseport(struct brother_conn *conn, unsigned num_socks)
+{
+    /* pick the socket by the sender's address, so it's always the same one */
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t) (SKF_NET_OFF + 12)),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, num_socks),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+    int one = 1;
+
+    if (setsockopt(conn->fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+        perror("setsockopt SO_REUSEPORT");
+        return -1;
+    }
+
+    if (setsockopt(conn->fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog,
+                   sizeof(prog)) != 0) {
+        /* the kernel will still spread the datagrams, just not by the address */
+        perror("setsockopt SO_ATTACH_REUSEPORT_CBPF");
+    }
+
+    return 0;
+}
+
+unsigned
+brother_conn_reuseport_index(in_addr_t addr, unsigned num_socks)
+{
+    /* must match the steering program above */
+    return ntohl(addr) % num_socks;
+}
+
 int
 brother_conn_get_client_ip(struct brother_conn *conn, char ip[16])
 {
@@ -263,6 +422,18 @@ brother_conn_get_client_ip(struct brother_conn *conn, char ip[16])
     return ret != NULL ? 0 : -1;
 }
 
+in_addr_t
+brother_conn_get_client_addr(struct brother_conn *conn)
+{
+    return conn->sin_oth.sin_addr.s_addr;
+}
+
+in_port_t
+brother_conn_get_client_port(struct brother_conn *conn)
+{
+    return conn->sin_oth.sin_port;
+}
+
 int
 brother_conn_get_local_ip(struct brother_conn *conn, char ip[16])
 {
@@ -279,6 +450,12 @@ brother_conn_get_local_ip(struct brother_conn *conn, char ip[16])
     return ret != NULL ? 0 : -1;
 }
 
+int
+brother_conn_get_fd(struct brother_conn *conn)
+{
+    return conn->fd;
+}
+
 void
 brother_conn_close(struct brother_conn *conn)
 {
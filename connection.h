@@ -5,6 +5,7 @@
  */
 
 #include <netinet/in.h>
+#include <sys/uio.h>
 
 #ifndef BROTHER_CONNECTION_H
 #define BROTHER_CONNECTION_H
@@ -14,10 +15,28 @@ enum brother_connection_type {
     BROTHER_CONNECTION_TYPE_TCP,
 };
 
+#define BROTHER_CONN_MAX_BATCH 32
+
 struct brother_conn;
 
+struct brother_datagram {
+    void *buf;
+    /* size of buf, or the length of the received datagram */
+    size_t len;
+    /* sender or destination, in network byte order */
+    in_addr_t addr;
+    in_port_t port;
+};
+
 struct brother_conn *brother_conn_open(enum brother_connection_type type, unsigned timeout_sec);
 int brother_conn_bind(struct brother_conn *conn, in_port_t local_port);
+
+/**
+ * Connect to the given address, replacing the previous connection if any.
+ * TCP connections are established in the background: the fd gets readable
+ * once the peer sends something or the connection fails, with the error
+ * reported by the next receive. Call again to retry after a failure.
+ */
 int brother_conn_reconnect(struct brother_conn *conn, in_addr_t dest_addr,
                       in_port_t dest_port);
 int brother_conn_poll(struct brother_conn *conn, unsigned timeout_sec);
@@ -25,8 +44,39 @@ int brother_conn_send(struct brother_conn *conn, const void *buf, size_t len);
 int brother_conn_sendto(struct brother_conn *conn, const void *buf, size_t len,
                    in_addr_t dest_addr, in_port_t dest_port);
 int brother_conn_receive(struct brother_conn *conn, void *buf, size_t len);
+int brother_conn_receive_iov(struct brother_conn *conn, struct iovec *iov, int iovcnt);
+
+/**
+ * Receive up to count datagrams without blocking. Returns the number of
+ * datagrams received, 0 if there were none, or -1 on error.
+ */
+int brother_conn_receive_batch(struct brother_conn *conn, struct brother_datagram *msgs,
+                               unsigned count);
+
+/**
+ * Send each datagram to its own address. Returns the number of datagrams sent.
+ */
+int brother_conn_send_batch(struct brother_conn *conn, const struct brother_datagram *msgs,
+                            unsigned count);
+
+/**
+ * Let num_socks sockets bind to the same port, with incoming datagrams
+ * steered by the sender's address. Must be called before binding.
+ */
+int brother_conn_set_reuseport(struct brother_conn *conn, unsigned num_socks);
+
+/**
+ * Index of the socket, in the order they were bound, that receives the
+ * datagrams sent from addr when num_socks sockets share the port.
+ */
+unsigned brother_conn_reuseport_index(in_addr_t addr, unsigned num_socks);
+
 int brother_conn_get_client_ip(struct brother_conn *conn, char ip[16]);
+/* address and port of the last received datagram's sender, in network byte order */
+in_addr_t brother_conn_get_client_addr(struct brother_conn *conn);
+in_port_t brother_conn_get_client_port(struct brother_conn *conn);
 int brother_conn_get_local_ip(struct brother_conn *conn, char ip[16]);
+int brother_conn_get_fd(struct brother_conn *conn);
 void brother_conn_close(struct brother_conn *conn);
 
 #endif //BROTHER_CONNECTION_H
@@ -4,7 +4,9 @@
  * that can be found in the LICENSE file.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <fcntl.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -13,33 +15,116 @@
 #include <memory.h>
 #include <zconf.h>
 #include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
 #include "data_channel.h"
 
+#include "adaptive_timeout.h"
 #include "connection.h"
 #include "event_thread.h"
+#include "spool.h"
+#include "ring_buf.h"
+#include "hook.h"
+#include "io_worker.h"
+#include "plugin.h"
+#include "pdf.h"
+#include "hash.h"
+#include "jpeg_blank.h"
+#include "profile_cache.h"
 #include "log.h"
 
 #define DATA_CHANNEL_CHUNK_MAX_SIZE 0x10000
 #define DATA_CHANNEL_CHUNK_HEADER_SIZE 0xC
+#define DATA_CHANNEL_PAGE_END_HEADER_SIZE 0xA
 #define DATA_CHANNEL_CHUNK_MAX_PROGRESS 0x1000
 #define DATA_CHANNEL_LOCAL_PORT 49424
 #define DATA_CHANNEL_TARGET_PORT 54921
+#define DATA_CHANNEL_OUTPUT_DIR "."
+#define DATA_CHANNEL_CONNECT_ATTEMPTS 10
+/* doubled after every failed attempt, up to the max. That's ~3s in total */
+#define DATA_CHANNEL_CONNECT_RETRY_MS 10
+#define DATA_CHANNEL_CONNECT_MAX_RETRY_MS 1000
+/* page size estimates are in 1/65536 of the raw image size */
+#define DATA_CHANNEL_SIZE_RATIO_ONE 65536
+#define DATA_CHANNEL_MAX_PAGE_ESTIMATE (256 * 1024 * 1024)
 
 struct data_channel {
     struct brother_conn *conn;
     int (*process_cb)(struct data_channel *data_channel);
 
-    FILE *tempfile;
+    struct spool *spool;
+    /* set while a multi-page document is being received */
+    struct pdf_writer *pdf;
+    char doc_filename[64];
 
     struct data_channel_page_data {
         int id;
         int remaining_chunk_bytes;
+        /* plugin consuming this page, if any */
+        struct plugin *plugin;
+        struct brother_plugin_page plugin_page;
+        struct hash hash;
+        size_t bytes;
+        /* 0 if unknown */
+        size_t estimated_bytes;
+        size_t raw_bytes;
     } page_data;
 
+    /* the file work at the end of a page, done by an io worker */
+    struct data_channel_page_end {
+        struct io_job job;
+        /* set while the worker has it, the channel is suspended meanwhile */
+        bool busy;
+        char digest[HASH_MAX_STR_LEN];
+        bool has_digest;
+        /* unused with pdf output */
+        char filename[64];
+        int blank;
+        bool dropped;
+        /* 1 if the page was a duplicate, -1 on error */
+        int rc;
+    } page_end;
+
+    /* frame header bytes received so far */
+    uint8_t header_buf[DATA_CHANNEL_CHUNK_HEADER_SIZE];
+    size_t header_len;
+    struct ring_buf ring;
+
+    /* set if the chunk payload is spliced to the spool instead of read */
+    bool splice;
+    /* socket -> spool, opened on the first spliced page */
+    int splice_pipe[2];
+
     unsigned scanned_pages;
+    unsigned scanned_docs;
+    /* pages received since the last connect */
+    unsigned batch_pages;
+    unsigned connect_attempts;
+    /* the button was pressed again before the session ended */
+    bool kick_pending;
+
+    /* NULL unless network.timeout.adaptive is set */
+    struct adaptive_timeout *timeout;
+    uint64_t wait_start_ms;
+    /* set if the current wait has a learned deadline */
+    bool wait_learned;
+
+    /* what the scanner agreed to the last time, NULL if not cached */
+    struct profile_cache_ref profile;
+    /* copy of the cached profile, all zeroes if there's none */
+    struct profile_cache_data profile_data;
+    /* reply to the scan params the scanner sent the last time */
+    uint8_t prebuilt_params[256];
+    size_t prebuilt_params_len;
+    /* compressed to raw page size as seen so far, 0 until the first page */
+    unsigned size_ratio;
     struct event_thread *thread;
 
     struct scan_param params[CONFIG_SCAN_MAX_PARAMS];
+    struct plugin *plugins[CONFIG_SCAN_MAX_FUNCS];
     uint8_t buf[2048];
 
     const struct device_config *config;
@@ -56,22 +141,91 @@ struct data_packet_header {
 };
 
 static int receive_initial_data(struct data_channel *data_channel);
+static int receive_data(struct data_channel *data_channel);
+static int receive_spooled_data(struct data_channel *data_channel);
+static int receive_page_end(struct data_channel *data_channel);
+static int exchange_params1(struct data_channel *data_channel);
+static int exchange_params2(struct data_channel *data_channel);
 
 static int
 set_paused(struct data_channel *data_channel)
 {
     event_thread_pause(data_channel->thread);
-    sleep(1);
     return 0;
 }
 
+static int init_connection(struct data_channel *data_channel);
+
 static void
 data_channel_pause(struct data_channel *data_channel)
 {
+    if (data_channel->kick_pending) {
+        LOG_DEBUG("%s: the button was pressed meanwhile, reconnecting.\n",
+                  data_channel->config->ip);
+        data_channel->kick_pending = false;
+        data_channel->process_cb = init_connection;
+        return;
+    }
+
     LOG_DEBUG("%s: going to sleep.\n", data_channel->config->ip);
     data_channel->process_cb = set_paused;
 }
 
+static uint64_t
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+/* process_cb will be called once there's data to read or timeout_ms passes */
+static void
+data_channel_wait(struct data_channel *data_channel,
+                  int (*process_cb)(struct data_channel *data_channel),
+                  unsigned timeout_ms)
+{
+    data_channel->process_cb = process_cb;
+    data_channel->wait_start_ms = now_ms();
+    data_channel->wait_learned = false;
+    event_thread_wait_fd(data_channel->thread,
+                         brother_conn_get_fd(data_channel->conn),
+                         timeout_ms);
+}
+
+/* wait with a deadline learned from the previous pages, if there's any */
+static void
+data_channel_wait_adaptive(struct data_channel *data_channel,
+                           int (*process_cb)(struct data_channel *data_channel),
+                           enum adaptive_timeout_type type, unsigned timeout_sec)
+{
+    unsigned max_ms = timeout_sec * 1000, timeout_ms = max_ms;
+    unsigned min_ms = data_channel->config->timeout * 1000;
+
+    if (data_channel->timeout != NULL) {
+        timeout_ms = adaptive_timeout_get(data_channel->timeout, type, max_ms);
+        if (timeout_ms < min_ms) {
+            timeout_ms = min_ms < max_ms ? min_ms : max_ms;
+        }
+    }
+
+    data_channel_wait(data_channel, process_cb, timeout_ms);
+    data_channel->wait_learned = timeout_ms < max_ms;
+}
+
+static unsigned
+data_channel_waited_ms(struct data_channel *data_channel)
+{
+    return (unsigned) (now_ms() - data_channel->wait_start_ms);
+}
+
+static bool
+data_channel_readable(struct data_channel *data_channel)
+{
+    return event_thread_fd_revents(data_channel->thread) != 0;
+}
+
 static struct scan_param *
 get_scan_param_by_index(struct data_channel *data_channel, uint8_t index)
 {
@@ -95,6 +249,57 @@ get_scan_param_by_id(struct data_channel *data_channel, char id)
     return ret;
 }
 
+/* index of the negotiated scan function, or -1 */
+static int
+get_scan_func(struct data_channel *data_channel)
+{
+    struct scan_param *param;
+    int i;
+
+    param = get_scan_param_by_id(data_channel, 'F');
+    for (i = 0; i < CONFIG_SCAN_MAX_FUNCS; ++i) {
+        if (strcmp(param->value, g_scan_func_str[i]) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static bool
+is_pdf_output(struct data_channel *data_channel)
+{
+    int func = get_scan_func(data_channel);
+
+    return func >= 0 &&
+           data_channel->config->scan_outputs[func] == CONFIG_SCAN_OUTPUT_PDF;
+}
+
+static void
+get_page_info(struct data_channel *data_channel, struct pdf_page_info *info)
+{
+    struct scan_param *param;
+    unsigned tmp[2];
+
+    memset(info, 0, sizeof(*info));
+
+    param = get_scan_param_by_id(data_channel, 'R');
+    if (sscanf(param->value, "%u,%u", &info->dpi_x, &info->dpi_y) != 2) {
+        info->dpi_x = info->dpi_y = 0;
+    }
+
+    /* scan area in pixels, as confirmed by the scanner */
+    param = get_scan_param_by_id(data_channel, 'A');
+    if (sscanf(param->value, "%u,%u,%u,%u", &tmp[0], &tmp[1], &info->width,
+               &info->height) != 4) {
+        info->width = info->height = 0;
+    }
+
+    /* all color modes start with 'C', e.g. CGRAY or C256 */
+    param = get_scan_param_by_id(data_channel, 'M');
+    info->components = param->value[0] == 'C' ? 3 : 1;
+}
+
 static int
 read_scan_params(struct data_channel *data_channel, uint8_t *buf, uint8_t *buf_end,
                  const char *whitelist)
@@ -167,16 +372,531 @@ write_scan_params(struct data_channel *data_channel, uint8_t *buf,
     return buf;
 }
 
+static void
+data_channel_reset_page_data(struct data_channel *data_channel)
+{
+    memset(&data_channel->page_data, 0, sizeof(data_channel->page_data));
+}
+
+static void
+plugin_start_page(struct data_channel *data_channel, unsigned page_id)
+{
+    struct brother_plugin_page *page = &data_channel->page_data.plugin_page;
+    struct plugin *plugin;
+    int func;
+
+    func = get_scan_func(data_channel);
+    if (func < 0 || (plugin = data_channel->plugins[func]) == NULL) {
+        return;
+    }
+
+    page->config = data_channel->config;
+    page->params = data_channel->params;
+    page->func = g_scan_func_str[func];
+    page->page_id = page_id;
+
+    if (plugin_page_start(plugin, page) != 0) {
+        LOG_WARN("%s: plugin rejected page %u\n", data_channel->config->ip, page_id);
+        return;
+    }
+
+    data_channel->page_data.plugin = plugin;
+}
+
+static void
+plugin_feed_page(struct data_channel *data_channel, const void *data, size_t len)
+{
+    struct plugin *plugin = data_channel->page_data.plugin;
+
+    if (plugin == NULL) {
+        return;
+    }
+
+    if (plugin_page_data(plugin, &data_channel->page_data.plugin_page, data, len) != 0) {
+        LOG_WARN("%s: plugin failed to process page %u\n", data_channel->config->ip,
+                 data_channel->page_data.plugin_page.page_id);
+        data_channel->page_data.plugin = NULL;
+    }
+}
+
+/* path is NULL if the page was not received */
+static void
+plugin_end_page(struct data_channel *data_channel, const char *path)
+{
+    struct plugin *plugin = data_channel->page_data.plugin;
+
+    if (plugin == NULL) {
+        return;
+    }
+
+    data_channel->page_data.plugin = NULL;
+    data_channel->page_data.plugin_page.path = path;
+    if (plugin_page_end(plugin, &data_channel->page_data.plugin_page) != 0) {
+        LOG_WARN("%s: plugin failed to finish page %u\n", data_channel->config->ip,
+                 data_channel->page_data.plugin_page.page_id);
+    }
+}
+
+/*
+ * Check if nothing needs to see the payload of the page being started,
+ * so it can be moved to the spool with splice().
+ */
+static bool
+can_splice_page(struct data_channel *data_channel)
+{
+    if (!data_channel->config->splice || data_channel->pdf ||
+        data_channel->page_data.plugin ||
+        data_channel->config->scan_hash != CONFIG_SCAN_HASH_NONE) {
+        return false;
+    }
+
+    if (data_channel->splice_pipe[0] < 0 &&
+        pipe2(data_channel->splice_pipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+        LOG_WARN("%s: cannot create a pipe for splice: %s\n",
+                 data_channel->config->ip, strerror(errno));
+        data_channel->splice_pipe[0] = data_channel->splice_pipe[1] = -1;
+        return false;
+    }
+
+    return true;
+}
+
+static void
+close_splice_pipe(struct data_channel *data_channel)
+{
+    if (data_channel->splice_pipe[0] < 0) {
+        return;
+    }
+
+    close(data_channel->splice_pipe[0]);
+    close(data_channel->splice_pipe[1]);
+    data_channel->splice_pipe[0] = data_channel->splice_pipe[1] = -1;
+}
+
+static int
+write_page_data(struct data_channel *data_channel, const void *data, size_t len)
+{
+    if (data_channel->pdf) {
+        return pdf_writer_page_data(data_channel->pdf, data, len);
+    }
+
+    return spool_write(data_channel->spool, data, len);
+}
+
+static void
+run_hook(const struct device_config *config, int func, const char *path,
+         const char *const *env)
+{
+    if (func < 0 || config->scan_funcs[func] == NULL) {
+        return;
+    }
+
+    if (hook_submit(func, config->scan_funcs[func], config->ip, path, env) != 0) {
+        LOG_ERR("%s: couldn't queue user hook.\n", config->ip);
+    }
+}
+
+/* a finished pdf, handed over to an io worker */
+struct data_channel_document {
+    struct io_job job;
+    const struct device_config *config;
+    int func;
+    struct pdf_writer *pdf;
+    struct spool *spool;
+    char filename[64];
+};
+
+static void
+save_document(struct data_channel_document *doc)
+{
+    unsigned pages;
+    int rc = -1;
+
+    pages = pdf_writer_page_count(doc->pdf);
+    if (pages > 0 && pdf_writer_finish(doc->pdf) == 0) {
+        rc = spool_publish(doc->spool, doc->filename);
+    }
+
+    pdf_writer_free(doc->pdf);
+    spool_close(doc->spool);
+
+    if (pages == 0) {
+        return;
+    }
+
+    if (rc != 0) {
+        LOG_ERR("Cannot create file '%s' on data_channel %s\n",
+                doc->filename, doc->config->ip);
+        return;
+    }
+
+    LOG_INFO("%s: successfully received document %s (%u pages)\n",
+             doc->config->ip, doc->filename, pages);
+    run_hook(doc->config, doc->func, doc->filename, NULL);
+}
+
+static void
+save_document_io(void *arg)
+{
+    struct data_channel_document *doc = arg;
+
+    save_document(doc);
+    free(doc);
+}
+
+/* publish the pdf with all pages received so far */
+static void
+data_channel_finish_document(struct data_channel *data_channel)
+{
+    struct data_channel_document *doc, local_doc;
+
+    if (data_channel->pdf == NULL) {
+        return;
+    }
+
+    doc = calloc(1, sizeof(*doc));
+    if (doc == NULL) {
+        LOG_WARN("%s: failed to calloc document job, saving it in place.\n",
+                 data_channel->config->ip);
+        doc = &local_doc;
+    }
+
+    doc->config = data_channel->config;
+    doc->func = get_scan_func(data_channel);
+    doc->pdf = data_channel->pdf;
+    doc->spool = data_channel->spool;
+    snprintf(doc->filename, sizeof(doc->filename), "%s", data_channel->doc_filename);
+    data_channel->pdf = NULL;
+    data_channel->spool = NULL;
+
+    if (doc == &local_doc) {
+        save_document(doc);
+        return;
+    }
+
+    /* nothing waits for it, the worker frees it */
+    doc->job.fn = save_document_io;
+    doc->job.arg = doc;
+    doc->job.done_fd = -1;
+    io_worker_submit(&doc->job);
+}
+
+/*
+ * Publish the page, or just link the identical one from the page
+ * store. Returns 1 if the page was a duplicate.
+ */
+static int
+publish_page(struct data_channel *data_channel, const char *filename,
+             const char *digest)
+{
+    const char *store_dir = data_channel->config->dedup_dir;
+    char store_path[PATH_MAX];
+    int rc;
+
+    if (store_dir == NULL || digest == NULL) {
+        return spool_publish(data_channel->spool, filename);
+    }
+
+    rc = snprintf(store_path, sizeof(store_path), "%s/%s.jpg", store_dir,
+                  hash_str_hex(digest));
+    if (rc < 0 || (size_t) rc >= sizeof(store_path)) {
+        return spool_publish(data_channel->spool, filename);
+    }
+
+    /* the digest may collide, only the same bytes make a duplicate */
+    if (spool_equals(data_channel->spool, store_path) &&
+        spool_link(store_path, filename) == 0) {
+        return 1;
+    }
+
+    rc = spool_publish(data_channel->spool, filename);
+    if (rc == 0 && link(filename, store_path) != 0 && errno != EEXIST) {
+        LOG_WARN("%s: cannot add '%s' to the page store: %s\n",
+                 data_channel->config->ip, filename, strerror(errno));
+    }
+
+    return rc;
+}
+
+/*
+ * Check if the page that was just received is blank. Returns 1 if
+ * it is, 0 if it's not, or -1 if it wasn't checked.
+ */
+static int
+check_blank_page(struct data_channel *data_channel)
+{
+    struct jpeg_blank_stats stats;
+    const void *data;
+    size_t offset = 0, len;
+    unsigned threshold;
+    int func, rc;
+
+    func = get_scan_func(data_channel);
+    if (func < 0 ||
+        data_channel->config->scan_blank_actions[func] == CONFIG_SCAN_BLANK_NONE) {
+        return -1;
+    }
+
+    if (data_channel->pdf &&
+        pdf_writer_page_offset(data_channel->pdf, &offset) != 0) {
+        return -1;
+    }
+
+    data = spool_map(data_channel->spool, offset, &len);
+    if (data == NULL) {
+        return -1;
+    }
+
+    rc = jpeg_blank_analyze(data, len, &stats);
+    spool_unmap(data, len);
+    if (rc != 0) {
+        LOG_WARN("%s: cannot check if page %u is blank\n", data_channel->config->ip,
+                 data_channel->page_data.id);
+        return -1;
+    }
+
+    threshold = data_channel->config->scan_blank_thresholds[func];
+    LOG_DEBUG("%s: page %u has %u/%u content blocks, background %u\n",
+              data_channel->config->ip, data_channel->page_data.id,
+              stats.content_blocks, stats.blocks, stats.background);
+    return (uint64_t) stats.content_blocks * 1000 <= (uint64_t) stats.blocks * threshold;
+}
+
+static bool
+is_blank_page_dropped(struct data_channel *data_channel, int blank)
+{
+    int func = get_scan_func(data_channel);
+
+    return blank == 1 && func >= 0 &&
+           data_channel->config->scan_blank_actions[func] == CONFIG_SCAN_BLANK_DROP;
+}
+
+static void
+data_channel_abort_page(struct data_channel *data_channel)
+{
+    if (data_channel->pdf) {
+        /* keep the pages that were received completely */
+        plugin_end_page(data_channel, NULL);
+        data_channel_reset_page_data(data_channel);
+        data_channel_finish_document(data_channel);
+        return;
+    }
+
+    if (data_channel->spool) {
+        spool_close(data_channel->spool);
+        data_channel->spool = NULL;
+    }
+
+    plugin_end_page(data_channel, NULL);
+    data_channel_reset_page_data(data_channel);
+}
+
+/* the raw image size of the page, 0 if the scan params don't tell */
+static size_t
+get_raw_page_size(struct data_channel *data_channel)
+{
+    struct pdf_page_info info;
+    uint64_t size;
+
+    get_page_info(data_channel, &info);
+    size = (uint64_t) info.width * info.height * info.components;
+    return size < DATA_CHANNEL_MAX_PAGE_ESTIMATE * (uint64_t) DATA_CHANNEL_SIZE_RATIO_ONE ?
+           (size_t) size : 0;
+}
+
+static unsigned
+get_default_size_ratio(struct data_channel *data_channel)
+{
+    struct scan_param *param = get_scan_param_by_id(data_channel, 'C');
+
+    if (param == NULL || strcmp(param->value, "JPEG") == 0) {
+        return DATA_CHANNEL_SIZE_RATIO_ONE / 10;
+    }
+
+    if (strcmp(param->value, "RLENGTH") == 0) {
+        return DATA_CHANNEL_SIZE_RATIO_ONE / 2;
+    }
+
+    return DATA_CHANNEL_SIZE_RATIO_ONE;
+}
+
+/*
+ * Guess the size of the page about to be received: the average of the
+ * previous pages with the same scan params if they're cached, otherwise
+ * its raw size times the ratio learned from the previous pages.
+ */
+static size_t
+estimate_page_size(struct data_channel *data_channel)
+{
+    unsigned ratio = data_channel->size_ratio;
+    uint64_t size;
+
+    if (data_channel->profile_data.pages > 0) {
+        size = data_channel->profile_data.page_bytes;
+    } else {
+        if (ratio == 0) {
+            ratio = get_default_size_ratio(data_channel);
+        }
+        size = (uint64_t) data_channel->page_data.raw_bytes * ratio /
+               DATA_CHANNEL_SIZE_RATIO_ONE;
+    }
+
+    return size < DATA_CHANNEL_MAX_PAGE_ESTIMATE ? (size_t) size :
+           DATA_CHANNEL_MAX_PAGE_ESTIMATE;
+}
+
+/* correct the size estimates with the actual size of a received page */
+static void
+update_size_ratio(struct data_channel *data_channel, size_t bytes,
+                  size_t estimated_bytes, size_t raw_bytes)
+{
+    uint64_t ratio;
+
+    if (estimated_bytes > 0) {
+        LOG_DEBUG("%s: page of %zu bytes, estimated %zu (%+ld%%)\n",
+                  data_channel->config->ip, bytes, estimated_bytes,
+                  ((long) estimated_bytes - (long) bytes) * 100 / (long) (bytes + 1));
+    }
+
+    if (raw_bytes == 0) {
+        return;
+    }
+
+    ratio = (uint64_t) bytes * DATA_CHANNEL_SIZE_RATIO_ONE / raw_bytes;
+    if (ratio > DATA_CHANNEL_SIZE_RATIO_ONE) {
+        ratio = DATA_CHANNEL_SIZE_RATIO_ONE;
+    }
+
+    if (data_channel->size_ratio == 0) {
+        data_channel->size_ratio = ratio > 0 ? (unsigned) ratio : 1;
+    } else {
+        /* a moving average, the pages of one device differ too */
+        data_channel->size_ratio = (unsigned) ((data_channel->size_ratio * 3 + ratio) / 4);
+        if (data_channel->size_ratio == 0) {
+            data_channel->size_ratio = 1;
+        }
+    }
+}
+
+/* the file work of the page end, possibly on an io worker */
+static void
+save_page_io(void *arg)
+{
+    struct data_channel *data_channel = arg;
+    struct data_channel_page_end *page_end = &data_channel->page_end;
+
+    page_end->blank = check_blank_page(data_channel);
+    page_end->dropped = is_blank_page_dropped(data_channel, page_end->blank);
+    page_end->rc = 0;
+
+    if (page_end->dropped) {
+        if (data_channel->pdf) {
+            pdf_writer_drop_page(data_channel->pdf);
+        } else {
+            spool_close(data_channel->spool);
+            data_channel->spool = NULL;
+        }
+        return;
+    }
+
+    if (data_channel->pdf) {
+        page_end->rc = pdf_writer_end_page(data_channel->pdf) == 0 ? 0 : -1;
+        return;
+    }
+
+    page_end->rc = publish_page(data_channel, page_end->filename,
+                                page_end->has_digest ? page_end->digest : NULL);
+    spool_close(data_channel->spool);
+    data_channel->spool = NULL;
+}
+
+/* the rest of the page end, back on the channel's thread */
+static int
+complete_page(struct data_channel *data_channel)
+{
+    struct data_channel_page_end *page_end = &data_channel->page_end;
+    char hash_env[sizeof(page_end->digest) + 32], dup_env[32], blank_env[32];
+    const char *env[4] = { NULL };
+    const char **env_tail = env;
+    unsigned page_id = data_channel->page_data.id;
+    size_t page_bytes = data_channel->page_data.bytes;
+    size_t estimated_bytes = data_channel->page_data.estimated_bytes;
+    size_t raw_bytes = data_channel->page_data.raw_bytes;
+    int rc = page_end->rc;
+
+    data_channel->page_data.plugin_page.blank = page_end->blank;
+    if (page_end->dropped) {
+        plugin_end_page(data_channel, NULL);
+        data_channel_reset_page_data(data_channel);
+        LOG_INFO("%s: dropped blank page %u\n", data_channel->config->ip, page_id);
+        goto out;
+    }
+
+    if (data_channel->pdf) {
+        if (rc != 0) {
+            LOG_ERR("%s: cannot add page %u to '%s'\n", data_channel->config->ip,
+                    page_id, data_channel->doc_filename);
+            return -1;
+        }
+
+        data_channel->scanned_pages++;
+        plugin_end_page(data_channel, data_channel->doc_filename);
+        data_channel_reset_page_data(data_channel);
+        LOG_INFO("%s: successfully received page %u\n",
+                 data_channel->config->ip, page_id);
+        goto out;
+    }
+
+    plugin_end_page(data_channel, rc >= 0 ? page_end->filename : NULL);
+    data_channel_reset_page_data(data_channel);
+    if (rc < 0) {
+        LOG_ERR("Cannot create file '%s' on data_channel %s\n", page_end->filename,
+                data_channel->config->ip);
+        return -1;
+    }
+
+    if (rc == 1) {
+        LOG_INFO("%s: received page %u, a duplicate of %s\n",
+                 data_channel->config->ip, page_id, page_end->digest);
+    } else {
+        LOG_INFO("%s: successfully received page %u\n",
+                 data_channel->config->ip, page_id);
+    }
+
+    if (page_end->has_digest) {
+        snprintf(hash_env, sizeof(hash_env), "BROTHER_PAGE_HASH=%s", page_end->digest);
+        snprintf(dup_env, sizeof(dup_env), "BROTHER_PAGE_DUPLICATE=%d", rc == 1);
+        *env_tail++ = hash_env;
+        *env_tail++ = dup_env;
+    }
+
+    if (page_end->blank >= 0) {
+        snprintf(blank_env, sizeof(blank_env), "BROTHER_PAGE_BLANK=%d", page_end->blank);
+        *env_tail++ = blank_env;
+    }
+
+    run_hook(data_channel->config, get_scan_func(data_channel), page_end->filename, env);
+
+out:
+    data_channel->batch_pages++;
+    update_size_ratio(data_channel, page_bytes, estimated_bytes, raw_bytes);
+    if (data_channel->profile.entry != NULL) {
+        profile_cache_add_page(&data_channel->profile, page_bytes);
+        profile_cache_load(&data_channel->profile, &data_channel->profile_data);
+    }
+    return 0;
+}
+
+/*
+ * Returns 0 if the page is done, or 2 if it's being saved by an io
+ * worker and the channel must wait for page_end.job.done_fd.
+ */
 static int
 process_page_end_header(struct data_channel *data_channel,
                         struct data_packet_header *header,
                         uint32_t payload_len)
 {
-    FILE *destfile;
-    struct scan_param *param;
-    char filename[64];
-    size_t size;
-    int i, rc;
+    struct data_channel_page_end *page_end = &data_channel->page_end;
 
     if (header->page_id != data_channel->page_data.id) {
         LOG_ERR("%s: packet page_id mismatch (got %u, expected %u)\n",
@@ -185,47 +905,54 @@ process_page_end_header(struct data_channel *data_channel,
         return -1;
     }
 
-    sprintf(filename, "scan%u.jpg", data_channel->scanned_pages++);
-    destfile = fopen(filename, "w");
-    if (destfile == NULL) {
-        LOG_ERR("Cannot create file '%s' on data_channel %s\n", filename,
-                data_channel->config->ip);
-        return -1;
+    page_end->has_digest = hash_final(&data_channel->page_data.hash, page_end->digest,
+                                      sizeof(page_end->digest)) == 0;
+    data_channel->page_data.plugin_page.digest =
+        page_end->has_digest ? page_end->digest : NULL;
+    if (data_channel->pdf == NULL) {
+        snprintf(page_end->filename, sizeof(page_end->filename), "scan%u.jpg",
+                 data_channel->scanned_pages++);
     }
 
-    fseek(data_channel->tempfile, 0, SEEK_SET);
-    while ((size = fread(data_channel->buf, 1, sizeof(data_channel->buf),
-                         data_channel->tempfile))) {
-        fwrite(data_channel->buf, 1, size, destfile);
+    if (page_end->job.done_fd < 0) {
+        page_end->job.done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
     }
 
-    fclose(destfile);
-    fclose(data_channel->tempfile);
-    data_channel->tempfile = NULL;
-
-    data_channel->process_cb = receive_initial_data;
-    LOG_INFO("%s: successfully received page %u\n",
-             data_channel->config->ip, header->page_id);
+    if (page_end->job.done_fd < 0) {
+        /* nothing to wait on, save it in place */
+        save_page_io(data_channel);
+        return complete_page(data_channel);
+    }
 
-    param = get_scan_param_by_id(data_channel, 'F');
-    for (i = 0; i < CONFIG_SCAN_MAX_FUNCS; ++i) {
-        if (strcmp(param->value, g_scan_func_str[i]) == 0) {
-            break;
-        }
+    page_end->job.fn = save_page_io;
+    page_end->job.arg = data_channel;
+    if (io_worker_submit(&page_end->job) == 1) {
+        return complete_page(data_channel);
     }
 
-    rc = snprintf((char *) data_channel->buf, sizeof(data_channel->buf), "%s %s %s",
-                  data_channel->config->scan_funcs[i], data_channel->config->ip,
-                  filename);
-    if (rc < 0 || rc == sizeof(data_channel->buf)) {
-        LOG_ERR("%s: couldn't execute user hook. snprintf failed: %d\n",
-                data_channel->config->ip, errno);
-        return -1;
+    page_end->busy = true;
+    return 2;
+}
+
+/* wait for the io worker to finish with the page, if it's still at it */
+static void
+wait_page_end(struct data_channel *data_channel)
+{
+    struct pollfd pfd = { 0 };
+    uint64_t cnt;
+
+    if (!data_channel->page_end.busy) {
+        return;
     }
 
-    system((char *) data_channel->buf);
+    pfd.fd = data_channel->page_end.job.done_fd;
+    pfd.events = POLLIN;
+    while (poll(&pfd, 1, -1) < 0 && errno == EINTR);
 
-    return 0;
+    if (read(pfd.fd, &cnt, sizeof(cnt)) < 0) {
+        LOG_ERR("%s: failed to read the page end fd.\n", data_channel->config->ip);
+    }
+    data_channel->page_end.busy = false;
 }
 
 static int
@@ -233,8 +960,9 @@ process_chunk_header(struct data_channel *data_channel,
                      struct data_packet_header *header,
                      uint32_t payload_len)
 {
+    struct pdf_page_info info;
     int progress_percent;
-    int total_chunk_size;
+    unsigned total_chunk_size;
 
     if (payload_len < 2) {
         LOG_ERR("%s: payload too small (%u/2 bytes)\n",
@@ -242,10 +970,52 @@ process_chunk_header(struct data_channel *data_channel,
         return -1;
     }
 
-    if (data_channel->page_data.id == 0) {
-        LOG_INFO("%s: now scanning page id %u\n", data_channel->config->ip,
-                 header->page_id);
-        data_channel->page_data.id = header->page_id;
+    if (data_channel->page_data.id == 0) {
+        LOG_INFO("%s: now scanning page id %u\n", data_channel->config->ip,
+                 header->page_id);
+        data_channel->page_data.id = header->page_id;
+
+        if (data_channel->spool == NULL) {
+            data_channel->spool = spool_open(DATA_CHANNEL_OUTPUT_DIR,
+                                             data_channel->config->spool_memory_limit);
+            if (data_channel->spool == NULL) {
+                LOG_ERR("Cannot create temp file on data_channel %s\n",
+                        data_channel->config->ip);
+                return -1;
+            }
+
+            if (is_pdf_output(data_channel)) {
+                data_channel->pdf = pdf_writer_create(data_channel->spool);
+                if (data_channel->pdf == NULL) {
+                    LOG_ERR("Cannot start a pdf document on data_channel %s\n",
+                            data_channel->config->ip);
+                    return -1;
+                }
+
+                sprintf(data_channel->doc_filename, "scan%u.pdf",
+                        data_channel->scanned_docs++);
+            }
+        }
+
+        if (data_channel->pdf) {
+            get_page_info(data_channel, &info);
+            if (pdf_writer_begin_page(data_channel->pdf, &info) != 0) {
+                return -1;
+            }
+        }
+
+        data_channel->page_data.raw_bytes = get_raw_page_size(data_channel);
+        data_channel->page_data.estimated_bytes = estimate_page_size(data_channel);
+        if (data_channel->page_data.estimated_bytes > 0) {
+            /* a little more, growing the file at the end would be worse */
+            spool_preallocate(data_channel->spool, spool_size(data_channel->spool) +
+                              data_channel->page_data.estimated_bytes +
+                              data_channel->page_data.estimated_bytes / 8);
+        }
+
+        hash_init(&data_channel->page_data.hash, data_channel->config->scan_hash);
+        plugin_start_page(data_channel, header->page_id);
+        data_channel->splice = can_splice_page(data_channel);
     } else if (header->page_id != data_channel->page_data.id) {
         LOG_ERR("%s: packet page_id mismatch (packet %u != local %u)\n",
                 data_channel->config->ip, header->page_id, data_channel->page_data.id);
@@ -258,7 +1028,8 @@ process_chunk_header(struct data_channel *data_channel,
 
     data_channel->page_data.remaining_chunk_bytes = header->payload[0] |
             (header->payload[1] << 8);
-    total_chunk_size = data_channel->page_data.remaining_chunk_bytes +
+    data_channel->page_data.bytes += (size_t) data_channel->page_data.remaining_chunk_bytes;
+    total_chunk_size = (unsigned) data_channel->page_data.remaining_chunk_bytes +
                        DATA_CHANNEL_CHUNK_HEADER_SIZE;
 
     if (total_chunk_size > DATA_CHANNEL_CHUNK_MAX_SIZE) {
@@ -309,9 +1080,6 @@ process_header(struct data_channel *data_channel, uint8_t *buf, uint32_t buf_len
         break;
     case 0x82:
         rc = process_page_end_header(data_channel, &header, payload_len);
-        if (rc == 0) {
-            rc = 1;
-        }
         break;
     default:
         LOG_ERR("%s: received unsupported header (id = %u)\n",
@@ -322,134 +1090,398 @@ process_header(struct data_channel *data_channel, uint8_t *buf, uint32_t buf_len
     return rc;
 }
 
+static size_t
+get_frame_header_size(uint8_t id)
+{
+    switch (id) {
+    case 0x64:
+        return DATA_CHANNEL_CHUNK_HEADER_SIZE;
+    case 0x82:
+        return DATA_CHANNEL_PAGE_END_HEADER_SIZE;
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Decode all frames currently held in the ring. Chunk payload is
+ * written straight from the ring, only the headers are copied aside
+ * as they may be split across reads. Returns 1 at the end of batch, or
+ * 2 if a page is being saved by an io worker.
+ */
 static int
-process_data(struct data_channel *data_channel, uint8_t *buf, int msg_len)
+process_data(struct data_channel *data_channel)
 {
-    int old_rem_chunk_bytes, rc;
+    struct ring_buf *ring = &data_channel->ring;
+    uint8_t *data;
+    size_t len, header_size;
+    int rc;
 
-    if (data_channel->page_data.remaining_chunk_bytes < msg_len) {
-        /* chunk header might be somewhere inside this packet */
+    while ((len = ring_buf_peek(ring, &data)) > 0) {
         if (data_channel->page_data.remaining_chunk_bytes > 0) {
-            /* chunk header is in the middle of this packet */
-            old_rem_chunk_bytes = data_channel->page_data.remaining_chunk_bytes;
-
-            /* process up to chunk header */
-            rc = process_data(data_channel, buf,
-                              data_channel->page_data.remaining_chunk_bytes);
-            if (rc != 0) {
-                return rc;
+            if (len > (size_t) data_channel->page_data.remaining_chunk_bytes) {
+                len = (size_t) data_channel->page_data.remaining_chunk_bytes;
+            }
+
+            if (write_page_data(data_channel, data, len) != 0) {
+                return -1;
+            }
+
+            hash_update(&data_channel->page_data.hash, data, len);
+            plugin_feed_page(data_channel, data, len);
+
+            data_channel->page_data.remaining_chunk_bytes -= (int) len;
+            ring_buf_consume(ring, len);
+            continue;
+        }
+
+        if (data_channel->header_len == 0) {
+            if (data_channel->page_data.id == 0 && data[0] == 0x80) {
+                /* no more documents to scan */
+                ring_buf_consume(ring, 1);
+                return 1;
             }
 
-            buf += old_rem_chunk_bytes;
-            msg_len -= old_rem_chunk_bytes;
+            data_channel->header_buf[0] = data[0];
         }
 
-        rc = process_header(data_channel, buf, msg_len);
-        if (rc == 1) {
-            return 0;
-        } else if (rc != 0) {
+        header_size = get_frame_header_size(data_channel->header_buf[0]);
+        if (header_size == 0) {
+            if (data_channel->page_data.id == 0) {
+                LOG_ERR("%s: device unavailable (error code %u)\n",
+                        data_channel->config->ip, data[0]);
+            } else {
+                LOG_ERR("%s: received unsupported header (id = %u)\n",
+                        data_channel->config->ip, data_channel->header_buf[0]);
+            }
+            return -1;
+        }
+
+        if (len > header_size - data_channel->header_len) {
+            len = header_size - data_channel->header_len;
+        }
+
+        memcpy(data_channel->header_buf + data_channel->header_len, data, len);
+        data_channel->header_len += len;
+        ring_buf_consume(ring, len);
+
+        if (data_channel->header_len < header_size) {
+            continue;
+        }
+
+        data_channel->header_len = 0;
+        rc = process_header(data_channel, data_channel->header_buf,
+                            (uint32_t) header_size);
+        if (rc < 0) {
             LOG_ERR("%s: couldn't parse header\n",
                     data_channel->config->ip);
             return -1;
         }
 
-        buf += DATA_CHANNEL_CHUNK_HEADER_SIZE;
-        msg_len -= DATA_CHANNEL_CHUNK_HEADER_SIZE;
+        if (rc == 2) {
+            /* the rest stays in the ring until the page is saved */
+            return 2;
+        }
     }
 
-    fwrite(buf, sizeof(*buf), (size_t) msg_len, data_channel->tempfile);
-    data_channel->page_data.remaining_chunk_bytes -= msg_len;
-
     return 0;
 }
 
+/*
+ * Move the rest of the current chunk payload from the socket to the
+ * spool through a pipe. Returns the number of bytes moved, 0 if there
+ * was nothing to read, or -1 on error.
+ */
 static int
-receive_data(struct data_channel *data_channel)
+splice_payload(struct data_channel *data_channel)
 {
-    int msg_len;
-    int rc;
+    size_t len = (size_t) data_channel->page_data.remaining_chunk_bytes;
+    ssize_t rc;
 
-    if (data_channel->tempfile != NULL &&
-        data_channel->page_data.remaining_chunk_bytes == 0) {
+    rc = splice(brother_conn_get_fd(data_channel->conn), NULL,
+                data_channel->splice_pipe[1], NULL, len,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return 0;
     }
 
-    /* waiting for the sensor rail to return */
-    rc = brother_conn_poll(data_channel->conn, data_channel->config->page_finish_timeout);
     if (rc <= 0) {
-        LOG_ERR("Couldn't receive final data packet on data_channel %s\n",
+        LOG_ERR("Failed to splice data packet on data_channel %s\n",
                 data_channel->config->ip);
         return -1;
     }
 
-    msg_len = brother_conn_receive(data_channel->conn, data_channel->buf,
-                                   sizeof(data_channel->buf));
-    if (msg_len < 1) {
-        LOG_ERR("Failed to receive data packet on data_channel %s\n",
-                data_channel->config->ip);
+    if (spool_splice(data_channel->spool, data_channel->splice_pipe[0],
+                     (size_t) rc) != 0) {
+        /* don't leave the rest in the pipe for the next page */
+        close_splice_pipe(data_channel);
         return -1;
     }
 
-    rc = process_data(data_channel, data_channel->buf, msg_len);
-    if (rc != 0) {
-        LOG_ERR("Couldn't process data packet on data_channel %s\n",
-                data_channel->config->ip);
-        return -1;
+    data_channel->page_data.remaining_chunk_bytes -= (int) rc;
+    return (int) rc;
+}
+
+/* shorten the iovecs to len bytes in total. Returns the new iovcnt */
+static int
+limit_iov(struct iovec *iov, int iovcnt, size_t len)
+{
+    if (iov[0].iov_len >= len || iovcnt == 1) {
+        if (iov[0].iov_len > len) {
+            iov[0].iov_len = len;
+        }
+        return 1;
+    }
+
+    if (iov[1].iov_len > len - iov[0].iov_len) {
+        iov[1].iov_len = len - iov[0].iov_len;
+    }
+    return 2;
+}
+
+/*
+ * Drain the socket into the ring and decode it, up to one ring
+ * worth of data per wakeup so other channels get their turn.
+ *
+ * When splicing, only the frame headers go through the ring. Reading
+ * up to the size of a chunk header can't reach into any payload, as
+ * every chunk payload is preceded by a full chunk header.
+ */
+static int
+receive_frames(struct data_channel *data_channel)
+{
+    struct ring_buf *ring = &data_channel->ring;
+    struct iovec iov[2];
+    size_t total_len = 0;
+    int iovcnt, msg_len, rc;
+
+    do {
+        if (data_channel->splice && data_channel->page_data.remaining_chunk_bytes > 0) {
+            /* the ring is empty, process_data() consumed it all */
+            msg_len = splice_payload(data_channel);
+            if (msg_len < 0) {
+                return -1;
+            }
+
+            if (msg_len == 0) {
+                break;
+            }
+
+            total_len += (size_t) msg_len;
+            continue;
+        }
+
+        /* anything left in the ring was held back by a page end */
+        if (ring_buf_len(ring) == 0) {
+            iovcnt = ring_buf_get_free_iov(ring, iov);
+            if (data_channel->splice) {
+                iovcnt = limit_iov(iov, iovcnt, DATA_CHANNEL_CHUNK_HEADER_SIZE -
+                                   data_channel->header_len);
+            }
+
+            /* the disk can't keep up, leave the data in the socket until it does */
+            if (data_channel->spool &&
+                !spool_writable(data_channel->spool,
+                                iov[0].iov_len + (iovcnt > 1 ? iov[1].iov_len : 0))) {
+                data_channel->process_cb = receive_spooled_data;
+                event_thread_wait_fd(data_channel->thread,
+                                     spool_wait_fd(data_channel->spool),
+                                     data_channel->config->page_finish_timeout * 1000);
+                return 0;
+            }
+
+            msg_len = brother_conn_receive_iov(data_channel->conn, iov, iovcnt);
+            if (msg_len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+
+            if (msg_len < 1) {
+                LOG_ERR("Failed to receive data packet on data_channel %s\n",
+                        data_channel->config->ip);
+                return -1;
+            }
+
+            ring_buf_produce(ring, (size_t) msg_len);
+            total_len += (size_t) msg_len;
+        }
+
+        rc = process_data(data_channel);
+        if (rc < 0) {
+            LOG_ERR("Couldn't process data packet on data_channel %s\n",
+                    data_channel->config->ip);
+            return -1;
+        }
+
+        if (rc == 1) {
+            data_channel_finish_document(data_channel);
+            data_channel_pause(data_channel);
+            return 0;
+        }
+
+        if (rc == 2) {
+            /* the socket isn't read meanwhile, so the next page has to wait */
+            data_channel->process_cb = receive_page_end;
+            event_thread_wait_fd(data_channel->thread, data_channel->page_end.job.done_fd,
+                                 data_channel->config->page_finish_timeout * 1000);
+            return 0;
+        }
+    } while (total_len < ring->size);
+
+    if (data_channel->page_data.id == 0 && data_channel->header_len == 0) {
+        if (data_channel->batch_pages == 0) {
+            /* the first page may take long to feed, whatever the params */
+            data_channel_wait(data_channel, receive_initial_data,
+                              data_channel->config->page_init_timeout * 1000);
+        } else {
+            data_channel_wait_adaptive(data_channel, receive_initial_data,
+                                       ADAPTIVE_TIMEOUT_PAGE_GAP,
+                                       data_channel->config->page_init_timeout);
+        }
+    } else {
+        /* a page cut short is lost, so never guess within one */
+        data_channel_wait(data_channel, receive_data,
+                          data_channel->config->page_finish_timeout * 1000);
     }
 
     return 0;
 }
 
-static void
-data_channel_reset_page_data(struct data_channel *data_channel)
+static int
+receive_data(struct data_channel *data_channel)
 {
-    memset(&data_channel->page_data, 0, sizeof(data_channel->page_data));
+    /* waiting for the sensor rail to return */
+    if (!data_channel_readable(data_channel)) {
+        LOG_ERR("Couldn't receive final data packet on data_channel %s\n",
+                data_channel->config->ip);
+        return -1;
+    }
+
+    return receive_frames(data_channel);
 }
 
 static int
-receive_initial_data(struct data_channel *data_channel)
+receive_page_end(struct data_channel *data_channel)
 {
-    int msg_len = 0, rc;
+    if (!data_channel_readable(data_channel)) {
+        /* the worker still has the page, there's no taking it back */
+        LOG_WARN("%s: still saving page %u\n", data_channel->config->ip,
+                 data_channel->page_data.id);
+        event_thread_wait_fd(data_channel->thread, data_channel->page_end.job.done_fd,
+                             data_channel->config->page_finish_timeout * 1000);
+        return 0;
+    }
 
-    rc = brother_conn_poll(data_channel->conn, data_channel->config->page_init_timeout);
-    if (rc <= 0) {
-        /* no more documents to scan */
-        data_channel_pause(data_channel);
+    wait_page_end(data_channel);
+    if (complete_page(data_channel) != 0) {
         return -1;
     }
 
-    msg_len = brother_conn_receive(data_channel->conn, data_channel->buf,
-                              sizeof(data_channel->buf));
-    if (msg_len < 1) {
-        LOG_ERR("Couldn't receive initial data packet on data_channel %s\n",
+    return receive_frames(data_channel);
+}
+
+static int
+receive_spooled_data(struct data_channel *data_channel)
+{
+    if (!data_channel_readable(data_channel)) {
+        LOG_ERR("%s: the spool writer didn't catch up in time\n",
                 data_channel->config->ip);
         return -1;
     }
 
-    if (msg_len == 1 && data_channel->buf[0] == 0x80) {
+    return receive_frames(data_channel);
+}
+
+static int
+receive_initial_data(struct data_channel *data_channel)
+{
+    unsigned waited_ms = data_channel_waited_ms(data_channel);
+
+    if (!data_channel_readable(data_channel)) {
+        if (data_channel->wait_learned) {
+            LOG_INFO("%s: no page within the learned %u ms, ending the batch.\n",
+                     data_channel->config->ip, waited_ms);
+            /*
+             * The device normally ends a batch itself, so this one was
+             * slower than learned. Count it, or the deadline would only
+             * ever shrink.
+             */
+            adaptive_timeout_add_sample(data_channel->timeout,
+                                        ADAPTIVE_TIMEOUT_PAGE_GAP, waited_ms);
+        }
+
         /* no more documents to scan */
+        data_channel_finish_document(data_channel);
         data_channel_pause(data_channel);
-        return 0;
+        return -1;
     }
 
-    data_channel_reset_page_data(data_channel);
-    data_channel->tempfile = tmpfile();
-    if (data_channel->tempfile == NULL) {
-        LOG_ERR("Cannot create temp file on data_channel %s\n",
-                data_channel->config->ip);
-        return -1;
+    if (data_channel->timeout != NULL && data_channel->batch_pages > 0) {
+        adaptive_timeout_add_sample(data_channel->timeout,
+                                    ADAPTIVE_TIMEOUT_PAGE_GAP, waited_ms);
     }
 
-    rc = process_data(data_channel, data_channel->buf, msg_len);
-    if (rc != 0) {
-        LOG_ERR("Couldn't process initial data packet on data_channel %s\n",
-                data_channel->config->ip);
-        fclose(data_channel->tempfile);
-        data_channel->tempfile = NULL;
-        return -1;
+    return receive_frames(data_channel);
+}
+
+/* the response to the final scan params, returns the end of the message */
+static uint8_t *
+write_final_params(struct data_channel *data_channel, uint8_t *buf)
+{
+    *buf++ = 0x1b; // magic sequence
+    *buf++ = 0x58; // packet id (?)
+    *buf++ = 0x0a; // header end
+
+    buf = write_scan_params(data_channel, buf, "RMCJBNADGL");
+    *buf++ = 0x80; // end of message
+    return buf;
+}
+
+/*
+ * Build the response to the final scan params the scanner sent the last
+ * time, while it's still preparing them. It's only used if they match.
+ */
+static void
+prebuild_final_params(struct data_channel *data_channel)
+{
+    const int32_t *scan_params = data_channel->profile_data.scan_params;
+    struct scan_param *resolution, *area;
+    struct scan_param saved_resolution, saved_area;
+
+    data_channel->prebuilt_params_len = 0;
+    if (scan_params[0] == 0) {
+        return;
     }
 
-    data_channel->process_cb = receive_data;
-    return 0;
+    resolution = get_scan_param_by_id(data_channel, 'R');
+    area = get_scan_param_by_id(data_channel, 'A');
+    saved_resolution = *resolution;
+    saved_area = *area;
+
+    snprintf(resolution->value, sizeof(resolution->value), "%d,%d",
+             scan_params[0], scan_params[1]);
+    snprintf(area->value, sizeof(area->value), "0,0,%d,%d",
+             scan_params[4], scan_params[6]);
+    data_channel->prebuilt_params_len =
+        (size_t) (write_final_params(data_channel, data_channel->prebuilt_params) -
+                  data_channel->prebuilt_params);
+
+    *resolution = saved_resolution;
+    *area = saved_area;
+}
+
+static bool
+is_profile_matched(const int32_t scan_params[PROFILE_CACHE_NUM_SCAN_PARAMS],
+                   long recv_params[PROFILE_CACHE_NUM_SCAN_PARAMS])
+{
+    unsigned i;
+
+    for (i = 0; i < PROFILE_CACHE_NUM_SCAN_PARAMS; ++i) {
+        if (scan_params[i] != recv_params[i]) {
+            return false;
+        }
+    }
+
+    return true;
 }
 
 static int
@@ -457,13 +1489,13 @@ exchange_params2(struct data_channel *data_channel)
 {
     struct scan_param *param;
     uint8_t *buf, *buf_end;
-    long recv_params[7];
+    long recv_params[PROFILE_CACHE_NUM_SCAN_PARAMS];
+    bool profile_matched;
     int msg_len, rc;
     size_t i, len;
     long tmp;
 
-    rc = brother_conn_poll(data_channel->conn, 3);
-    if (rc <= 0) {
+    if (!data_channel_readable(data_channel)) {
         LOG_ERR("Couldn't receive scan params on data_channel %s\n",
                 data_channel->config->ip);
         return -1;
@@ -524,6 +1556,17 @@ exchange_params2(struct data_channel *data_channel)
         return -1;
     }
 
+    profile_matched = data_channel->prebuilt_params_len > 0 &&
+                      is_profile_matched(data_channel->profile_data.scan_params,
+                                         recv_params);
+    if (data_channel->profile.entry != NULL && !profile_matched) {
+        for (i = 0; i < PROFILE_CACHE_NUM_SCAN_PARAMS; ++i) {
+            data_channel->profile_data.scan_params[i] = (int32_t) recv_params[i];
+        }
+        profile_cache_set_scan_params(&data_channel->profile,
+                                      data_channel->profile_data.scan_params);
+    }
+
     param = get_scan_param_by_id(data_channel, 'R');
     assert(param);
 
@@ -545,30 +1588,32 @@ exchange_params2(struct data_channel *data_channel)
     assert(param);
     sprintf(param->value, "0,0,%ld,%ld", recv_params[4], recv_params[6]);
 
-    /* prepare a response */
-    buf = data_channel->buf;
-    *buf++ = 0x1b; // magic sequence
-    *buf++ = 0x58; // packet id (?)
-    *buf++ = 0x0a; // header end
-
-    buf = write_scan_params(data_channel, buf, "RMCJBNADGL");
-    if (buf == NULL) {
-        LOG_ERR("Failed to write scan params on data_channel %s\n",
-                data_channel->config->ip);
-        return -1;
+    if (profile_matched) {
+        /* just like the last time, the response is ready */
+        LOG_DEBUG("%s: scan params match the cached profile.\n",
+                  data_channel->config->ip);
+        len = data_channel->prebuilt_params_len;
+        msg_len = brother_conn_send(data_channel->conn, data_channel->prebuilt_params, len);
+    } else {
+        len = (size_t) (write_final_params(data_channel, data_channel->buf) -
+                        data_channel->buf);
+        msg_len = brother_conn_send(data_channel->conn, data_channel->buf, len);
     }
 
-    *buf++ = 0x80; // end of message
-
-    msg_len = brother_conn_send(data_channel->conn, data_channel->buf, buf -
-                           data_channel->buf);
-    if (msg_len < 0 || (unsigned) msg_len != buf - data_channel->buf) {
+    if (msg_len < 0 || (size_t) msg_len != len) {
         LOG_ERR("Couldn't send scan params on data_channel %s\n",
                 data_channel->config->ip);
         return -1;
     }
 
-    data_channel->process_cb = receive_initial_data;
+    if (data_channel->timeout != NULL) {
+        adaptive_timeout_select(data_channel->timeout,
+                                get_scan_param_by_id(data_channel, 'R')->value,
+                                get_scan_param_by_id(data_channel, 'M')->value);
+    }
+
+    data_channel_wait(data_channel, receive_initial_data,
+                      data_channel->config->page_init_timeout * 1000);
     return 0;
 }
 
@@ -581,8 +1626,7 @@ exchange_params1(struct data_channel *data_channel)
     size_t str_len;
     int i, rc;
 
-    rc = brother_conn_poll(data_channel->conn, 2);
-    if (rc <= 0) {
+    if (!data_channel_readable(data_channel)) {
         LOG_ERR("%s: couldn't receive initial scan params\n",
                 data_channel->config->ip);
         return -1;
@@ -642,19 +1686,21 @@ exchange_params1(struct data_channel *data_channel)
         memcpy(&param->value[str_len + 1], param->value, str_len);
     }
 
-    param = get_scan_param_by_id(data_channel, 'F');
-    for (i = 0; i < CONFIG_SCAN_MAX_FUNCS; ++i) {
-        if (strcmp(param->value, g_scan_func_str[i]) == 0) {
-            break;
-        }
-    }
-
-    if (i == CONFIG_SCAN_MAX_FUNCS) {
+    if (get_scan_func(data_channel) < 0) {
+        param = get_scan_param_by_id(data_channel, 'F');
         LOG_ERR("%s: received invalid scan function %s.\n",
                 data_channel->config->ip, param->value);
         return -1;
     }
 
+    if (profile_cache_get(inet_addr(data_channel->config->ip),
+                          get_scan_func(data_channel),
+                          get_scan_param_by_id(data_channel, 'R')->value,
+                          get_scan_param_by_id(data_channel, 'M')->value,
+                          &data_channel->profile) == 0) {
+        profile_cache_load(&data_channel->profile, &data_channel->profile_data);
+    }
+
     /* prepare a response */
     buf = data_channel->buf;
     *buf++ = 0x1b; // magic sequence
@@ -678,23 +1724,19 @@ exchange_params1(struct data_channel *data_channel)
         return -1;
     }
 
-    data_channel->process_cb = exchange_params2;
+    prebuild_final_params(data_channel);
+    data_channel_wait(data_channel, exchange_params2, 3000);
     return 0;
 }
 
+static int retry_connect(struct data_channel *data_channel);
+
 static int
-init_connection(struct data_channel *data_channel)
+receive_welcome(struct data_channel *data_channel)
 {
-    int rc, msg_len;
-
-    if (brother_conn_reconnect(data_channel->conn, inet_addr(data_channel->config->ip),
-                          htons(DATA_CHANNEL_TARGET_PORT)) != 0) {
-        LOG_ERR("Could not connect to scanner.\n");
-        return -1;
-    }
+    int msg_len;
 
-    rc = brother_conn_poll(data_channel->conn, 3);
-    if (rc <= 0) {
+    if (!data_channel_readable(data_channel)) {
         LOG_ERR("Couldn't receive welcome message on data_channel %s\n",
                 data_channel->config->ip);
         return -1;
@@ -702,6 +1744,12 @@ init_connection(struct data_channel *data_channel)
 
     msg_len = brother_conn_receive(data_channel->conn, data_channel->buf,
                               sizeof(data_channel->buf));
+    if (msg_len < 0 && (errno == ECONNREFUSED || errno == ECONNRESET) &&
+        data_channel->connect_attempts < DATA_CHANNEL_CONNECT_ATTEMPTS) {
+        /* the scanner might not be listening just yet */
+        return retry_connect(data_channel);
+    }
+
     if (msg_len < 1) {
         LOG_ERR("Failed to receive welcome message on data_channel %s\n",
                 data_channel->config->ip);
@@ -721,10 +1769,67 @@ init_connection(struct data_channel *data_channel)
         return -1;
     }
 
-    data_channel->process_cb = exchange_params1;
+    data_channel_wait(data_channel, exchange_params1, 2000);
+    return 0;
+}
+
+/* the scanner greets us as soon as the connection is up */
+static int
+connect_data_channel(struct data_channel *data_channel)
+{
+    data_channel->connect_attempts++;
+    if (brother_conn_reconnect(data_channel->conn, inet_addr(data_channel->config->ip),
+                               htons(DATA_CHANNEL_TARGET_PORT)) == 0) {
+        data_channel_wait(data_channel, receive_welcome,
+                          (data_channel->config->timeout + 3) * 1000);
+        return 0;
+    }
+
+    /* e.g. the previous connection from our port is still being closed */
+    return retry_connect(data_channel);
+}
+
+static int
+retry_connect(struct data_channel *data_channel)
+{
+    unsigned delay_ms = DATA_CHANNEL_CONNECT_RETRY_MS;
+    unsigned i;
+
+    if (data_channel->connect_attempts >= DATA_CHANNEL_CONNECT_ATTEMPTS) {
+        LOG_ERR("Could not connect to scanner.\n");
+        return -1;
+    }
+
+    for (i = 1; i < data_channel->connect_attempts &&
+                delay_ms < DATA_CHANNEL_CONNECT_MAX_RETRY_MS; ++i) {
+        delay_ms *= 2;
+    }
+    if (delay_ms > DATA_CHANNEL_CONNECT_MAX_RETRY_MS) {
+        delay_ms = DATA_CHANNEL_CONNECT_MAX_RETRY_MS;
+    }
+
+    data_channel->process_cb = connect_data_channel;
+    event_thread_wait_fd(data_channel->thread, -1, delay_ms);
     return 0;
 }
 
+static int
+init_connection(struct data_channel *data_channel)
+{
+    ring_buf_reset(&data_channel->ring);
+    data_channel->header_len = 0;
+    data_channel->batch_pages = 0;
+    data_channel->profile.entry = NULL;
+    memset(&data_channel->profile_data, 0, sizeof(data_channel->profile_data));
+    data_channel->prebuilt_params_len = 0;
+    data_channel_reset_page_data(data_channel);
+    /* the first page will tell if its payload can be spliced */
+    data_channel->splice = data_channel->config->splice;
+
+    data_channel->connect_attempts = 0;
+    return connect_data_channel(data_channel);
+}
+
 static void
 data_channel_loop(void *arg)
 {
@@ -736,11 +1841,7 @@ data_channel_loop(void *arg)
         LOG_ERR("%s: failed to process data. The channel will be closed.\n",
                 data_channel->config->ip);
 
-        if (data_channel->tempfile) {
-            fclose(data_channel->tempfile);
-            data_channel->tempfile = NULL;
-        }
-
+        data_channel_abort_page(data_channel);
         data_channel_pause(data_channel);
     }
 }
@@ -750,12 +1851,15 @@ data_channel_stop(void *arg)
 {
     struct data_channel *data_channel = arg;
 
-    if (data_channel->tempfile) {
-        fclose(data_channel->tempfile);
-        data_channel->tempfile = NULL;
+    wait_page_end(data_channel);
+    data_channel_abort_page(data_channel);
+    if (data_channel->page_end.job.done_fd >= 0) {
+        close(data_channel->page_end.job.done_fd);
     }
-
     brother_conn_close(data_channel->conn);
+    ring_buf_free(&data_channel->ring);
+    close_splice_pipe(data_channel);
+    adaptive_timeout_free(data_channel->timeout);
     free(data_channel);
 }
 
@@ -779,6 +1883,13 @@ init_data_channel(struct data_channel *data_channel)
         return 0;
     }
 
+    if (ring_buf_init(&data_channel->ring, data_channel->config->buffer_size) != 0) {
+        LOG_ERR("Failed to allocate a receive buffer for data_channel %s.\n",
+                data_channel->config->ip);
+        event_thread_stop(data_channel->thread);
+        return 0;
+    }
+
     memcpy(data_channel->params, data_channel->config->scan_params,
            sizeof(data_channel->config->scan_params));
 
@@ -791,8 +1902,10 @@ data_channel_kick_cb(void *arg1, void *arg2)
     struct data_channel *data_channel = arg1;
 
     if (data_channel->process_cb != set_paused) {
-        LOG_ERR("Trying to kick non-sleeping data_channel %s.\n",
-                data_channel->config->ip);
+        /* the scanner may still be finishing the previous batch, we're behind */
+        LOG_DEBUG("%s: kicked while busy, will reconnect once done.\n",
+                  data_channel->config->ip);
+        data_channel->kick_pending = true;
         return;
     }
 
@@ -827,6 +1940,7 @@ data_channel_create(struct device_config *config)
 {
     struct data_channel *data_channel;
     struct event_thread *thread;
+    int i;
 
     data_channel = calloc(1, sizeof(*data_channel));
     if (data_channel == NULL) {
@@ -836,11 +1950,36 @@ data_channel_create(struct device_config *config)
 
     data_channel->config = config;
     data_channel->process_cb = init_data_channel;
+    data_channel->splice_pipe[0] = data_channel->splice_pipe[1] = -1;
+    data_channel->page_end.job.done_fd = -1;
+
+    for (i = 0; i < CONFIG_SCAN_MAX_FUNCS; ++i) {
+        if (config->scan_plugins[i] == NULL) {
+            continue;
+        }
+
+        data_channel->plugins[i] = plugin_load(config->scan_plugins[i]);
+        if (data_channel->plugins[i] == NULL) {
+            LOG_ERR("Failed to load %s plugin for data_channel %s.\n",
+                    g_scan_func_str[i], config->ip);
+            free(data_channel);
+            return NULL;
+        }
+    }
+
+    if (config->adaptive_timeout) {
+        data_channel->timeout = adaptive_timeout_create();
+        if (data_channel->timeout == NULL) {
+            free(data_channel);
+            return NULL;
+        }
+    }
 
-    thread = event_thread_create("data_channel", data_channel_loop,
-                                 data_channel_stop, data_channel);
+    thread = event_thread_create_shared("data_channel", data_channel_loop,
+                                        data_channel_stop, data_channel);
     if (thread == NULL) {
         LOG_ERR("Failed to create data_channel thread.\n");
+        adaptive_timeout_free(data_channel->timeout);
         free(data_channel);
         return NULL;
     }
@@ -12,41 +12,99 @@
 #include <time.h>
 #include <memory.h>
 #include <stdatomic.h>
+#include <errno.h>
 #include "device_handler.h"
 #include "event_thread.h"
 #include "config.h"
 #include "connection.h"
 #include "data_channel.h"
+#include "notify.h"
 #include "snmp.h"
 #include "log.h"
 
 #define DEVICE_REGISTER_DURATION_SEC 360
+/* renewals are spread over this many seconds before the registration expires */
+#define DEVICE_REGISTER_JITTER_SEC 60
 #define DEVICE_KEEPALIVE_DURATION_SEC 5
 #define BUTTON_HANDLER_PORT 54925
+#define BUTTON_MSG_MAX_LEN 512
+#define SNMP_PORT 161
+#define SNMP_TIMEOUT_MS 3000
+
+/* the wheel must span more than SNMP_TIMEOUT_MS */
+#define TIMER_WHEEL_TICK_MS 250
+#define TIMER_WHEEL_SLOTS 16
+
+enum device_request {
+    DEVICE_REQUEST_NONE,
+    DEVICE_REQUEST_STATUS,
+    DEVICE_REQUEST_REGISTER,
+};
 
 struct device {
     in_addr_t ip;
     struct data_channel *channel;
     int status;
+    /* set once the driver was registered at least once */
+    bool registered;
     char local_ip[16];
     time_t next_ping_time;
     time_t next_register_time;
     const struct device_config *config;
     TAILQ_ENTRY(device) tailq;
+
+    /* in-flight SNMP request, at most one per device */
+    enum device_request request;
+    int request_id;
+    uint64_t request_deadline_ms;
+    TAILQ_ENTRY(device) timer_tailq;
+};
+
+/*
+ * Receives the button events on its own socket. With multiple shards,
+ * the sockets share the port and a device always reaches the same one.
+ */
+struct button_shard {
+    struct brother_conn *conn;
+    struct event_thread *thread;
+    uint8_t bufs[BROTHER_CONN_MAX_BATCH][BUTTON_MSG_MAX_LEN];
 };
 
 struct device_handler {
-    struct brother_conn *button_conn;
+    struct button_shard button_shards[CONFIG_BUTTON_MAX_THREADS];
+    unsigned num_button_shards;
+    /* SNMP requests use their own socket, so they never consume button events */
+    struct brother_conn *snmp_conn;
+    /*
+     * for encoding the requests and decoding the responses. All SNMP is
+     * done on the device handler thread, including device_handler_stop().
+     * Each request is sent right after it's encoded, and the responses
+     * are matched by request id, so no request needs it for longer.
+     */
+    uint8_t snmp_buf[1024];
     struct event_thread *thread;
     struct brother_poll_group *devices_poll_group;
     TAILQ_HEAD(, device) devices;
+
+    /* open-addressed index of the devices by their ip */
+    struct device **table;
+    size_t table_mask;
+    size_t table_count;
+
+    /* timeouts of the in-flight SNMP requests */
+    TAILQ_HEAD(, device) timer_wheel[TIMER_WHEEL_SLOTS];
+    uint64_t timer_tick;
+    unsigned seed;
+
+    /* set once every device was registered or found unreachable */
+    bool ready;
+    uint64_t startup_deadline_ms;
 };
 
 #define BUTTON_HANDLER_NETWORK_TIMEOUT 3
 
 static atomic_int g_appnum;
 static struct device_handler g_dev_handler;
-static uint8_t g_buf[1024];
 
 static char
 digit_to_hex(int n)
@@ -93,11 +151,50 @@ encode_password(const char *pass, char *buf)
     return 0;
 }
 
+static uint64_t
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+/* the local address the device can reach us at */
 static int
-register_scanner_driver(struct device *dev, char local_ip[16], bool enabled)
+get_local_ip(const char *ip, char local_ip[16])
+{
+    struct brother_conn *conn;
+    int rc;
+
+    conn = brother_conn_open(BROTHER_CONNECTION_TYPE_UDP,
+                           BUTTON_HANDLER_NETWORK_TIMEOUT);
+    if (conn == NULL) {
+        LOG_ERR("Cannot open an UDP socket for device %s.\n", ip);
+        return -1;
+    }
+
+    rc = brother_conn_reconnect(conn, inet_addr(ip), htons(161));
+    if (rc != 0) {
+        LOG_ERR("Can't connect to %s:161.\n", ip);
+        brother_conn_close(conn);
+        return -1;
+    }
+
+    rc = brother_conn_get_local_ip(conn, local_ip);
+    brother_conn_close(conn);
+    if (rc != 0) {
+        LOG_ERR("Can't get the local ip address that connected to %s:161.\n", ip);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+format_register_msgs(struct device *dev, char local_ip[16],
+                     char msg[CONFIG_SCAN_MAX_FUNCS][256], const char *functions[4])
 {
-    const char *functions[4] = { 0 };
-    char msg[CONFIG_SCAN_MAX_FUNCS][256];
     char pass_buf[9] = { 0 };
     int num_funcs = 0, i, rc;
 
@@ -106,11 +203,12 @@ register_scanner_driver(struct device *dev, char local_ip[16], bool enabled)
     }
 
     for (i = 0; i < CONFIG_SCAN_MAX_FUNCS; ++i) {
-        if (dev->config->scan_funcs[i] == NULL) {
+        if (dev->config->scan_funcs[i] == NULL &&
+            dev->config->scan_plugins[i] == NULL) {
             continue;
         }
 
-        rc = snprintf(msg[num_funcs], sizeof(msg),
+        rc = snprintf(msg[num_funcs], sizeof(msg[num_funcs]),
                       "TYPE=BR;"
                       "BUTTON=SCAN;"
                       "USER=\"%s\";"
@@ -135,49 +233,255 @@ register_scanner_driver(struct device *dev, char local_ip[16], bool enabled)
         ++num_funcs;
     }
 
-    return snmp_register_scanner_driver(g_dev_handler.button_conn, enabled,
-                                        g_buf, sizeof(g_buf), functions,
+    return 0;
+}
+
+static int
+register_scanner_driver(struct device *dev, char local_ip[16], bool enabled)
+{
+    const char *functions[4] = { 0 };
+    char msg[CONFIG_SCAN_MAX_FUNCS][256];
+
+    if (format_register_msgs(dev, local_ip, msg, functions) != 0) {
+        return -1;
+    }
+
+    return snmp_register_scanner_driver(g_dev_handler.snmp_conn, enabled,
+                                        g_dev_handler.snmp_buf,
+                                        sizeof(g_dev_handler.snmp_buf), functions,
                                         dev->ip);
 }
 
-struct device *
-device_handler_add_device(struct device_config *config)
+static void
+device_request_start(struct device *dev, enum device_request request, int request_id)
+{
+    uint64_t deadline = now_ms() + SNMP_TIMEOUT_MS;
+
+    dev->request = request;
+    dev->request_id = request_id;
+    dev->request_deadline_ms = deadline;
+    TAILQ_INSERT_TAIL(&g_dev_handler.timer_wheel[(deadline / TIMER_WHEEL_TICK_MS) %
+                      TIMER_WHEEL_SLOTS], dev, timer_tailq);
+}
+
+static void
+device_request_finish(struct device *dev)
+{
+    TAILQ_REMOVE(&g_dev_handler.timer_wheel[(dev->request_deadline_ms /
+                 TIMER_WHEEL_TICK_MS) % TIMER_WHEEL_SLOTS], dev, timer_tailq);
+    dev->request = DEVICE_REQUEST_NONE;
+}
+
+static void
+device_send_status(struct device *dev)
+{
+    int request_id;
+
+    if (snmp_send_printer_status(g_dev_handler.snmp_conn, g_dev_handler.snmp_buf,
+                                 sizeof(g_dev_handler.snmp_buf), dev->ip,
+                                 &request_id) != 0) {
+        dev->status = -1;
+        return;
+    }
+
+    device_request_start(dev, DEVICE_REQUEST_STATUS, request_id);
+}
+
+static void
+device_send_register(struct device *dev)
+{
+    const char *functions[4] = { 0 };
+    char msg[CONFIG_SCAN_MAX_FUNCS][256];
+    int request_id;
+
+    /* there might have been no route to the device on startup */
+    if (dev->local_ip[0] == 0 && get_local_ip(dev->config->ip, dev->local_ip) != 0) {
+        dev->local_ip[0] = 0;
+        return;
+    }
+
+    if (format_register_msgs(dev, dev->local_ip, msg, functions) != 0 ||
+        snmp_send_register_scanner_driver(g_dev_handler.snmp_conn, true,
+                                          g_dev_handler.snmp_buf,
+                                          sizeof(g_dev_handler.snmp_buf), functions,
+                                          dev->ip, &request_id) != 0) {
+        LOG_ERR("Failed to register the driver at %s.\n", dev->config->ip);
+        return;
+    }
+
+    device_request_start(dev, DEVICE_REQUEST_REGISTER, request_id);
+}
+
+static void
+device_set_status(struct device *dev, int status)
+{
+    if (status == 10001 && dev->status != 10001) {
+        /* the device might have been restarted, register right away */
+        dev->next_register_time = 0;
+    }
+
+    dev->status = status;
+    if (dev->status != 10001) {
+        LOG_WARN("Warn: device at %s is currently unreachable.\n",
+                 dev->config->ip);
+    }
+}
+
+static void
+device_request_timeout(struct device *dev)
+{
+    enum device_request request = dev->request;
+
+    device_request_finish(dev);
+    if (request == DEVICE_REQUEST_STATUS) {
+        LOG_ERR("Failed to receive SNMP status reponse from %s.\n", dev->config->ip);
+        device_set_status(dev, -1);
+    } else {
+        LOG_ERR("Failed to receive SNMP register reponse from %s.\n", dev->config->ip);
+        /* retry with the next successful ping */
+        dev->next_register_time = 0;
+    }
+}
+
+static void
+expire_requests(uint64_t now)
+{
+    struct device *dev, *next;
+    uint64_t tick = now / TIMER_WHEEL_TICK_MS;
+    uint64_t t = g_dev_handler.timer_tick;
+
+    if (tick - t >= TIMER_WHEEL_SLOTS) {
+        t = tick - TIMER_WHEEL_SLOTS + 1;
+    }
+
+    for (; t <= tick; ++t) {
+        dev = TAILQ_FIRST(&g_dev_handler.timer_wheel[t % TIMER_WHEEL_SLOTS]);
+        for (; dev; dev = next) {
+            next = TAILQ_NEXT(dev, timer_tailq);
+            if (dev->request_deadline_ms <= now) {
+                device_request_timeout(dev);
+            }
+        }
+    }
+
+    /* the current tick may still hold requests that are due later */
+    g_dev_handler.timer_tick = tick;
+}
+
+/* returns the ms until the next timeout, capped at max_ms */
+static unsigned
+next_request_timeout(uint64_t now, unsigned max_ms)
 {
     struct device *dev;
-    struct brother_conn *conn;
-    int status, rc, i;
-    char local_ip[16];
+    uint64_t t, tick = now / TIMER_WHEEL_TICK_MS;
+
+    for (t = tick; t < tick + TIMER_WHEEL_SLOTS &&
+         (t - tick) * TIMER_WHEEL_TICK_MS < max_ms; ++t) {
+        TAILQ_FOREACH(dev, &g_dev_handler.timer_wheel[t % TIMER_WHEEL_SLOTS],
+                      timer_tailq) {
+            if (dev->request_deadline_ms <= now) {
+                return 0;
+            }
 
-    conn = brother_conn_open(BROTHER_CONNECTION_TYPE_UDP,
-                           BUTTON_HANDLER_NETWORK_TIMEOUT);
-    if (conn == NULL) {
-        LOG_ERR("Cannot open an UDP socket for device %s.\n", config->ip);
-        return NULL;
+            if (dev->request_deadline_ms - now < max_ms) {
+                max_ms = (unsigned) (dev->request_deadline_ms - now);
+            }
+        }
     }
 
-    rc = brother_conn_reconnect(conn, inet_addr(config->ip), htons(161));
-    if (rc != 0) {
-        LOG_ERR("Can't connect to %s:161.\n", config->ip);
-        brother_conn_close(conn);
-        return NULL;
+    return max_ms;
+}
+
+static size_t
+device_table_hash(in_addr_t ip)
+{
+    /* fibonacci hashing, the low bits of an address are the ones that vary */
+    return (size_t) ((ntohl(ip) * 2654435769u) >> 16);
+}
+
+static void
+device_table_put(struct device **table, size_t mask, struct device *dev)
+{
+    size_t i = device_table_hash(dev->ip);
+
+    while (table[i & mask] != NULL) {
+        ++i;
     }
 
-    rc = brother_conn_get_local_ip(conn, local_ip);
-    brother_conn_close(conn);
-    if (rc != 0) {
-        LOG_ERR("Can't get the local ip address that connected to %s:161.\n",
-                config->ip);
+    table[i & mask] = dev;
+}
+
+/* make room for one more device, so that the insert can't fail */
+static int
+device_table_reserve(void)
+{
+    struct device **table;
+    size_t i, size;
+
+    /* keep the load factor under 1/2 */
+    if (g_dev_handler.table == NULL ||
+        (g_dev_handler.table_count + 1) * 2 > g_dev_handler.table_mask + 1) {
+        size = g_dev_handler.table ? (g_dev_handler.table_mask + 1) * 2 : 64;
+        table = calloc(size, sizeof(*table));
+        if (table == NULL) {
+            return -1;
+        }
+
+        for (i = 0; g_dev_handler.table && i <= g_dev_handler.table_mask; ++i) {
+            if (g_dev_handler.table[i] != NULL) {
+                device_table_put(table, size - 1, g_dev_handler.table[i]);
+            }
+        }
+
+        free(g_dev_handler.table);
+        g_dev_handler.table = table;
+        g_dev_handler.table_mask = size - 1;
+    }
+
+    return 0;
+}
+
+static void
+device_table_insert(struct device *dev)
+{
+    device_table_put(g_dev_handler.table, g_dev_handler.table_mask, dev);
+    g_dev_handler.table_count++;
+}
+
+static struct device *
+find_device(in_addr_t ip)
+{
+    struct device *dev;
+    size_t i;
+
+    if (g_dev_handler.table == NULL) {
         return NULL;
+    }
 
+    for (i = device_table_hash(ip); ; ++i) {
+        dev = g_dev_handler.table[i & g_dev_handler.table_mask];
+        if (dev == NULL || dev->ip == ip) {
+            return dev;
+        }
     }
+}
+
+/*
+ * The device isn't contacted here. All devices are pinged at once by
+ * the device handler thread, and registered as soon as they respond.
+ */
+struct device *
+device_handler_add_device(struct device_config *config)
+{
+    struct device *dev;
 
-    status = snmp_get_printer_status(g_dev_handler.button_conn,
-                                     g_buf, sizeof(g_buf),
-                                     inet_addr(config->ip));
+    if (find_device(inet_addr(config->ip)) != NULL) {
+        LOG_ERR("Device at %s is configured twice.\n", config->ip);
+        return NULL;
+    }
 
-    if (status != 10001) {
-        LOG_ERR("Error: device at %s is unreachable.\n", config->ip);
-        free(dev);
+    if (device_table_reserve() != 0) {
+        LOG_ERR("Could not grow the device table for device at %s.\n", config->ip);
         return NULL;
     }
 
@@ -188,7 +492,6 @@ device_handler_add_device(struct device_config *config)
     }
 
     dev->ip = inet_addr(config->ip);
-    snprintf(dev->local_ip, sizeof(dev->local_ip), "%s", local_ip);
     dev->config = config;
     dev->channel = data_channel_create(config);
     if (dev->channel == NULL) {
@@ -197,112 +500,346 @@ device_handler_add_device(struct device_config *config)
         return NULL;
     }
 
+    device_table_insert(dev);
     TAILQ_INSERT_TAIL(&g_dev_handler.devices, dev, tailq);
     return dev;
 }
 
 static void
-device_handler_loop(void *arg)
+handle_snmp_response(struct device *dev, int msg_len)
 {
+    int request_id, value, rc;
+
+    rc = snmp_decode_response(g_dev_handler.snmp_buf, (size_t) msg_len,
+                              &request_id, &value);
+    if (dev->request == DEVICE_REQUEST_NONE || request_id != dev->request_id) {
+        LOG_DEBUG("Ignoring a stale SNMP response from %s.\n", dev->config->ip);
+        return;
+    }
+
+    if (rc != 0) {
+        LOG_ERR("Received invalid SNMP response from %s.\n", dev->config->ip);
+        DUMP_ERR(g_dev_handler.snmp_buf, (size_t) msg_len);
+    }
+
+    if (dev->request == DEVICE_REQUEST_STATUS) {
+        device_request_finish(dev);
+        device_set_status(dev, rc == 0 ? value : -1);
+        return;
+    }
+
+    device_request_finish(dev);
+    if (rc != 0) {
+        dev->next_register_time = 0;
+    } else {
+        dev->registered = true;
+    }
+}
+
+/*
+ * Receive the next pending datagram of a socket without blocking.
+ * Returns its length, or -1 if there's nothing to read.
+ */
+static int
+receive_datagram(struct brother_conn *conn, uint8_t *buf, size_t buf_len)
+{
+    if (brother_conn_poll(conn, 0) <= 0) {
+        return -1;
+    }
+
+    return brother_conn_receive(conn, buf, buf_len);
+}
+
+/* anything that doesn't look like an SNMP response is dropped */
+static void
+receive_snmp_responses(void)
+{
+    struct brother_conn *conn = g_dev_handler.snmp_conn;
     struct device *dev;
-    time_t time_now;
     char client_ip[16];
-    int msg_len, rc;
+    int msg_len;
+
+    while ((msg_len = receive_datagram(conn, g_dev_handler.snmp_buf,
+                                       sizeof(g_dev_handler.snmp_buf))) >= 0) {
+        /* a response is a BER sequence */
+        if (brother_conn_get_client_port(conn) != htons(SNMP_PORT) ||
+            msg_len < 6 || g_dev_handler.snmp_buf[0] != 0x30) {
+            LOG_DEBUG("Dropping a non-SNMP packet.\n");
+            continue;
+        }
 
-    TAILQ_FOREACH(dev, &g_dev_handler.devices, tailq) {
-        time_now = time(NULL);
+        dev = find_device(brother_conn_get_client_addr(conn));
+        if (dev == NULL) {
+            brother_conn_get_client_ip(conn, client_ip);
+            LOG_WARN("Received SNMP response from unknown device %s.\n", client_ip);
+            continue;
+        }
 
-        if (difftime(time_now, dev->next_ping_time) > 0) {
-            /* only ping once per DEVICE_KEEPALIVE_DURATION_SEC */
-            dev->next_ping_time = time_now + DEVICE_KEEPALIVE_DURATION_SEC;
-            dev->status = snmp_get_printer_status(g_dev_handler.button_conn,
-                                                  g_buf, sizeof(g_buf),
-                                                  dev->ip);
-            if (dev->status != 10001) {
-                LOG_WARN("Warn: device at %s is currently unreachable.\n",
-                         dev->config->ip);
+        handle_snmp_response(dev, msg_len);
+    }
+}
+
+/*
+ * Drain a burst of button events at once. The data channel of each device
+ * is kicked, and then the event is echoed back to acknowledge it.
+ */
+static void
+button_shard_loop(void *arg)
+{
+    struct button_shard *shard = arg;
+    struct brother_datagram msgs[BROTHER_CONN_MAX_BATCH];
+    struct device *devs[BROTHER_CONN_MAX_BATCH];
+    char client_ip[16];
+    unsigned i, num_acks;
+    int count;
+
+    do {
+        for (i = 0; i < BROTHER_CONN_MAX_BATCH; ++i) {
+            msgs[i].buf = shard->bufs[i];
+            msgs[i].len = sizeof(shard->bufs[i]);
+        }
+
+        count = brother_conn_receive_batch(shard->conn, msgs, BROTHER_CONN_MAX_BATCH);
+        if (count <= 0) {
+            break;
+        }
+
+        num_acks = 0;
+        for (i = 0; i < (unsigned) count; ++i) {
+            if (msgs[i].port == htons(SNMP_PORT)) {
+                LOG_DEBUG("Dropping an SNMP packet on the button port.\n");
+                continue;
+            }
+
+            devs[num_acks] = find_device(msgs[i].addr);
+            if (devs[num_acks] == NULL) {
+                inet_ntop(AF_INET, &msgs[i].addr, client_ip, sizeof(client_ip));
+                LOG_WARN("Received scan button event from unknown device %s.\n",
+                         client_ip);
+                continue;
             }
+
+            msgs[num_acks++] = msgs[i];
         }
 
-        if (dev->status != 10001) {
-            continue;
+        /* start connecting to the scanners while they're being acknowledged */
+        for (i = 0; i < num_acks; ++i) {
+            data_channel_kick(devs[i]->channel);
         }
 
-        if (difftime(time_now, dev->next_register_time) > 0) {
-            /* only register once per DEVICE_REGISTER_DURATION_SEC */
-            dev->next_register_time = time_now + DEVICE_REGISTER_DURATION_SEC;
-            register_scanner_driver(dev, dev->local_ip, true);
+        if (num_acks > 0 &&
+            brother_conn_send_batch(shard->conn, msgs, num_acks) != (int) num_acks) {
+            LOG_ERR("Failed to acknowledge some of the button events.\n");
+        }
+    } while (count == BROTHER_CONN_MAX_BATCH);
+
+    event_thread_wait_fd(event_thread_self(), brother_conn_get_fd(shard->conn), 1000);
+}
+
+static void
+button_shard_stop(void *arg)
+{
+    struct button_shard *shard = arg;
+
+    brother_conn_close(shard->conn);
+}
+
+static struct brother_conn *
+open_button_conn(unsigned num_conns)
+{
+    struct brother_conn *conn;
+
+    conn = brother_conn_open(BROTHER_CONNECTION_TYPE_UDP,
+                             BUTTON_HANDLER_NETWORK_TIMEOUT);
+    if (conn == NULL) {
+        LOG_FATAL("Failed to open a socket for the button handler.\n");
+        return NULL;
+    }
+
+    if ((num_conns > 1 && brother_conn_set_reuseport(conn, num_conns) != 0) ||
+        brother_conn_bind(conn, htons(BUTTON_HANDLER_PORT)) != 0) {
+        LOG_FATAL("Could not bind to the button handler port %d.\n", BUTTON_HANDLER_PORT);
+        brother_conn_close(conn);
+        return NULL;
+    }
+
+    return conn;
+}
+
+int
+device_handler_open_button_conns(struct brother_conn **conns, unsigned count)
+{
+    unsigned n;
+
+    /* all sockets must be bound before any datagram is steered to them */
+    for (n = 0; n < count; ++n) {
+        conns[n] = open_button_conn(count);
+        if (conns[n] == NULL) {
+            while (n > 0) {
+                brother_conn_close(conns[--n]);
+            }
+            return -1;
         }
     }
 
-    rc = brother_conn_poll(g_dev_handler.button_conn, 1);
-    if (rc <= 0) {
-        return;
+    return 0;
+}
+
+void
+device_handler_set_button_conns(struct brother_conn **conns, unsigned count)
+{
+    unsigned n;
+
+    for (n = 0; n < count; ++n) {
+        g_dev_handler.button_shards[n].conn = conns[n];
     }
+    g_dev_handler.num_button_shards = count;
+}
+
+/*
+ * Signal the readiness once the first ping of each device failed or the
+ * driver got registered there, or once the startup deadline passes. The
+ * unreachable devices are pinged again in the background.
+ */
+static void
+check_ready(uint64_t now)
+{
+    struct device *dev;
+    unsigned num_devices = 0, num_registered = 0;
+    bool pending = false;
 
-    /* try to receive scan event */
-    msg_len = brother_conn_receive(g_dev_handler.button_conn, g_buf, sizeof(g_buf));
-    if (msg_len < 0) {
+    if (g_dev_handler.ready) {
         return;
     }
 
-    rc = brother_conn_get_client_ip(g_dev_handler.button_conn, client_ip);
-    if (rc < 0) {
-        LOG_ERR("Invalid client IP. (IPv6 not supported yet)\n");
+    TAILQ_FOREACH(dev, &g_dev_handler.devices, tailq) {
+        num_devices++;
+        if (dev->registered) {
+            num_registered++;
+        } else if (dev->status == 0 || dev->status == 10001) {
+            pending = true;
+        }
+    }
+
+    if (pending && now < g_dev_handler.startup_deadline_ms) {
         return;
     }
 
+    LOG_INFO("Registered at %u of %u devices, ready.\n", num_registered, num_devices);
+    g_dev_handler.ready = true;
+    notify_ready();
+}
+
+/*
+ * Every due SNMP request is sent at once, and the responses are matched
+ * by their request ids as they come, so unreachable devices don't delay
+ * the others or the button events.
+ */
+static void
+device_handler_loop(void *arg)
+{
+    struct device *dev;
+    time_t time_now;
+    uint64_t now;
+
+    if (event_thread_fd_revents(event_thread_self())) {
+        receive_snmp_responses();
+    }
+
+    now = now_ms();
+    expire_requests(now);
+
+    time_now = time(NULL);
     TAILQ_FOREACH(dev, &g_dev_handler.devices, tailq) {
-        if (strncmp(dev->config->ip, client_ip, 16) == 0) {
-            msg_len = brother_conn_send(g_dev_handler.button_conn, g_buf, msg_len);
-            if (msg_len < 0) {
-                perror("sendto");
-                return;
-            }
+        if (dev->request != DEVICE_REQUEST_NONE) {
+            continue;
+        }
 
-            data_channel_kick(dev->channel);
-            return;
+        if (difftime(time_now, dev->next_ping_time) > 0) {
+            /* only ping once per DEVICE_KEEPALIVE_DURATION_SEC */
+            dev->next_ping_time = time_now + DEVICE_KEEPALIVE_DURATION_SEC;
+            device_send_status(dev);
+            continue;
+        }
+
+        if (dev->status != 10001) {
+            continue;
+        }
+
+        if (difftime(time_now, dev->next_register_time) > 0) {
+            /* renew before the registration expires, but not all at once */
+            dev->next_register_time = time_now + DEVICE_REGISTER_DURATION_SEC -
+                                      DEVICE_REGISTER_JITTER_SEC +
+                                      rand_r(&g_dev_handler.seed) %
+                                      DEVICE_REGISTER_JITTER_SEC;
+            device_send_register(dev);
         }
     }
 
-    LOG_WARN("Received scan button event from unknown device %s.\n", client_ip);
+    check_ready(now);
+    event_thread_wait_fd(event_thread_self(),
+                         brother_conn_get_fd(g_dev_handler.snmp_conn),
+                         next_request_timeout(now, 1000));
 }
 
 static void
 device_handler_stop(void *arg)
 {
     struct device *dev;
-    char ip[16];
 
     while ((dev = TAILQ_FIRST(&g_dev_handler.devices))) {
         TAILQ_REMOVE(&g_dev_handler.devices, dev, tailq);
-        snmp_get_printer_status(g_dev_handler.button_conn,
-                                g_buf, sizeof(g_buf), dev->ip);
-        brother_conn_get_local_ip(g_dev_handler.button_conn, ip);
-        register_scanner_driver(dev, ip, false);
+        if (dev->request != DEVICE_REQUEST_NONE) {
+            device_request_finish(dev);
+        }
+        /* don't wait for the ones that are gone anyway */
+        if (dev->registered && dev->status == 10001) {
+            snmp_get_printer_status(g_dev_handler.snmp_conn,
+                                    g_dev_handler.snmp_buf,
+                                    sizeof(g_dev_handler.snmp_buf), dev->ip);
+            register_scanner_driver(dev, dev->local_ip, false);
+        }
         free(dev);
     }
+
+    free(g_dev_handler.table);
+    g_dev_handler.table = NULL;
+    g_dev_handler.table_count = 0;
+
+    brother_conn_close(g_dev_handler.snmp_conn);
 }
 
 void
 device_handler_init(const char *config_path)
 {
     struct device_config *dev_config;
+    struct brother_conn *conns[CONFIG_BUTTON_MAX_THREADS];
+    struct button_shard *shard;
+    unsigned n;
+    int i;
 
     atomic_store(&g_appnum, 1);
     TAILQ_INIT(&g_dev_handler.devices);
+    for (i = 0; i < TIMER_WHEEL_SLOTS; ++i) {
+        TAILQ_INIT(&g_dev_handler.timer_wheel[i]);
+    }
+    g_dev_handler.timer_tick = now_ms() / TIMER_WHEEL_TICK_MS;
+    g_dev_handler.startup_deadline_ms = now_ms() + g_config.startup_timeout * 1000;
+    g_dev_handler.seed = (unsigned) time(NULL) ^ (unsigned) getpid();
 
-    g_dev_handler.button_conn = brother_conn_open(BROTHER_CONNECTION_TYPE_UDP,
-                                BUTTON_HANDLER_NETWORK_TIMEOUT);
-    if (g_dev_handler.button_conn == NULL) {
-        LOG_FATAL("Failed to open a socket for the button handler.\n");
-        return;
+    /* a supervisor may have handed us the sockets already */
+    if (g_dev_handler.num_button_shards == 0) {
+        if (device_handler_open_button_conns(conns, g_config.button_threads) != 0) {
+            return;
+        }
+        device_handler_set_button_conns(conns, g_config.button_threads);
     }
 
-    if (brother_conn_bind(g_dev_handler.button_conn, htons(BUTTON_HANDLER_PORT)) != 0) {
-        LOG_FATAL("Could not bind to the button handler port %d.\n", BUTTON_HANDLER_PORT);
-        brother_conn_close(g_dev_handler.button_conn);
-        return;
+    g_dev_handler.snmp_conn = brother_conn_open(BROTHER_CONNECTION_TYPE_UDP,
+                              BUTTON_HANDLER_NETWORK_TIMEOUT);
+    if (g_dev_handler.snmp_conn == NULL) {
+        LOG_FATAL("Failed to open a socket for SNMP.\n");
+        goto err;
     }
 
     TAILQ_FOREACH(dev_config, &g_config.devices, tailq) {
@@ -312,11 +849,29 @@ device_handler_init(const char *config_path)
         }
     }
 
+    /* the device table is read-only from now on, the shards may use it */
+    for (n = 0; n < g_dev_handler.num_button_shards; ++n) {
+        shard = &g_dev_handler.button_shards[n];
+        shard->thread = event_thread_create("button_handler", button_shard_loop,
+                                            button_shard_stop, shard);
+        if (shard->thread == NULL) {
+            LOG_FATAL("Could not init button_handler thread.\n");
+            return;
+        }
+    }
+
     g_dev_handler.thread = event_thread_create("device_handler", device_handler_loop,
                            device_handler_stop, NULL);
     if (g_dev_handler.thread == NULL) {
         LOG_FATAL("Could not init device_handler thread.\n");
-        brother_conn_close(g_dev_handler.button_conn);
         return;
     }
+
+    return;
+
+err:
+    for (n = 0; n < g_dev_handler.num_button_shards; ++n) {
+        brother_conn_close(g_dev_handler.button_shards[n].conn);
+    }
+    g_dev_handler.num_button_shards = 0;
 }
@@ -9,7 +9,21 @@
 
 #include "config.h"
 
+struct brother_conn;
+
 void device_handler_init(const char *config_path);
 struct device *device_handler_add_device(struct device_config *config);
 
+/**
+ * Open count sockets sharing the button port, with the events of each
+ * device always steered to the same one, see brother_conn_reuseport_index().
+ */
+int device_handler_open_button_conns(struct brother_conn **conns, unsigned count);
+
+/**
+ * Receive the button events on the given, already bound sockets instead
+ * of opening new ones. Must be called before device_handler_init().
+ */
+void device_handler_set_button_conns(struct brother_conn **conns, unsigned count);
+
 #endif //BROTHER_DEVICE_HANDLER_H
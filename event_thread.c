@@ -7,15 +7,26 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/queue.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <stdlib.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <stdatomic.h>
 #include "event_thread.h"
 #include "con_queue.h"
 #include "log.h"
 
-#define MAX_EVENT_THREADS 32
+#define MAX_EVENT_THREADS 1024
+#define MAX_EVENT_LOOPS 64
+#define EVENT_LOOP_MAX_EPOLL_EVENTS 64
+#define EVENT_THREAD_QUEUE_SIZE 64
+#define EVENT_THREAD_DRAIN_BATCH 16
 
 struct event {
     void (*callback)(void *, void *);
@@ -27,86 +38,198 @@ enum event_thread_state {
     EVENT_THREAD_RUNNING,
     EVENT_THREAD_SLEEPING,
     EVENT_THREAD_STOPPED,
+    /* no state change requested */
+    EVENT_THREAD_STATE_NONE,
 };
 
 struct event_thread {
     enum event_thread_state state;
+    /* set by other threads, applied before the queued events are processed */
+    atomic_int pending_state;
+    /* events rejected because the queue was full */
+    atomic_uint dropped_events;
     char *name;
     void (*update_cb)(void *);
     void (*stop_cb)(void *);
     void *arg;
     struct con_queue *events;
     pthread_t tid;
-    sem_t sem;
+    /* eventfd polled by a dedicated thread along with its wait fd */
+    int wake_fd;
+
+    /* NULL for threads that own a dedicated pthread */
+    struct event_loop *loop;
+    TAILQ_ENTRY(event_thread) loop_tailq;
+
+    /* one-shot wait requested by update_cb for its next call */
+    bool waiting;
+    bool wait_ready;
+    int wait_fd;
+    int wait_revents;
+    uint64_t wait_deadline_ms;
+};
+
+/*
+ * A single pthread multiplexing any number of shared event threads
+ * over one epoll instance. Wait deadlines are tracked per-thread and
+ * used as the epoll_wait() timeout.
+ */
+struct event_loop {
+    pthread_t tid;
+    int epoll_fd;
+    int wake_fd;
+    atomic_bool stopping;
+    pthread_mutex_t lock;
+    TAILQ_HEAD(, event_thread) threads;
 };
 
 static atomic_int g_thread_cnt;
 static struct event_thread g_threads[MAX_EVENT_THREADS];
+static atomic_uint g_loop_rr;
+static unsigned g_loop_cnt;
+static struct event_loop g_loops[MAX_EVENT_LOOPS];
+static _Thread_local struct event_thread *g_current_thread;
 
-static struct event *
-allocate_event(void (*callback)(void *, void *), void *arg1, void *arg2)
+static uint64_t
+now_ms(void)
 {
-    struct event *event;
+    struct timespec ts;
 
-    event = calloc(1, sizeof(*event));
-    if (!event) {
-        LOG_FATAL("Failed to allocate memory for event.\n");
-        return NULL;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+static void
+event_loop_wake(struct event_loop *loop)
+{
+    uint64_t one = 1;
+
+    if (write(loop->wake_fd, &one, sizeof(one)) != sizeof(one)) {
+        LOG_ERR("Failed to wake event loop %p.\n", (void *) loop);
+    }
+}
+
+static void
+event_thread_wake(struct event_thread *thread)
+{
+    uint64_t one = 1;
+
+    if (thread->loop) {
+        event_loop_wake(thread->loop);
+        return;
     }
 
-    event->callback = callback;
-    event->arg1 = arg1;
-    event->arg2 = arg2;
+    if (thread == g_current_thread) {
+        /* the events are always processed before the thread polls again */
+        return;
+    }
 
-    return event;
+    if (write(thread->wake_fd, &one, sizeof(one)) != sizeof(one)) {
+        LOG_ERR("%s: failed to wake thread.\n", thread->name);
+    }
 }
 
 int
 event_thread_enqueue_event(struct event_thread *thread,
                            void (*callback)(void *, void *), void *arg1, void *arg2)
 {
-    struct event *event;
+    struct event event = { callback, arg1, arg2 };
+    unsigned dropped;
 
     if (!thread) {
         LOG_FATAL("Trying to enqueue event to inexistent thread.\n");
         return -1;
     }
 
-    event = allocate_event(callback, arg1, arg2);
-    if (event == NULL) {
-        LOG_FATAL("Failed to allocate event for enqueuing.\n");
+    if (con_queue_push(thread->events, &event) != 0) {
+        dropped = atomic_fetch_add(&thread->dropped_events, 1) + 1;
+        /* don't flood the log if the consumer is stuck */
+        if ((dropped & (dropped - 1)) == 0) {
+            LOG_ERR("%s: event queue is full, dropped %u event(s) so far.\n",
+                    thread->name, dropped);
+        }
         return -1;
     }
 
-    con_queue_push(thread->events, event);
+    event_thread_wake(thread);
     return 0;
 }
 
+unsigned
+event_thread_dropped_events(struct event_thread *thread)
+{
+    return atomic_load(&thread->dropped_events);
+}
+
 static void
 event_thread_destroy(struct event_thread *thread)
 {
-    struct event *event;
+    unsigned dropped = atomic_load(&thread->dropped_events);
 
-    while (con_queue_pop(thread->events, (void **) &event) == 0) {
-        free(event);
+    if (dropped > 0) {
+        LOG_WARN("%s: %u event(s) were dropped on a full queue.\n",
+                 thread->name, dropped);
     }
 
-    free(thread->events);
+    con_queue_free(thread->events);
     free(thread->name);
-    sem_destroy(&thread->sem);
+
+    if (thread->wake_fd >= 0) {
+        close(thread->wake_fd);
+    }
 }
 
 static void
-event_thread_set_state_cb(void *arg1, void *arg2)
+event_thread_apply_state(struct event_thread *thread)
 {
-    struct event_thread *thread = arg1;
+    int state;
 
-    if (thread->state == EVENT_THREAD_STOPPED) {
+    state = atomic_exchange(&thread->pending_state, EVENT_THREAD_STATE_NONE);
+    if (state == EVENT_THREAD_STATE_NONE || thread->state == EVENT_THREAD_STOPPED) {
         /* thread will be stopped with current loop tick */
         return;
     }
 
-    thread->state = (enum event_thread_state)(intptr_t) arg2;
+    thread->state = (enum event_thread_state) state;
+}
+
+static void
+event_thread_process_events(struct event_thread *thread)
+{
+    struct event events[EVENT_THREAD_DRAIN_BATCH];
+    size_t i, count;
+
+    /*
+     * Apply the state first, so that events enqueued right before
+     * a state change are always seen in the same iteration.
+     */
+    event_thread_apply_state(thread);
+
+    do {
+        count = con_queue_pop_bulk(thread->events, events, EVENT_THREAD_DRAIN_BATCH);
+        for (i = 0; i < count; ++i) {
+            events[i].callback(events[i].arg1, events[i].arg2);
+        }
+    } while (count == EVENT_THREAD_DRAIN_BATCH);
+}
+
+/*
+ * State changes don't go through the event queue, so they can't be
+ * lost when it's full. A pending stop can't be overridden.
+ */
+static void
+event_thread_request_state(struct event_thread *thread, enum event_thread_state state)
+{
+    int pending = atomic_load(&thread->pending_state);
+
+    do {
+        if (pending == EVENT_THREAD_STOPPED) {
+            break;
+        }
+    } while (!atomic_compare_exchange_weak(&thread->pending_state, &pending,
+                                           (int) state));
+
+    event_thread_wake(thread);
 }
 
 int
@@ -117,50 +240,119 @@ event_thread_pause(struct event_thread *thread)
         return -1;
     }
 
-    if (event_thread_enqueue_event(thread, event_thread_set_state_cb, thread,
-                                   (void *)(intptr_t) EVENT_THREAD_SLEEPING) != 0) {
-        LOG_FATAL("Failed to pause thread %p.\n", thread);
-        return -1;
-    }
-
+    event_thread_request_state(thread, EVENT_THREAD_SLEEPING);
     return 0;
 }
 
 int
 event_thread_kick(struct event_thread *thread)
 {
-    if (event_thread_enqueue_event(thread, event_thread_set_state_cb, thread,
-                                   (void *)(intptr_t) EVENT_THREAD_RUNNING) != 0) {
-        LOG_FATAL("Failed to wake thread %p.\n", thread);
+    event_thread_request_state(thread, EVENT_THREAD_RUNNING);
+    return 0;
+}
+
+int
+event_thread_wait_fd(struct event_thread *thread, int fd, unsigned timeout_ms)
+{
+    if (thread != g_current_thread) {
+        LOG_ERR("Thread %p can only set up its own waits.\n", (void *) thread);
         return -1;
     }
 
-    sem_post(&thread->sem);
+    thread->waiting = true;
+    thread->wait_ready = false;
+    thread->wait_fd = fd;
+    thread->wait_revents = 0;
+    thread->wait_deadline_ms = now_ms() + timeout_ms;
     return 0;
 }
 
+int
+event_thread_fd_revents(struct event_thread *thread)
+{
+    return thread->wait_revents;
+}
+
+/*
+ * Block a dedicated thread until it's woken up, or until its pending
+ * wait completes. Sleeping threads only wait for the wakeup.
+ */
+static void
+event_thread_dedicated_poll(struct event_thread *thread)
+{
+    struct pollfd pfds[2] = { 0 };
+    uint64_t now, wake_cnt;
+    bool waiting;
+    int nfds = 1, timeout = -1;
+
+    pfds[0].fd = thread->wake_fd;
+    pfds[0].events = POLLIN;
+
+    waiting = thread->state == EVENT_THREAD_RUNNING && thread->waiting;
+    if (waiting) {
+        now = now_ms();
+        timeout = thread->wait_deadline_ms > now ?
+                  (int)(thread->wait_deadline_ms - now) : 0;
+
+        if (thread->wait_fd >= 0) {
+            pfds[1].fd = thread->wait_fd;
+            pfds[1].events = POLLIN;
+            nfds = 2;
+        }
+    }
+
+    if (poll(pfds, (nfds_t) nfds, timeout) < 0) {
+        if (errno != EINTR) {
+            LOG_ERR("%s: poll() failed: %s.\n", thread->name, strerror(errno));
+        }
+        return;
+    }
+
+    if (pfds[0].revents && read(thread->wake_fd, &wake_cnt, sizeof(wake_cnt)) < 0) {
+        LOG_ERR("%s: failed to read the wake fd.\n", thread->name);
+    }
+
+    if (!waiting) {
+        return;
+    }
+
+    if (nfds == 2 && pfds[1].revents) {
+        thread->wait_revents = pfds[1].revents;
+        thread->wait_ready = true;
+    } else if (now_ms() >= thread->wait_deadline_ms) {
+        thread->wait_revents = 0;
+        thread->wait_ready = true;
+    }
+}
+
+static void
+event_thread_update(struct event_thread *thread)
+{
+    thread->waiting = false;
+    thread->update_cb(thread->arg);
+}
+
 static void *
 event_thread_loop(void *arg)
 {
     struct event_thread *thread = arg;
-    struct event *event;
     sigset_t sigset;
 
-    sem_init(&thread->sem, 0, 0);
+    g_current_thread = thread;
 
-    while (thread->state != EVENT_THREAD_STOPPED) {
-        while (con_queue_pop(thread->events, (void **) &event) == 0) {
-            event->callback(event->arg1, event->arg2);
-            free(event);
+    while (true) {
+        event_thread_process_events(thread);
+        if (thread->state == EVENT_THREAD_STOPPED) {
+            break;
         }
 
-        if (thread->state == EVENT_THREAD_RUNNING && thread->update_cb) {
-            thread->update_cb(thread->arg);
+        if (thread->state == EVENT_THREAD_RUNNING && thread->update_cb &&
+            (!thread->waiting || thread->wait_ready)) {
+            event_thread_update(thread);
+            continue;
         }
 
-        if (thread->state == EVENT_THREAD_SLEEPING) {
-            sem_wait(&thread->sem);
-        }
+        event_thread_dedicated_poll(thread);
     }
 
     if (thread->stop_cb) {
@@ -172,93 +364,311 @@ event_thread_loop(void *arg)
     return NULL;
 }
 
-struct event_thread *
-event_thread_create(const char *name, void (*update_cb)(void *),
-                    void (*stop_cb)(void *), void *arg)
+static struct event_thread *
+event_thread_alloc(const char *name, void (*update_cb)(void *),
+                   void (*stop_cb)(void *), void *arg)
 {
     struct event_thread *thread;
-    int thread_id, rc;
+    int thread_id;
 
     thread_id = atomic_fetch_add(&g_thread_cnt, 1);
     if (thread_id >= MAX_EVENT_THREADS) {
         LOG_FATAL("Reached the thread limit (%d).\n", MAX_EVENT_THREADS);
-        goto name_err;
+        return NULL;
     }
 
     thread = &g_threads[thread_id];
 
     thread->state = EVENT_THREAD_RUNNING;
+    thread->wait_fd = -1;
+    thread->wake_fd = -1;
     thread->name = strdup(name);
     if (!thread->name) {
         LOG_ERR("strdup() failed.\n");
-        goto err;
+        return NULL;
     }
 
-    thread->events = calloc(1, sizeof(*thread->events) + 32 * sizeof(void *));
+    atomic_init(&thread->pending_state, EVENT_THREAD_STATE_NONE);
+    atomic_init(&thread->dropped_events, 0);
+    thread->events = con_queue_create(EVENT_THREAD_QUEUE_SIZE, sizeof(struct event));
     if (!thread->events) {
-        LOG_ERR("calloc() failed.\n");
-        goto name_err;
+        LOG_ERR("con_queue_create() failed.\n");
+        free(thread->name);
+        return NULL;
     }
 
-    thread->events->size = 32;
     thread->update_cb = update_cb;
     thread->stop_cb = stop_cb;
     thread->arg = arg;
 
+    return thread;
+}
+
+struct event_thread *
+event_thread_create(const char *name, void (*update_cb)(void *),
+                    void (*stop_cb)(void *), void *arg)
+{
+    struct event_thread *thread;
+    int rc;
+
+    thread = event_thread_alloc(name, update_cb, stop_cb, arg);
+    if (thread == NULL) {
+        return NULL;
+    }
+
+    thread->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (thread->wake_fd < 0) {
+        LOG_ERR("eventfd() failed: %s.\n", strerror(errno));
+        goto err;
+    }
+
     rc = pthread_create(&thread->tid, NULL, event_thread_loop, thread);
     if (rc != 0) {
-        LOG_ERR("pthread_create() failed: %s.\n", strerror(-rc));
-        goto events_err;
+        LOG_ERR("pthread_create() failed: %s.\n", strerror(rc));
+        close(thread->wake_fd);
+        goto err;
     }
 
     return thread;
 
-events_err:
-    free(thread->events);
-name_err:
-    free(thread->name);
 err:
+    con_queue_free(thread->events);
+    free(thread->name);
     return NULL;
 }
 
-int
-event_thread_stop(struct event_thread *thread)
+static void
+event_loop_arm(struct event_loop *loop, struct event_thread *thread)
 {
-    if (thread->state == EVENT_THREAD_STOPPED) {
-        LOG_ERR("Thread %p is not running.\n", (void *)thread);
+    struct epoll_event ev = { 0 };
+
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = thread;
+
+    /* a closed fd drops out of the epoll set by itself, so re-add on ENOENT */
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, thread->wait_fd, &ev) != 0 &&
+        (errno != ENOENT ||
+         epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, thread->wait_fd, &ev) != 0)) {
+        LOG_ERR("%s: epoll_ctl() failed: %s.\n", thread->name, strerror(errno));
+        /* let the deadline expire, the callback will see a timeout */
+        thread->wait_fd = -1;
+    }
+}
+
+/*
+ * Run a single shared thread. Returns the number of ms the thread
+ * may stay idle for, or -1 if it only waits for external events.
+ */
+static int
+event_loop_run_thread(struct event_loop *loop, struct event_thread *thread,
+                      uint64_t now)
+{
+    g_current_thread = thread;
+    event_thread_process_events(thread);
+
+    if (thread->state != EVENT_THREAD_RUNNING || !thread->update_cb) {
         return -1;
     }
 
-    if (event_thread_enqueue_event(thread, event_thread_set_state_cb, thread,
-                                   (void *)(intptr_t) EVENT_THREAD_STOPPED) != 0) {
-        LOG_ERR("Failed to stop thread %p.\n", (void *)thread);
+    if (thread->waiting && !thread->wait_ready &&
+        thread->wait_deadline_ms > now) {
+        return (int)(thread->wait_deadline_ms - now);
+    }
+
+    if (thread->waiting && !thread->wait_ready) {
+        thread->wait_revents = 0;
+    }
+
+    event_thread_update(thread);
+
+    if (thread->state != EVENT_THREAD_RUNNING) {
         return -1;
     }
 
-    sem_post(&thread->sem);
-    return 0;
+    if (!thread->waiting) {
+        /* still runnable */
+        return 0;
+    }
+
+    if (thread->wait_fd >= 0) {
+        event_loop_arm(loop, thread);
+    }
+
+    return thread->wait_deadline_ms > now ?
+           (int)(thread->wait_deadline_ms - now) : 0;
 }
 
-struct event_thread *
-event_thread_self(void)
+static void *
+event_loop_run(void *arg)
 {
-    struct event_thread *thread_tmp;
-    int i;
+    struct event_loop *loop = arg;
+    struct epoll_event evs[EVENT_LOOP_MAX_EPOLL_EVENTS];
+    struct event_thread *thread, *next;
+    struct event_thread *ev_thread;
+    uint64_t wake_cnt;
+    int timeout, thread_timeout, i, n;
+
+    while (true) {
+        timeout = -1;
+
+        pthread_mutex_lock(&loop->lock);
+        for (thread = TAILQ_FIRST(&loop->threads); thread; thread = next) {
+            next = TAILQ_NEXT(thread, loop_tailq);
+
+            thread_timeout = event_loop_run_thread(loop, thread, now_ms());
+            if (thread->state == EVENT_THREAD_STOPPED) {
+                TAILQ_REMOVE(&loop->threads, thread, loop_tailq);
+                if (thread->stop_cb) {
+                    thread->stop_cb(thread->arg);
+                }
+                event_thread_destroy(thread);
+                continue;
+            }
+
+            if (thread_timeout >= 0 && (timeout < 0 || thread_timeout < timeout)) {
+                timeout = thread_timeout;
+            }
+        }
+        g_current_thread = NULL;
 
-    for (i = 0; i < MAX_EVENT_THREADS; ++i) {
-        thread_tmp = &g_threads[i];
-        if (thread_tmp->tid == pthread_self()) {
-            return thread_tmp;
+        if (TAILQ_EMPTY(&loop->threads) && atomic_load(&loop->stopping)) {
+            pthread_mutex_unlock(&loop->lock);
+            break;
+        }
+        pthread_mutex_unlock(&loop->lock);
+
+        do {
+            n = epoll_wait(loop->epoll_fd, evs, EVENT_LOOP_MAX_EPOLL_EVENTS, timeout);
+        } while (n < 0 && errno == EINTR);
+
+        for (i = 0; i < n; ++i) {
+            ev_thread = evs[i].data.ptr;
+            if (ev_thread == NULL) {
+                if (read(loop->wake_fd, &wake_cnt, sizeof(wake_cnt)) < 0) {
+                    LOG_ERR("Failed to read event loop wake fd.\n");
+                }
+                continue;
+            }
+
+            /* epoll flags match their poll() counterparts */
+            ev_thread->wait_revents = (int) evs[i].events;
+            ev_thread->wait_ready = true;
         }
     }
 
+    close(loop->wake_fd);
+    close(loop->epoll_fd);
     return NULL;
 }
 
+int
+event_thread_lib_start_loops(unsigned num_loops)
+{
+    struct event_loop *loop;
+    struct epoll_event ev = { 0 };
+    unsigned i;
+    int rc;
+
+    if (num_loops > MAX_EVENT_LOOPS) {
+        LOG_WARN("Limiting the number of event loops to %d.\n", MAX_EVENT_LOOPS);
+        num_loops = MAX_EVENT_LOOPS;
+    }
+
+    for (i = 0; i < num_loops; ++i) {
+        loop = &g_loops[i];
+
+        TAILQ_INIT(&loop->threads);
+        pthread_mutex_init(&loop->lock, NULL);
+        atomic_init(&loop->stopping, false);
+
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epoll_fd < 0) {
+            LOG_ERR("epoll_create1() failed: %s.\n", strerror(errno));
+            return -1;
+        }
+
+        loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (loop->wake_fd < 0) {
+            LOG_ERR("eventfd() failed: %s.\n", strerror(errno));
+            close(loop->epoll_fd);
+            return -1;
+        }
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &ev) != 0) {
+            LOG_ERR("epoll_ctl() failed: %s.\n", strerror(errno));
+            goto err;
+        }
+
+        rc = pthread_create(&loop->tid, NULL, event_loop_run, loop);
+        if (rc != 0) {
+            LOG_ERR("pthread_create() failed: %s.\n", strerror(rc));
+            goto err;
+        }
+
+        g_loop_cnt = i + 1;
+    }
+
+    return 0;
+
+err:
+    close(loop->wake_fd);
+    close(loop->epoll_fd);
+    return -1;
+}
+
+struct event_thread *
+event_thread_create_shared(const char *name, void (*update_cb)(void *),
+                           void (*stop_cb)(void *), void *arg)
+{
+    struct event_thread *thread;
+    struct event_loop *loop;
+
+    if (g_loop_cnt == 0) {
+        return event_thread_create(name, update_cb, stop_cb, arg);
+    }
+
+    thread = event_thread_alloc(name, update_cb, stop_cb, arg);
+    if (thread == NULL) {
+        return NULL;
+    }
+
+    loop = &g_loops[atomic_fetch_add(&g_loop_rr, 1) % g_loop_cnt];
+    thread->loop = loop;
+    thread->tid = loop->tid;
+
+    pthread_mutex_lock(&loop->lock);
+    TAILQ_INSERT_TAIL(&loop->threads, thread, loop_tailq);
+    pthread_mutex_unlock(&loop->lock);
+
+    event_loop_wake(loop);
+    return thread;
+}
+
+int
+event_thread_stop(struct event_thread *thread)
+{
+    if (thread->state == EVENT_THREAD_STOPPED) {
+        LOG_ERR("Thread %p is not running.\n", (void *)thread);
+        return -1;
+    }
+
+    event_thread_request_state(thread, EVENT_THREAD_STOPPED);
+    return 0;
+}
+
+struct event_thread *
+event_thread_self(void)
+{
+    return g_current_thread;
+}
+
 void
 event_thread_lib_init(void)
 {
     atomic_init(&g_thread_cnt, 0);
+    atomic_init(&g_loop_rr, 0);
 }
 
 void
@@ -269,13 +679,18 @@ event_thread_lib_wait(void)
 
     for (i = 0; i < MAX_EVENT_THREADS; ++i) {
         thread = &g_threads[i];
-        if (thread->tid && thread->state != EVENT_THREAD_STOPPED) {
+        if (thread->tid && !thread->loop && thread->state != EVENT_THREAD_STOPPED) {
             pthread_join(thread->tid, NULL);
             event_thread_lib_wait();
             return;
         }
     }
 
+    for (i = 0; i < (int) g_loop_cnt; ++i) {
+        pthread_join(g_loops[i].tid, NULL);
+    }
+    g_loop_cnt = 0;
+
     fflush(stdout);
 }
 
@@ -283,7 +698,7 @@ static void *
 event_thread_lib_shutdown_cb(void *arg)
 {
     struct event_thread *thread;
-    int i;
+    unsigned i;
 
     for (i = 0; i < MAX_EVENT_THREADS; ++i) {
         thread = &g_threads[i];
@@ -292,6 +707,11 @@ event_thread_lib_shutdown_cb(void *arg)
         }
     }
 
+    for (i = 0; i < g_loop_cnt; ++i) {
+        atomic_store(&g_loops[i].stopping, true);
+        event_loop_wake(&g_loops[i]);
+    }
+
     return NULL;
 }
 
@@ -10,16 +10,49 @@
 void event_thread_lib_init(void);
 void event_thread_lib_wait(void);
 void event_thread_lib_shutdown(void);
+int event_thread_lib_start_loops(unsigned num_loops);
 
 struct event_thread *event_thread_create(const char *name,
         void (*update_cb)(void *),
         void (*stop_cb)(void *), void *arg);
+
+/**
+ * Create an event thread that is served by one of the shared event loops
+ * started with event_thread_lib_start_loops(). Its update_cb must never
+ * block; waits on sockets are expressed with event_thread_wait_fd().
+ * Falls back to event_thread_create() if no shared loops are running.
+ */
+struct event_thread *event_thread_create_shared(const char *name,
+        void (*update_cb)(void *),
+        void (*stop_cb)(void *), void *arg);
+
+/**
+ * Enqueue a callback to be called on the given thread. Nothing is
+ * allocated; returns -1 if the thread's event queue is full.
+ */
 int event_thread_enqueue_event(struct event_thread *thread,
                                void (*callback)(void *, void *),
                                void *arg1, void *arg2);
+
+/**
+ * Number of events rejected so far because the queue was full.
+ */
+unsigned event_thread_dropped_events(struct event_thread *thread);
 int event_thread_pause(struct event_thread *thread);
 int event_thread_kick(struct event_thread *thread);
 int event_thread_stop(struct event_thread *thread);
+
+/**
+ * Delay the next update_cb call until given fd becomes readable or
+ * timeout_ms passes. May only be called from the thread's own update_cb.
+ * Use fd < 0 for a plain timer.
+ */
+int event_thread_wait_fd(struct event_thread *thread, int fd, unsigned timeout_ms);
+
+/**
+ * Poll revents of the last completed wait, 0 if it timed out.
+ */
+int event_thread_fd_revents(struct event_thread *thread);
 struct event_thread *event_thread_self(void);
 
 #endif //BROTHER_EVENT_THREAD_H
@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "hash.h"
+#include "config.h"
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static const uint32_t g_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint64_t
+rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint32_t
+rotr32(uint32_t x, int r)
+{
+    return (x >> r) | (x << (32 - r));
+}
+
+static inline uint64_t
+read_le64(const uint8_t *p)
+{
+    return (uint64_t) p[0] | (uint64_t) p[1] << 8 | (uint64_t) p[2] << 16 |
+           (uint64_t) p[3] << 24 | (uint64_t) p[4] << 32 | (uint64_t) p[5] << 40 |
+           (uint64_t) p[6] << 48 | (uint64_t) p[7] << 56;
+}
+
+static inline uint32_t
+read_le32(const uint8_t *p)
+{
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 |
+           (uint32_t) p[3] << 24;
+}
+
+static inline uint32_t
+read_be32(const uint8_t *p)
+{
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 |
+           (uint32_t) p[3];
+}
+
+static inline uint64_t
+xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t
+xxh64_merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+/* consume whole 32-byte stripes, returns the number of bytes processed */
+static size_t
+xxh64_stripes(uint64_t *v, const uint8_t *p, size_t len)
+{
+    const uint8_t *start = p;
+
+    while (len >= 32) {
+        v[0] = xxh64_round(v[0], read_le64(p));
+        v[1] = xxh64_round(v[1], read_le64(p + 8));
+        v[2] = xxh64_round(v[2], read_le64(p + 16));
+        v[3] = xxh64_round(v[3], read_le64(p + 24));
+        p += 32;
+        len -= 32;
+    }
+
+    return (size_t) (p - start);
+}
+
+static void
+xxh64_update(struct hash *hash, const uint8_t *p, size_t len)
+{
+    size_t n;
+
+    if (hash->xxh64.mem_len > 0) {
+        n = sizeof(hash->xxh64.mem) - hash->xxh64.mem_len;
+        if (n > len) {
+            n = len;
+        }
+
+        memcpy(hash->xxh64.mem + hash->xxh64.mem_len, p, n);
+        hash->xxh64.mem_len += n;
+        p += n;
+        len -= n;
+
+        if (hash->xxh64.mem_len < sizeof(hash->xxh64.mem)) {
+            return;
+        }
+
+        xxh64_stripes(hash->xxh64.v, hash->xxh64.mem, sizeof(hash->xxh64.mem));
+        hash->xxh64.mem_len = 0;
+    }
+
+    n = xxh64_stripes(hash->xxh64.v, p, len);
+    memcpy(hash->xxh64.mem, p + n, len - n);
+    hash->xxh64.mem_len = len - n;
+}
+
+static uint64_t
+xxh64_digest(struct hash *hash)
+{
+    const uint64_t *v = hash->xxh64.v;
+    const uint8_t *p = hash->xxh64.mem;
+    size_t len = hash->xxh64.mem_len;
+    uint64_t h;
+
+    if (hash->total_len >= 32) {
+        h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18);
+        h = xxh64_merge_round(h, v[0]);
+        h = xxh64_merge_round(h, v[1]);
+        h = xxh64_merge_round(h, v[2]);
+        h = xxh64_merge_round(h, v[3]);
+    } else {
+        h = v[2] + XXH_PRIME64_5;
+    }
+
+    h += hash->total_len;
+
+    while (len >= 8) {
+        h ^= xxh64_round(0, read_le64(p));
+        h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+        p += 8;
+        len -= 8;
+    }
+
+    if (len >= 4) {
+        h ^= (uint64_t) read_le32(p) * XXH_PRIME64_1;
+        h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+        len -= 4;
+    }
+
+    while (len > 0) {
+        h ^= *p * XXH_PRIME64_5;
+        h = rotl64(h, 11) * XXH_PRIME64_1;
+        ++p;
+        --len;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static void
+sha256_block(uint32_t *h, const uint8_t *p)
+{
+    uint32_t w[64], a, b, c, d, e, f, g, k, t1, t2;
+    int i;
+
+    for (i = 0; i < 16; ++i) {
+        w[i] = read_be32(p + i * 4);
+    }
+
+    for (i = 16; i < 64; ++i) {
+        w[i] = w[i - 16] + w[i - 7] +
+               (rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+               (rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+    }
+
+    a = h[0]; b = h[1]; c = h[2]; d = h[3];
+    e = h[4]; f = h[5]; g = h[6]; k = h[7];
+
+    for (i = 0; i < 64; ++i) {
+        t1 = k + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) +
+             ((e & f) ^ (~e & g)) + g_sha256_k[i] + w[i];
+        t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) +
+             ((a & b) ^ (a & c) ^ (b & c));
+        k = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static void
+sha256_update(struct hash *hash, const uint8_t *p, size_t len)
+{
+    size_t n;
+
+    if (hash->sha256.mem_len > 0) {
+        n = sizeof(hash->sha256.mem) - hash->sha256.mem_len;
+        if (n > len) {
+            n = len;
+        }
+
+        memcpy(hash->sha256.mem + hash->sha256.mem_len, p, n);
+        hash->sha256.mem_len += n;
+        p += n;
+        len -= n;
+
+        if (hash->sha256.mem_len < sizeof(hash->sha256.mem)) {
+            return;
+        }
+
+        sha256_block(hash->sha256.h, hash->sha256.mem);
+        hash->sha256.mem_len = 0;
+    }
+
+    while (len >= 64) {
+        sha256_block(hash->sha256.h, p);
+        p += 64;
+        len -= 64;
+    }
+
+    memcpy(hash->sha256.mem, p, len);
+    hash->sha256.mem_len = len;
+}
+
+static void
+sha256_digest(struct hash *hash, uint8_t *out)
+{
+    uint64_t bits = hash->total_len * 8;
+    uint8_t pad[72] = { 0x80 };
+    size_t pad_len;
+    int i;
+
+    pad_len = (hash->sha256.mem_len < 56 ? 56 : 120) - hash->sha256.mem_len;
+    for (i = 0; i < 8; ++i) {
+        pad[pad_len + i] = (uint8_t) (bits >> (56 - i * 8));
+    }
+
+    sha256_update(hash, pad, pad_len + 8);
+
+    for (i = 0; i < 8; ++i) {
+        out[i * 4] = (uint8_t) (hash->sha256.h[i] >> 24);
+        out[i * 4 + 1] = (uint8_t) (hash->sha256.h[i] >> 16);
+        out[i * 4 + 2] = (uint8_t) (hash->sha256.h[i] >> 8);
+        out[i * 4 + 3] = (uint8_t) hash->sha256.h[i];
+    }
+}
+
+void
+hash_init(struct hash *hash, int type)
+{
+    static const uint32_t sha256_iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    memset(hash, 0, sizeof(*hash));
+    hash->type = type;
+
+    switch (type) {
+    case CONFIG_SCAN_HASH_XXH64:
+        hash->xxh64.v[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+        hash->xxh64.v[1] = XXH_PRIME64_2;
+        hash->xxh64.v[2] = 0;
+        hash->xxh64.v[3] = -XXH_PRIME64_1;
+        break;
+    case CONFIG_SCAN_HASH_SHA256:
+        memcpy(hash->sha256.h, sha256_iv, sizeof(sha256_iv));
+        break;
+    default:
+        break;
+    }
+}
+
+void
+hash_update(struct hash *hash, const void *buf, size_t len)
+{
+    switch (hash->type) {
+    case CONFIG_SCAN_HASH_XXH64:
+        xxh64_update(hash, buf, len);
+        break;
+    case CONFIG_SCAN_HASH_SHA256:
+        sha256_update(hash, buf, len);
+        break;
+    default:
+        return;
+    }
+
+    hash->total_len += len;
+}
+
+int
+hash_final(struct hash *hash, char *str, size_t str_len)
+{
+    uint8_t digest[32];
+    size_t i;
+    int len;
+
+    switch (hash->type) {
+    case CONFIG_SCAN_HASH_XXH64:
+        len = snprintf(str, str_len, "xxh64:%016llx",
+                       (unsigned long long) xxh64_digest(hash));
+        break;
+    case CONFIG_SCAN_HASH_SHA256:
+        sha256_digest(hash, digest);
+        len = snprintf(str, str_len, "sha256:");
+        for (i = 0; i < sizeof(digest) && len > 0 && (size_t) len < str_len; ++i) {
+            len += snprintf(str + len, str_len - (size_t) len, "%02x", digest[i]);
+        }
+        break;
+    default:
+        return -1;
+    }
+
+    if (len < 0 || (size_t) len >= str_len) {
+        return -1;
+    }
+
+    return 0;
+}
+
+const char *
+hash_str_hex(const char *str)
+{
+    const char *hex = strchr(str, ':');
+
+    return hex ? hex + 1 : str;
+}
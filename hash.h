@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#ifndef BROTHER_HASH_H
+#define BROTHER_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* enough for "sha256:" and 64 hex digits */
+#define HASH_MAX_STR_LEN 72
+
+/*
+ * Incremental page digest, fed with the page data as it's received.
+ * type is one of CONFIG_SCAN_HASH_*.
+ */
+struct hash {
+    int type;
+    uint64_t total_len;
+
+    union {
+        struct {
+            uint64_t v[4];
+            uint8_t mem[32];
+            size_t mem_len;
+        } xxh64;
+        struct {
+            uint32_t h[8];
+            uint8_t mem[64];
+            size_t mem_len;
+        } sha256;
+    };
+};
+
+void hash_init(struct hash *hash, int type);
+void hash_update(struct hash *hash, const void *buf, size_t len);
+
+/**
+ * Write the digest as "<type>:<hex>" into str, which should be
+ * at least HASH_MAX_STR_LEN bytes long. Returns -1 if hashing
+ * is disabled.
+ */
+int hash_final(struct hash *hash, char *str, size_t str_len);
+
+/**
+ * Just the hex digits of a string produced by hash_final().
+ */
+const char *hash_str_hex(const char *str);
+
+#endif //BROTHER_HASH_H
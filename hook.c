@@ -0,0 +1,418 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/wait.h>
+#include "hook.h"
+#include "config.h"
+#include "log.h"
+
+#define HOOK_MAX_ARGS 16
+
+struct hook_job {
+    char *argv[HOOK_MAX_ARGS + 1];
+    int argc;
+    char *strbuf;
+    /* environ with the extra variables appended, or NULL */
+    char **envp;
+    char *envbuf;
+    /* the job's own link to the file, removed once the hook is done */
+    char *link_path;
+    time_t submit_time;
+};
+
+/* a job that didn't fit in the queue */
+struct hook_overflow_job {
+    struct hook_job job;
+    TAILQ_ENTRY(hook_overflow_job) tailq;
+};
+
+struct hook_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    struct hook_job *jobs;
+    unsigned size;
+    unsigned head;
+    unsigned count;
+    /* moved to the queue as it empties, so the order is kept */
+    TAILQ_HEAD(, hook_overflow_job) overflow;
+    unsigned overflow_count;
+    unsigned num_workers;
+    pthread_t *workers;
+    bool stopping;
+
+    /* backpressure accounting */
+    unsigned long submitted;
+    unsigned long failed;
+    unsigned long overflowed;
+    unsigned long dropped;
+    unsigned max_count;
+    unsigned max_overflow_count;
+};
+
+static struct hook_pool g_pools[CONFIG_SCAN_MAX_FUNCS];
+/* makes the names of the jobs' links unique */
+static atomic_uint g_link_seq;
+/* closes everything but stdio in the hooks, in case some fd isn't O_CLOEXEC */
+static posix_spawn_file_actions_t g_spawn_actions;
+
+static void
+hook_job_free(struct hook_job *job)
+{
+    if (job->link_path) {
+        /* the hook might have moved it already */
+        if (unlink(job->link_path) != 0 && errno != ENOENT) {
+            LOG_WARN("Cannot remove '%s': %s\n", job->link_path, strerror(errno));
+        }
+        free(job->link_path);
+    }
+    free(job->envp);
+    free(job->envbuf);
+    free(job->strbuf);
+}
+
+/* the daemon never modifies its environment, so environ can be shared */
+static int
+hook_job_init_env(struct hook_job *job, const char *const *env)
+{
+    size_t env_count = 0, extra_count = 0, buf_len = 0, len, i;
+    char *buf;
+
+    job->envp = NULL;
+    job->envbuf = NULL;
+    if (env == NULL || env[0] == NULL) {
+        return 0;
+    }
+
+    while (environ[env_count]) {
+        ++env_count;
+    }
+
+    for (; env[extra_count]; ++extra_count) {
+        buf_len += strlen(env[extra_count]) + 1;
+    }
+
+    job->envp = calloc(env_count + extra_count + 1, sizeof(*job->envp));
+    job->envbuf = buf = malloc(buf_len);
+    if (job->envp == NULL || job->envbuf == NULL) {
+        /* freed by the caller */
+        return -1;
+    }
+
+    memcpy(job->envp, environ, env_count * sizeof(*job->envp));
+    for (i = 0; i < extra_count; ++i) {
+        len = strlen(env[i]) + 1;
+        memcpy(buf, env[i], len);
+        job->envp[env_count + i] = buf;
+        buf += len;
+    }
+
+    return 0;
+}
+
+/*
+ * Link the file under a hidden name only this job knows, so the hook
+ * still gets this page if another one is published at path meanwhile.
+ */
+static char *
+hook_job_link(const char *path)
+{
+    const char *base;
+    char *link_path;
+
+    base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    if (asprintf(&link_path, "%.*s.hook-%d-%u-%s", (int) (base - path), path,
+                 (int) getpid(), atomic_fetch_add(&g_link_seq, 1), base) < 0) {
+        return NULL;
+    }
+
+    if (link(path, link_path) != 0) {
+        LOG_WARN("Cannot link '%s' for the hook, passing it as is: %s\n", path,
+                 strerror(errno));
+        free(link_path);
+        return NULL;
+    }
+
+    return link_path;
+}
+
+static int
+hook_job_init(struct hook_job *job, const char *cmd, const char *ip,
+              const char *path, const char *const *env)
+{
+    char *saveptr, *tok;
+    int argc = 0;
+
+    job->envp = NULL;
+    job->envbuf = NULL;
+    job->link_path = hook_job_link(path);
+    if (asprintf(&job->strbuf, "%s %s %s", cmd, ip,
+                 job->link_path ? job->link_path : path) < 0) {
+        job->strbuf = NULL;
+        goto err;
+    }
+
+    for (tok = strtok_r(job->strbuf, " \t", &saveptr); tok;
+         tok = strtok_r(NULL, " \t", &saveptr)) {
+        if (argc == HOOK_MAX_ARGS) {
+            LOG_ERR("Hook '%s' has too many arguments.\n", cmd);
+            goto err;
+        }
+        job->argv[argc++] = tok;
+    }
+
+    job->argv[argc] = NULL;
+    job->argc = argc;
+    job->submit_time = time(NULL);
+
+    if (hook_job_init_env(job, env) != 0) {
+        goto err;
+    }
+
+    return 0;
+
+err:
+    hook_job_free(job);
+    return -1;
+}
+
+static void
+hook_job_run(struct hook_pool *pool, struct hook_job *job)
+{
+    pid_t pid;
+    int rc, status;
+
+    rc = posix_spawnp(&pid, job->argv[0], &g_spawn_actions, NULL, job->argv,
+                      job->envp ? job->envp : environ);
+    if (rc != 0) {
+        LOG_ERR("Failed to spawn hook '%s': %s\n", job->argv[0], strerror(rc));
+        goto err;
+    }
+
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            LOG_ERR("waitpid() failed for hook '%s': %s\n", job->argv[0],
+                    strerror(errno));
+            goto err;
+        }
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        LOG_WARN("Hook '%s' failed for '%s' (status %d).\n", job->argv[0],
+                 job->argv[job->argc - 1], status);
+        goto err;
+    }
+
+    LOG_DEBUG("Hook '%s' finished for '%s' %.0fs after submission.\n",
+              job->argv[0], job->argv[job->argc - 1],
+              difftime(time(NULL), job->submit_time));
+    return;
+
+err:
+    pthread_mutex_lock(&pool->lock);
+    pool->failed++;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void *
+hook_worker(void *arg)
+{
+    struct hook_pool *pool = arg;
+    struct hook_overflow_job *overflow_job;
+    struct hook_job job;
+
+    while (true) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->count == 0 && !pool->stopping) {
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+        }
+
+        if (pool->count == 0) {
+            /* stopping and nothing left to run */
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+
+        job = pool->jobs[pool->head];
+        pool->head = (pool->head + 1) % pool->size;
+        pool->count--;
+
+        overflow_job = TAILQ_FIRST(&pool->overflow);
+        if (overflow_job != NULL) {
+            TAILQ_REMOVE(&pool->overflow, overflow_job, tailq);
+            pool->overflow_count--;
+            pool->jobs[(pool->head + pool->count) % pool->size] = overflow_job->job;
+            pool->count++;
+            free(overflow_job);
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        hook_job_run(pool, &job);
+        hook_job_free(&job);
+    }
+
+    return NULL;
+}
+
+int
+hook_submit(int func, const char *cmd, const char *ip, const char *path,
+            const char *const *env)
+{
+    struct hook_pool *pool = &g_pools[func];
+    struct hook_overflow_job *overflow_job;
+    struct hook_job job;
+
+    if (pool->num_workers == 0) {
+        LOG_ERR("Hook workers for %s are not running.\n", g_scan_func_str[func]);
+        return -1;
+    }
+
+    if (hook_job_init(&job, cmd, ip, path, env) != 0) {
+        LOG_ERR("%s: couldn't prepare user hook.\n", ip);
+        return -1;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->stopping) {
+        pthread_mutex_unlock(&pool->lock);
+        hook_job_free(&job);
+        return -1;
+    }
+
+    if (pool->count == pool->size && g_config.hook_queue_drop) {
+        pool->dropped++;
+        pthread_mutex_unlock(&pool->lock);
+        LOG_WARN("%s: %s hook queue is full (%u jobs), not running the hook "
+                 "for %s.\n", ip, g_scan_func_str[func], pool->size, path);
+        hook_job_free(&job);
+        return -1;
+    }
+
+    /* never hold up the caller, it may be serving other scanners too */
+    if (pool->count == pool->size) {
+        overflow_job = malloc(sizeof(*overflow_job));
+        if (overflow_job == NULL) {
+            pthread_mutex_unlock(&pool->lock);
+            LOG_ERR("%s: failed to malloc an overflow hook job.\n", ip);
+            hook_job_free(&job);
+            return -1;
+        }
+
+        if (pool->overflow_count == 0) {
+            LOG_WARN("%s: %s hook queue is full (%u jobs), keeping the next "
+                     "ones in memory.\n", ip, g_scan_func_str[func], pool->size);
+        }
+
+        overflow_job->job = job;
+        TAILQ_INSERT_TAIL(&pool->overflow, overflow_job, tailq);
+        pool->overflowed++;
+        if (++pool->overflow_count > pool->max_overflow_count) {
+            pool->max_overflow_count = pool->overflow_count;
+        }
+    } else {
+        pool->jobs[(pool->head + pool->count) % pool->size] = job;
+        pool->count++;
+        if (pool->count > pool->max_count) {
+            pool->max_count = pool->count;
+        }
+    }
+    pool->submitted++;
+
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+int
+hook_lib_init(void)
+{
+    struct hook_pool *pool;
+    int i, rc;
+    unsigned j;
+
+    rc = posix_spawn_file_actions_init(&g_spawn_actions);
+    if (rc == 0) {
+        rc = posix_spawn_file_actions_addclosefrom_np(&g_spawn_actions, 3);
+    }
+    if (rc != 0) {
+        LOG_FATAL("Failed to set up the hook file actions: %s.\n", strerror(rc));
+        return -1;
+    }
+
+    for (i = 0; i < CONFIG_SCAN_MAX_FUNCS; ++i) {
+        pool = &g_pools[i];
+
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->not_empty, NULL);
+        TAILQ_INIT(&pool->overflow);
+
+        pool->size = g_config.hook_queue_size;
+        pool->jobs = calloc(pool->size, sizeof(*pool->jobs));
+        pool->workers = calloc(g_config.hook_concurrency[i], sizeof(*pool->workers));
+        if (pool->jobs == NULL || pool->workers == NULL) {
+            LOG_FATAL("Failed to allocate the %s hook pool.\n", g_scan_func_str[i]);
+            return -1;
+        }
+
+        for (j = 0; j < g_config.hook_concurrency[i]; ++j) {
+            rc = pthread_create(&pool->workers[j], NULL, hook_worker, pool);
+            if (rc != 0) {
+                LOG_FATAL("pthread_create() failed: %s.\n", strerror(rc));
+                return -1;
+            }
+            pool->num_workers++;
+        }
+    }
+
+    return 0;
+}
+
+/* run whatever is still queued and wait for it */
+void
+hook_lib_shutdown(void)
+{
+    struct hook_pool *pool;
+    unsigned j;
+    int i;
+
+    for (i = 0; i < CONFIG_SCAN_MAX_FUNCS; ++i) {
+        pool = &g_pools[i];
+        if (pool->num_workers == 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        pool->stopping = true;
+        pthread_cond_broadcast(&pool->not_empty);
+        pthread_mutex_unlock(&pool->lock);
+
+        for (j = 0; j < pool->num_workers; ++j) {
+            pthread_join(pool->workers[j], NULL);
+        }
+
+        LOG_INFO("%s hooks: %lu run, %lu failed, %lu overflowed, %lu dropped, "
+                 "max queue depth %u/%u+%u.\n", g_scan_func_str[i],
+                 pool->submitted, pool->failed, pool->overflowed, pool->dropped,
+                 pool->max_count, pool->size, pool->max_overflow_count);
+
+        pool->num_workers = 0;
+        free(pool->workers);
+        free(pool->jobs);
+    }
+
+    posix_spawn_file_actions_destroy(&g_spawn_actions);
+}
@@ -0,0 +1,25 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#ifndef BROTHER_HOOK_H
+#define BROTHER_HOOK_H
+
+int hook_lib_init(void);
+void hook_lib_shutdown(void);
+
+/**
+ * Queue the user hook of given scan function. The command is split on
+ * whitespace and run without a shell, with ip and a private hard link to
+ * path as two additional arguments. The link is removed once the hook
+ * exits. env is an optional NULL-terminated list of NAME=VALUE
+ * strings to add to the hook's environment. Never blocks; if the
+ * function's queue is full, the job is kept on an unbounded overflow
+ * list, or dropped with -1 returned if hook.queue.drop is set.
+ */
+int hook_submit(int func, const char *cmd, const char *ip, const char *path,
+                const char *const *env);
+
+#endif //BROTHER_HOOK_H
@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "io_worker.h"
+#include "config.h"
+#include "log.h"
+
+struct io_worker_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    TAILQ_HEAD(, io_job) jobs;
+    unsigned num_workers;
+    pthread_t *workers;
+    bool stopping;
+
+    unsigned long done;
+    unsigned max_count;
+    unsigned count;
+};
+
+static struct io_worker_pool g_pool;
+
+static void *
+io_worker(void *arg)
+{
+    struct io_job *job;
+    uint64_t one = 1;
+    int done_fd;
+
+    pthread_mutex_lock(&g_pool.lock);
+    while (true) {
+        while (TAILQ_EMPTY(&g_pool.jobs) && !g_pool.stopping) {
+            pthread_cond_wait(&g_pool.not_empty, &g_pool.lock);
+        }
+
+        job = TAILQ_FIRST(&g_pool.jobs);
+        if (job == NULL) {
+            break;
+        }
+
+        TAILQ_REMOVE(&g_pool.jobs, job, tailq);
+        g_pool.count--;
+        pthread_mutex_unlock(&g_pool.lock);
+
+        /* the job may be gone once fn returns */
+        done_fd = job->done_fd;
+        job->fn(job->arg);
+        if (done_fd >= 0 && write(done_fd, &one, sizeof(one)) < 0) {
+            LOG_ERR("Failed to signal io job completion: %s\n", strerror(errno));
+        }
+
+        pthread_mutex_lock(&g_pool.lock);
+        g_pool.done++;
+    }
+    pthread_mutex_unlock(&g_pool.lock);
+
+    return NULL;
+}
+
+int
+io_worker_submit(struct io_job *job)
+{
+    if (g_pool.num_workers == 0) {
+        job->fn(job->arg);
+        return 1;
+    }
+
+    pthread_mutex_lock(&g_pool.lock);
+    TAILQ_INSERT_TAIL(&g_pool.jobs, job, tailq);
+    if (++g_pool.count > g_pool.max_count) {
+        g_pool.max_count = g_pool.count;
+    }
+    pthread_cond_signal(&g_pool.not_empty);
+    pthread_mutex_unlock(&g_pool.lock);
+    return 0;
+}
+
+int
+io_worker_lib_init(void)
+{
+    unsigned num_workers = g_config.reactor_io_threads;
+    unsigned i;
+    int rc;
+
+    /* the dedicated threads may just as well block themselves */
+    if (g_config.reactor_threads == 0) {
+        return 0;
+    }
+
+    if (num_workers == 0) {
+        num_workers = g_config.reactor_threads;
+    }
+
+    pthread_mutex_init(&g_pool.lock, NULL);
+    pthread_cond_init(&g_pool.not_empty, NULL);
+    TAILQ_INIT(&g_pool.jobs);
+
+    g_pool.workers = calloc(num_workers, sizeof(*g_pool.workers));
+    if (g_pool.workers == NULL) {
+        LOG_FATAL("Failed to allocate %u io workers.\n", num_workers);
+        return -1;
+    }
+
+    for (i = 0; i < num_workers; ++i) {
+        rc = pthread_create(&g_pool.workers[i], NULL, io_worker, NULL);
+        if (rc != 0) {
+            LOG_FATAL("pthread_create() failed: %s.\n", strerror(rc));
+            return -1;
+        }
+        g_pool.num_workers++;
+    }
+
+    return 0;
+}
+
+void
+io_worker_lib_shutdown(void)
+{
+    unsigned i;
+
+    if (g_pool.num_workers == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_pool.lock);
+    g_pool.stopping = true;
+    pthread_cond_broadcast(&g_pool.not_empty);
+    pthread_mutex_unlock(&g_pool.lock);
+
+    for (i = 0; i < g_pool.num_workers; ++i) {
+        pthread_join(g_pool.workers[i], NULL);
+    }
+
+    LOG_INFO("IO workers: %lu jobs done, max queue depth %u.\n",
+             g_pool.done, g_pool.max_count);
+
+    g_pool.num_workers = 0;
+    free(g_pool.workers);
+}
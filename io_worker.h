@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#ifndef BROTHER_IO_WORKER_H
+#define BROTHER_IO_WORKER_H
+
+#include <sys/queue.h>
+
+/*
+ * Threads doing the blocking file work of the pages, so the shared event
+ * loops only ever wait for the network.
+ */
+struct io_job {
+    void (*fn)(void *arg);
+    void *arg;
+    /*
+     * eventfd written to once fn returns, or -1. If set, fn must not
+     * free the job, as its owner may reuse it right away.
+     */
+    int done_fd;
+    TAILQ_ENTRY(io_job) tailq;
+};
+
+/**
+ * Start reactor.io.threads workers if the shared event loops are used.
+ * Without them, the jobs are run on the submitting thread.
+ */
+int io_worker_lib_init(void);
+
+/**
+ * Run whatever is still queued and wait for it.
+ */
+void io_worker_lib_shutdown(void);
+
+/**
+ * Queue the job to a worker. Returns 0 if it was queued, or 1 if there
+ * are no workers and the job was run on the calling thread already, in
+ * which case done_fd is not written to.
+ */
+int io_worker_submit(struct io_job *job);
+
+#endif //BROTHER_IO_WORKER_H
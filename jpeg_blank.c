@@ -0,0 +1,623 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "jpeg_blank.h"
+#include "log.h"
+
+#define JPEG_HUFF_LOOKAHEAD 9
+/* blocks with a std deviation over 16 levels contain something */
+#define JPEG_BLANK_VARIANCE 256
+/* as do blocks this much lighter or darker than the background */
+#define JPEG_BLANK_MEAN_DELTA 32
+/* 1/32 of the page on each side is skipped, it's usually scanner shadow */
+#define JPEG_BLANK_MARGIN_DIV 32
+/* zero bytes fed past the entropy coded data before giving up */
+#define JPEG_MAX_OVERRUN 64
+#define JPEG_BLOCK_BUSY 0x100
+
+struct huff_table {
+    bool valid;
+    /* (code length << 8) | symbol for codes up to JPEG_HUFF_LOOKAHEAD bits */
+    uint16_t lookup[1 << JPEG_HUFF_LOOKAHEAD];
+    int32_t maxcode[17];
+    int32_t mincode[17];
+    int valptr[17];
+    uint8_t vals[256];
+};
+
+struct jpeg_component {
+    uint8_t id;
+    uint8_t h, v;
+    uint8_t tq, td, ta;
+    int pred;
+};
+
+struct jpeg_decoder {
+    const uint8_t *p;
+    const uint8_t *end;
+    uint64_t buf;
+    int bits;
+    unsigned overrun;
+
+    uint16_t qt[4][64];
+    struct huff_table dc[4];
+    struct huff_table ac[4];
+    struct jpeg_component comps[4];
+    unsigned num_comps;
+    unsigned width, height;
+    unsigned hmax, vmax;
+    unsigned restart_interval;
+};
+
+static inline unsigned
+read_be16(const uint8_t *p)
+{
+    return (unsigned) (p[0] << 8 | p[1]);
+}
+
+static int
+build_huff_table(struct huff_table *table, const uint8_t *counts,
+                 const uint8_t *vals, unsigned num_vals)
+{
+    unsigned len, i, j, k = 0, fill;
+    int32_t code = 0;
+
+    memset(table, 0, sizeof(*table));
+    memcpy(table->vals, vals, num_vals);
+
+    for (len = 1; len <= 16; ++len) {
+        table->valptr[len] = (int) k;
+        table->mincode[len] = code;
+
+        for (i = 0; i < counts[len - 1]; ++i) {
+            if (len <= JPEG_HUFF_LOOKAHEAD) {
+                fill = 1u << (JPEG_HUFF_LOOKAHEAD - len);
+                for (j = 0; j < fill; ++j) {
+                    table->lookup[((unsigned) code << (JPEG_HUFF_LOOKAHEAD - len)) | j] =
+                        (uint16_t) (len << 8 | vals[k]);
+                }
+            }
+
+            ++code;
+            ++k;
+        }
+
+        if (code > (1 << len)) {
+            return -1;
+        }
+
+        table->maxcode[len] = counts[len - 1] ? code - 1 : -1;
+        code <<= 1;
+    }
+
+    table->valid = true;
+    return 0;
+}
+
+static void
+fill_bits(struct jpeg_decoder *dec)
+{
+    uint64_t word;
+    unsigned num_bytes, i;
+    uint8_t byte;
+
+    if (dec->end - dec->p >= 8) {
+        word = 0;
+        for (i = 0; i < 8; ++i) {
+            word = word << 8 | dec->p[i];
+        }
+
+        /* if there's no 0xFF byte, there's no stuffing or marker to care about */
+        if (((~word - 0x0101010101010101ULL) & word & 0x8080808080808080ULL) == 0) {
+            num_bytes = (unsigned) (64 - dec->bits) / 8;
+            dec->buf |= (word & (~0ULL << (64 - num_bytes * 8))) >> dec->bits;
+            dec->bits += (int) num_bytes * 8;
+            dec->p += num_bytes;
+            return;
+        }
+    }
+
+    while (dec->bits <= 56) {
+        byte = 0;
+        if (dec->p < dec->end && dec->p[0] != 0xFF) {
+            byte = *dec->p++;
+        } else if (dec->p + 1 < dec->end && dec->p[0] == 0xFF && dec->p[1] == 0x00) {
+            byte = 0xFF;
+            dec->p += 2;
+        } else {
+            /* a marker or the end of data, feed zeros */
+            dec->overrun++;
+        }
+
+        dec->buf |= (uint64_t) byte << (56 - dec->bits);
+        dec->bits += 8;
+    }
+}
+
+static inline void
+skip_bits(struct jpeg_decoder *dec, int n)
+{
+    dec->buf <<= n;
+    dec->bits -= n;
+}
+
+static int
+decode_huff(struct jpeg_decoder *dec, const struct huff_table *table)
+{
+    unsigned entry, len;
+    int32_t code;
+
+    if (dec->bits < 16) {
+        fill_bits(dec);
+    }
+
+    entry = table->lookup[dec->buf >> (64 - JPEG_HUFF_LOOKAHEAD)];
+    if (entry != 0) {
+        skip_bits(dec, (int) (entry >> 8));
+        return (int) (entry & 0xFF);
+    }
+
+    for (len = JPEG_HUFF_LOOKAHEAD + 1; len <= 16; ++len) {
+        code = (int32_t) (dec->buf >> (64 - len));
+        if (code <= table->maxcode[len]) {
+            skip_bits(dec, (int) len);
+            return table->vals[table->valptr[len] + code - table->mincode[len]];
+        }
+    }
+
+    return -1;
+}
+
+static int
+receive_extend(struct jpeg_decoder *dec, int s)
+{
+    int v;
+
+    if (dec->bits < s) {
+        fill_bits(dec);
+    }
+
+    v = (int) (dec->buf >> (64 - s));
+    skip_bits(dec, s);
+
+    if (v < (1 << (s - 1))) {
+        v += (int) (~0u << s) + 1;
+    }
+
+    return v;
+}
+
+/*
+ * Entropy decode a single block. If ret is given, it's set to the
+ * block mean with JPEG_BLOCK_BUSY or'ed in for high variance blocks.
+ */
+static int
+decode_block(struct jpeg_decoder *dec, struct jpeg_component *comp, unsigned *ret)
+{
+    const uint16_t *qt = dec->qt[comp->tq];
+    uint64_t sum_sq = 0;
+    int s, r, rs, k, mean;
+    int64_t coef;
+
+    s = decode_huff(dec, &dec->dc[comp->td]);
+    if (s < 0 || s > 11) {
+        return -1;
+    }
+
+    if (s > 0) {
+        comp->pred += receive_extend(dec, s);
+    }
+
+    for (k = 1; k < 64;) {
+        rs = decode_huff(dec, &dec->ac[comp->ta]);
+        if (rs < 0) {
+            return -1;
+        }
+
+        r = rs >> 4;
+        s = rs & 15;
+        if (s == 0) {
+            if (r != 15) {
+                break;
+            }
+
+            k += 16;
+            continue;
+        }
+
+        k += r;
+        if (k > 63) {
+            return -1;
+        }
+
+        coef = receive_extend(dec, s);
+        if (ret) {
+            coef *= qt[k];
+            sum_sq += (uint64_t) (coef * coef);
+        }
+        ++k;
+    }
+
+    if (ret) {
+        /* the DCT is orthonormal, so DC is 8x the mean and AC energy is 64x the variance */
+        mean = comp->pred * qt[0] / 8 + 128;
+        mean = mean < 0 ? 0 : mean > 255 ? 255 : mean;
+        *ret = (unsigned) mean;
+        if (sum_sq / 64 > JPEG_BLANK_VARIANCE) {
+            *ret |= JPEG_BLOCK_BUSY;
+        }
+    }
+
+    return 0;
+}
+
+static int
+parse_dqt(struct jpeg_decoder *dec, const uint8_t *p, const uint8_t *end)
+{
+    unsigned id, precision, i;
+
+    while (p < end) {
+        precision = p[0] >> 4;
+        id = p[0] & 15;
+        ++p;
+
+        if (id > 3 || p + 64 * (precision + 1) > end) {
+            return -1;
+        }
+
+        for (i = 0; i < 64; ++i) {
+            dec->qt[id][i] = (uint16_t) (precision ? read_be16(p + i * 2) : p[i]);
+        }
+
+        p += 64 * (precision + 1);
+    }
+
+    return 0;
+}
+
+static int
+parse_dht(struct jpeg_decoder *dec, const uint8_t *p, const uint8_t *end)
+{
+    struct huff_table *table;
+    unsigned num_vals, i;
+
+    while (p + 17 <= end) {
+        if ((p[0] & 15) > 3) {
+            return -1;
+        }
+
+        table = (p[0] >> 4) ? &dec->ac[p[0] & 15] : &dec->dc[p[0] & 15];
+
+        num_vals = 0;
+        for (i = 0; i < 16; ++i) {
+            num_vals += p[1 + i];
+        }
+
+        if (num_vals > 256 || p + 17 + num_vals > end) {
+            return -1;
+        }
+
+        if (build_huff_table(table, p + 1, p + 17, num_vals) != 0) {
+            return -1;
+        }
+
+        p += 17 + num_vals;
+    }
+
+    return 0;
+}
+
+static int
+parse_sof(struct jpeg_decoder *dec, const uint8_t *p, const uint8_t *end)
+{
+    struct jpeg_component *comp;
+    unsigned i;
+
+    if (p + 6 > end || p[0] != 8) {
+        return -1;
+    }
+
+    dec->height = read_be16(p + 1);
+    dec->width = read_be16(p + 3);
+    dec->num_comps = p[5];
+    if (dec->width == 0 || dec->height == 0 || dec->num_comps == 0 ||
+        dec->num_comps > 4 || p + 6 + dec->num_comps * 3 > end) {
+        return -1;
+    }
+
+    for (i = 0; i < dec->num_comps; ++i) {
+        comp = &dec->comps[i];
+        comp->id = p[6 + i * 3];
+        comp->h = p[7 + i * 3] >> 4;
+        comp->v = p[7 + i * 3] & 15;
+        comp->tq = p[8 + i * 3] & 3;
+        if (comp->h == 0 || comp->h > 4 || comp->v == 0 || comp->v > 4) {
+            return -1;
+        }
+
+        if (comp->h > dec->hmax) {
+            dec->hmax = comp->h;
+        }
+
+        if (comp->v > dec->vmax) {
+            dec->vmax = comp->v;
+        }
+    }
+
+    return 0;
+}
+
+static int
+restart(struct jpeg_decoder *dec)
+{
+    struct jpeg_component *comp;
+
+    while (dec->p + 1 < dec->end && dec->p[0] == 0xFF && dec->p[1] == 0xFF) {
+        dec->p++;
+    }
+
+    if (dec->p + 1 >= dec->end || dec->p[0] != 0xFF ||
+        dec->p[1] < 0xD0 || dec->p[1] > 0xD7) {
+        return -1;
+    }
+
+    dec->p += 2;
+    dec->buf = 0;
+    dec->bits = 0;
+    dec->overrun = 0;
+    for (comp = dec->comps; comp < dec->comps + dec->num_comps; ++comp) {
+        comp->pred = 0;
+    }
+
+    return 0;
+}
+
+static void
+compute_stats(const uint16_t *blocks, unsigned num_blocks,
+              struct jpeg_blank_stats *stats)
+{
+    unsigned hist[256] = { 0 };
+    unsigned i, j, sum, best = 0, mean;
+
+    for (i = 0; i < num_blocks; ++i) {
+        if (!(blocks[i] & JPEG_BLOCK_BUSY)) {
+            hist[blocks[i] & 0xFF]++;
+        }
+    }
+
+    /* the background is the most common brightness, +-2 levels */
+    stats->background = 255;
+    for (i = 0; i < 256; ++i) {
+        sum = 0;
+        for (j = i < 2 ? 0 : i - 2; j <= i + 2 && j < 256; ++j) {
+            sum += hist[j];
+        }
+
+        if (sum > best) {
+            best = sum;
+            stats->background = i;
+        }
+    }
+
+    stats->blocks = num_blocks;
+    stats->content_blocks = 0;
+    for (i = 0; i < num_blocks; ++i) {
+        mean = blocks[i] & 0xFF;
+        if ((blocks[i] & JPEG_BLOCK_BUSY) ||
+            mean + JPEG_BLANK_MEAN_DELTA < stats->background ||
+            mean > stats->background + JPEG_BLANK_MEAN_DELTA) {
+            stats->content_blocks++;
+        }
+    }
+}
+
+static int
+decode_scan(struct jpeg_decoder *dec, struct jpeg_component **scan_comps,
+            unsigned num_scan_comps, struct jpeg_blank_stats *stats)
+{
+    struct jpeg_component *luma = &dec->comps[0], *comp;
+    unsigned luma_w, luma_h, margin_x, margin_y;
+    unsigned mcus_x, mcus_y, mcu, num_mcus, num_blocks = 0;
+    unsigned bx, by, h, v, c, value;
+    uint16_t *blocks;
+    int rc = -1;
+
+    /* luma size in blocks */
+    luma_w = ((dec->width * luma->h + dec->hmax - 1) / dec->hmax + 7) / 8;
+    luma_h = ((dec->height * luma->v + dec->vmax - 1) / dec->vmax + 7) / 8;
+    margin_x = luma_w / JPEG_BLANK_MARGIN_DIV;
+    margin_y = luma_h / JPEG_BLANK_MARGIN_DIV;
+
+    if (num_scan_comps == 1) {
+        mcus_x = luma_w;
+        mcus_y = luma_h;
+    } else {
+        mcus_x = (dec->width + 8 * dec->hmax - 1) / (8 * dec->hmax);
+        mcus_y = (dec->height + 8 * dec->vmax - 1) / (8 * dec->vmax);
+    }
+
+    blocks = malloc(luma_w * luma_h * sizeof(*blocks));
+    if (blocks == NULL) {
+        return -1;
+    }
+
+    num_mcus = mcus_x * mcus_y;
+    for (mcu = 0; mcu < num_mcus; ++mcu) {
+        if (dec->restart_interval && mcu > 0 && mcu % dec->restart_interval == 0 &&
+            restart(dec) != 0) {
+            goto out;
+        }
+
+        for (c = 0; c < num_scan_comps; ++c) {
+            comp = scan_comps[c];
+            for (v = 0; v < (num_scan_comps == 1 ? 1u : comp->v); ++v) {
+                for (h = 0; h < (num_scan_comps == 1 ? 1u : comp->h); ++h) {
+                    if (comp != luma) {
+                        if (decode_block(dec, comp, NULL) != 0) {
+                            goto out;
+                        }
+                        continue;
+                    }
+
+                    if (num_scan_comps == 1) {
+                        bx = mcu % mcus_x;
+                        by = mcu / mcus_x;
+                    } else {
+                        bx = (mcu % mcus_x) * comp->h + h;
+                        by = (mcu / mcus_x) * comp->v + v;
+                    }
+
+                    if (decode_block(dec, comp, &value) != 0) {
+                        goto out;
+                    }
+
+                    if (bx >= margin_x && bx + margin_x < luma_w &&
+                        by >= margin_y && by + margin_y < luma_h) {
+                        blocks[num_blocks++] = (uint16_t) value;
+                    }
+                }
+            }
+        }
+
+        if (dec->overrun > JPEG_MAX_OVERRUN) {
+            /*
+             * truncated or corrupt. The content might be just in the
+             * part that's missing, so don't tell anything
+             */
+            goto out;
+        }
+    }
+
+    rc = num_blocks > 0 ? 0 : -1;
+    if (rc == 0) {
+        compute_stats(blocks, num_blocks, stats);
+    }
+
+out:
+    free(blocks);
+    return rc;
+}
+
+static int
+parse_sos(struct jpeg_decoder *dec, const uint8_t *p, const uint8_t *end,
+          struct jpeg_blank_stats *stats)
+{
+    struct jpeg_component *scan_comps[4];
+    unsigned num_scan_comps, i, j;
+    bool has_luma = false;
+
+    if (p + 1 > end || p[0] == 0 || p[0] > dec->num_comps ||
+        p + 1 + p[0] * 2 + 3 > end) {
+        return -1;
+    }
+
+    num_scan_comps = p[0];
+    for (i = 0; i < num_scan_comps; ++i) {
+        for (j = 0; j < dec->num_comps; ++j) {
+            if (dec->comps[j].id == p[1 + i * 2]) {
+                break;
+            }
+        }
+
+        if (j == dec->num_comps) {
+            return -1;
+        }
+
+        scan_comps[i] = &dec->comps[j];
+        scan_comps[i]->td = p[2 + i * 2] >> 4 & 3;
+        scan_comps[i]->ta = p[2 + i * 2] & 3;
+        if (!dec->dc[scan_comps[i]->td].valid || !dec->ac[scan_comps[i]->ta].valid) {
+            return -1;
+        }
+
+        has_luma |= j == 0;
+    }
+
+    if (!has_luma) {
+        return -1;
+    }
+
+    return decode_scan(dec, scan_comps, num_scan_comps, stats);
+}
+
+int
+jpeg_blank_analyze(const void *data, size_t len, struct jpeg_blank_stats *stats)
+{
+    const uint8_t *p = data, *end = p + len, *seg_end;
+    struct jpeg_decoder *dec;
+    unsigned marker;
+    int rc = -1;
+
+    if (len < 4 || p[0] != 0xFF || p[1] != 0xD8) {
+        return -1;
+    }
+
+    dec = calloc(1, sizeof(*dec));
+    if (dec == NULL) {
+        return -1;
+    }
+
+    p += 2;
+    while (p + 4 <= end) {
+        if (p[0] != 0xFF) {
+            break;
+        }
+
+        marker = p[1];
+        if (marker == 0xFF) {
+            ++p;
+            continue;
+        }
+
+        seg_end = p + 2 + read_be16(p + 2);
+        if (seg_end > end || seg_end < p + 4) {
+            break;
+        }
+
+        p += 4;
+        if (marker == 0xDB) {
+            rc = parse_dqt(dec, p, seg_end);
+        } else if (marker == 0xC4) {
+            rc = parse_dht(dec, p, seg_end);
+        } else if (marker == 0xC0 || marker == 0xC1) {
+            rc = parse_sof(dec, p, seg_end);
+        } else if (marker == 0xDD) {
+            rc = seg_end - p >= 2 ? 0 : -1;
+            if (rc == 0) {
+                dec->restart_interval = read_be16(p);
+            }
+        } else if (marker == 0xDA) {
+            if (dec->num_comps == 0) {
+                rc = -1;
+                break;
+            }
+
+            dec->p = seg_end;
+            dec->end = end;
+            rc = parse_sos(dec, p, seg_end, stats);
+            break;
+        } else if ((marker & 0xF0) == 0xC0 && marker != 0xC8 && marker != 0xCC) {
+            /* progressive, lossless or arithmetic coded */
+            rc = -1;
+        } else {
+            rc = 0;
+        }
+
+        if (rc != 0) {
+            break;
+        }
+
+        p = seg_end;
+        rc = -1;
+    }
+
+    free(dec);
+    return rc;
+}
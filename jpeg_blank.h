@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#ifndef BROTHER_JPEG_BLANK_H
+#define BROTHER_JPEG_BLANK_H
+
+#include <stddef.h>
+
+struct jpeg_blank_stats {
+    /* 8x8 luma blocks looked at, page margins excluded */
+    unsigned blocks;
+    /* blocks that differ from the page background */
+    unsigned content_blocks;
+    /* most common block brightness, 0-255 */
+    unsigned background;
+};
+
+/**
+ * Estimate how much of a baseline JPEG isn't plain background. Only
+ * the entropy coded data of the luma channel is decoded, there's no
+ * dequantization of whole blocks, IDCT or color conversion. Each block's
+ * mean comes from its DC coefficient and its variance from the sum of
+ * squared AC coefficients.
+ *
+ * Returns -1 if the image can't be analyzed, e.g. it's progressive, or
+ * its entropy-coded data is truncated or corrupt.
+ */
+int jpeg_blank_analyze(const void *data, size_t len, struct jpeg_blank_stats *stats);
+
+#endif //BROTHER_JPEG_BLANK_H
@@ -10,8 +10,14 @@
 #include <getopt.h>
 #include <string.h>
 
+#include "config.h"
 #include "device_handler.h"
 #include "event_thread.h"
+#include "hook.h"
+#include "io_worker.h"
+#include "profile_cache.h"
+#include "spool.h"
+#include "supervisor.h"
 #include "log.h"
 
 static void
@@ -37,7 +43,7 @@ print_version(void)
 int
 main(int argc, char *argv[])
 {
-    int option = 0;
+    int option = 0, rc;
     const char *config_path = "brother.config";
 
     while ((option = getopt(argc, argv, "c:h")) != -1) {
@@ -66,8 +72,53 @@ main(int argc, char *argv[])
         return -1;
     }
 
+    /* before the fork, so the workers share it */
+    if (g_config.profile_cache != NULL &&
+        profile_cache_init(g_config.profile_cache) != 0) {
+        fprintf(stderr, "Warning: continuing without the profile cache.\n");
+    }
+
+    if (g_config.workers > 1) {
+        rc = supervisor_run();
+        if (rc < 0) {
+            fprintf(stderr, "Fatal: could not start workers.\n");
+            return -1;
+        }
+
+        if (rc > 0) {
+            /* this is the supervisor, and all workers are done */
+            return 0;
+        }
+    }
+
+    if (hook_lib_init() != 0) {
+        fprintf(stderr, "Fatal: could not start hook workers.\n");
+        return -1;
+    }
+
+    if (spool_lib_init() != 0) {
+        fprintf(stderr, "Fatal: could not start the spool writer.\n");
+        return -1;
+    }
+
+    if (io_worker_lib_init() != 0) {
+        fprintf(stderr, "Fatal: could not start io workers.\n");
+        return -1;
+    }
+
+    if (g_config.reactor_threads > 0 &&
+        event_thread_lib_start_loops(g_config.reactor_threads) != 0) {
+        fprintf(stderr, "Fatal: could not start event loops.\n");
+        return -1;
+    }
+
     device_handler_init(config_path);
 
     event_thread_lib_wait();
+    /* may still publish documents and queue their hooks */
+    io_worker_lib_shutdown();
+    spool_lib_shutdown();
+    hook_lib_shutdown();
+    profile_cache_shutdown();
     return 0;
 }
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "notify.h"
+#include "log.h"
+
+static bool g_notify_parent;
+
+void
+notify_use_parent(void)
+{
+    g_notify_parent = true;
+}
+
+void
+notify_ready(void)
+{
+    struct sockaddr_un addr = { 0 };
+    const char *path;
+    size_t len;
+    int fd;
+
+    if (g_notify_parent) {
+        /* a realtime signal, so the ones of different workers don't merge */
+        kill(getppid(), NOTIFY_WORKER_READY_SIGNAL);
+        return;
+    }
+
+    path = getenv("NOTIFY_SOCKET");
+    if (path == NULL) {
+        return;
+    }
+
+    len = strlen(path);
+    if ((path[0] != '/' && path[0] != '@') || len < 2 || len > sizeof(addr.sun_path)) {
+        LOG_ERR("Invalid NOTIFY_SOCKET '%s'.\n", path);
+        return;
+    }
+
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, len);
+    if (path[0] == '@') {
+        /* abstract namespace */
+        addr.sun_path[0] = 0;
+    }
+
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        LOG_ERR("Cannot open a socket for NOTIFY_SOCKET: %s\n", strerror(errno));
+        return;
+    }
+
+    if (sendto(fd, "READY=1", 7, MSG_NOSIGNAL, (struct sockaddr *) &addr,
+               (socklen_t) (offsetof(struct sockaddr_un, sun_path) + len)) < 0) {
+        LOG_ERR("Cannot notify '%s': %s\n", path, strerror(errno));
+    }
+
+    close(fd);
+}
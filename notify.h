@@ -0,0 +1,29 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#ifndef BROTHER_NOTIFY_H
+#define BROTHER_NOTIFY_H
+
+#include <signal.h>
+
+/* sent by the workers to the supervisor, see notify_ready() */
+#define NOTIFY_WORKER_READY_SIGNAL SIGRTMIN
+
+/**
+ * Tell the service manager that the daemon is ready, with a "READY=1"
+ * datagram to the $NOTIFY_SOCKET, as in sd_notify(). Does nothing if
+ * the variable isn't set.
+ */
+void notify_ready(void);
+
+/**
+ * Make notify_ready() send NOTIFY_WORKER_READY_SIGNAL to the parent
+ * process instead. Used by the workers, whose readiness is collected
+ * by the supervisor.
+ */
+void notify_use_parent(void);
+
+#endif //BROTHER_NOTIFY_H
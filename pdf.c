@@ -0,0 +1,466 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include "pdf.h"
+#include "spool.h"
+#include "log.h"
+
+/* how much of a page to hold back while looking for the JPEG frame header */
+#define PDF_JPEG_HEADER_MAX_SIZE 0x10000
+#define PDF_OBJ_CATALOG 1
+#define PDF_OBJ_PAGES 2
+/* image, its length, content stream and the page itself */
+#define PDF_OBJS_PER_PAGE 4
+
+struct pdf_writer {
+    struct spool *spool;
+
+    /* file offset of each object, indexed by object number */
+    size_t *offsets;
+    unsigned obj_count;
+    unsigned obj_capacity;
+
+    unsigned *pages;
+    unsigned page_count;
+    unsigned page_capacity;
+
+    struct pdf_page {
+        bool active;
+        bool stream_started;
+        unsigned first_obj;
+        size_t stream_offset;
+        struct pdf_page_info info;
+        uint8_t *header;
+        size_t header_len;
+        size_t parse_pos;
+    } page;
+};
+
+static int
+pdf_printf(struct pdf_writer *pdf, const char *fmt, ...)
+{
+    char buf[256];
+    va_list args;
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+
+    if (len < 0 || (size_t) len >= sizeof(buf)) {
+        return -1;
+    }
+
+    return spool_write(pdf->spool, buf, (size_t) len);
+}
+
+static int
+pdf_alloc_objs(struct pdf_writer *pdf, unsigned count)
+{
+    size_t *offsets;
+    unsigned capacity;
+
+    if (pdf->obj_count + count >= pdf->obj_capacity) {
+        capacity = (pdf->obj_capacity + count) * 2;
+        offsets = realloc(pdf->offsets, capacity * sizeof(*offsets));
+        if (offsets == NULL) {
+            LOG_ERR("Failed to realloc pdf object table.\n");
+            return -1;
+        }
+
+        pdf->offsets = offsets;
+        pdf->obj_capacity = capacity;
+    }
+
+    memset(pdf->offsets + pdf->obj_count + 1, 0, count * sizeof(*pdf->offsets));
+    pdf->obj_count += count;
+    return 0;
+}
+
+static int
+pdf_begin_obj(struct pdf_writer *pdf, unsigned num)
+{
+    pdf->offsets[num] = spool_size(pdf->spool);
+    return pdf_printf(pdf, "%u 0 obj\n", num);
+}
+
+/*
+ * Look for the SOF marker in the beginning of a JPEG stream.
+ * Returns 1 if found, 0 if more data is needed, or -1 if it's
+ * not there.
+ */
+static int
+parse_jpeg_header(struct pdf_page *page)
+{
+    const uint8_t *buf = page->header;
+    size_t len = page->header_len;
+    size_t pos = page->parse_pos;
+    uint8_t marker;
+
+    if (pos == 0) {
+        if (len < 2) {
+            return 0;
+        }
+
+        if (buf[0] != 0xFF || buf[1] != 0xD8) {
+            return -1;
+        }
+
+        pos = 2;
+    }
+
+    while (pos + 2 <= len) {
+        if (buf[pos] != 0xFF) {
+            return -1;
+        }
+
+        marker = buf[pos + 1];
+        if (marker == 0xFF) {
+            /* fill byte */
+            ++pos;
+            continue;
+        }
+
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+            pos += 2;
+            continue;
+        }
+
+        if (marker == 0xDA || marker == 0xD9) {
+            return -1;
+        }
+
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 &&
+            marker != 0xC8 && marker != 0xCC) {
+            if (pos + 10 > len) {
+                break;
+            }
+
+            page->info.height = (unsigned) (buf[pos + 5] << 8 | buf[pos + 6]);
+            page->info.width = (unsigned) (buf[pos + 7] << 8 | buf[pos + 8]);
+            page->info.components = buf[pos + 9];
+            return 1;
+        }
+
+        if (pos + 4 > len) {
+            break;
+        }
+
+        pos += 2 + (size_t) (buf[pos + 2] << 8 | buf[pos + 3]);
+    }
+
+    page->parse_pos = pos;
+    return 0;
+}
+
+static const char *
+get_color_space(unsigned components)
+{
+    switch (components) {
+    case 1:
+        return "DeviceGray";
+    case 4:
+        return "DeviceCMYK";
+    default:
+        return "DeviceRGB";
+    }
+}
+
+static int
+pdf_start_stream(struct pdf_writer *pdf, const struct pdf_page_info *info)
+{
+    struct pdf_page *page = &pdf->page;
+    int rc;
+
+    if (info->width == 0 || info->height == 0) {
+        LOG_ERR("Unknown dimensions of pdf page %u.\n", pdf->page_count + 1);
+        return -1;
+    }
+
+    if (pdf_begin_obj(pdf, page->first_obj) != 0 ||
+        pdf_printf(pdf, "<< /Type /XObject /Subtype /Image /Width %u"
+                   " /Height %u /ColorSpace /%s /BitsPerComponent 8"
+                   " /Filter /DCTDecode /Length %u 0 R >>\nstream\n",
+                   info->width, info->height,
+                   get_color_space(info->components), page->first_obj + 1) != 0) {
+        return -1;
+    }
+
+    page->info = *info;
+    page->stream_offset = spool_size(pdf->spool);
+    page->stream_started = true;
+
+    rc = spool_write(pdf->spool, page->header, page->header_len);
+    free(page->header);
+    page->header = NULL;
+    page->header_len = 0;
+    return rc;
+}
+
+struct pdf_writer *
+pdf_writer_create(struct spool *spool)
+{
+    struct pdf_writer *pdf;
+
+    pdf = calloc(1, sizeof(*pdf));
+    if (pdf == NULL) {
+        LOG_ERR("Failed to calloc pdf writer.\n");
+        return NULL;
+    }
+
+    pdf->spool = spool;
+
+    /* catalog and page tree are written last, but get the first numbers */
+    if (pdf_alloc_objs(pdf, 2) != 0) {
+        free(pdf);
+        return NULL;
+    }
+
+    if (pdf_printf(pdf, "%%PDF-1.4\n%%\xe2\xe3\xcf\xd3\n") != 0) {
+        pdf_writer_free(pdf);
+        return NULL;
+    }
+
+    return pdf;
+}
+
+int
+pdf_writer_begin_page(struct pdf_writer *pdf, const struct pdf_page_info *info)
+{
+    struct pdf_page *page = &pdf->page;
+
+    if (page->active) {
+        LOG_ERR("Previous pdf page was not finished.\n");
+        return -1;
+    }
+
+    memset(page, 0, sizeof(*page));
+    page->first_obj = pdf->obj_count + 1;
+    if (pdf_alloc_objs(pdf, PDF_OBJS_PER_PAGE) != 0) {
+        return -1;
+    }
+
+    page->info = *info;
+    page->active = true;
+    return 0;
+}
+
+int
+pdf_writer_page_data(struct pdf_writer *pdf, const void *buf, size_t len)
+{
+    struct pdf_page *page = &pdf->page;
+    struct pdf_page_info info;
+    uint8_t *header;
+    size_t copy_len;
+    int rc;
+
+    if (!page->active) {
+        return -1;
+    }
+
+    if (page->stream_started) {
+        return spool_write(pdf->spool, buf, len);
+    }
+
+    if (page->header == NULL) {
+        page->header = malloc(PDF_JPEG_HEADER_MAX_SIZE);
+        if (page->header == NULL) {
+            LOG_ERR("Failed to malloc pdf page header buffer.\n");
+            return -1;
+        }
+    }
+
+    header = page->header;
+    copy_len = PDF_JPEG_HEADER_MAX_SIZE - page->header_len;
+    if (copy_len > len) {
+        copy_len = len;
+    }
+
+    memcpy(header + page->header_len, buf, copy_len);
+    page->header_len += copy_len;
+
+    info = page->info;
+    rc = parse_jpeg_header(page);
+    if (rc == 0 && page->header_len < PDF_JPEG_HEADER_MAX_SIZE) {
+        return 0;
+    }
+
+    if (rc == 1 && page->info.width > 0 && page->info.height > 0 &&
+        page->info.components > 0) {
+        info.width = page->info.width;
+        info.height = page->info.height;
+        info.components = page->info.components;
+    } else {
+        LOG_WARN("No JPEG frame header in pdf page %u, using scan params.\n",
+                 pdf->page_count + 1);
+    }
+
+    if (pdf_start_stream(pdf, &info) != 0) {
+        return -1;
+    }
+
+    return spool_write(pdf->spool, (const uint8_t *) buf + copy_len, len - copy_len);
+}
+
+int
+pdf_writer_end_page(struct pdf_writer *pdf)
+{
+    struct pdf_page *page = &pdf->page;
+    unsigned *pages, capacity;
+    size_t stream_len;
+    double width_pt, height_pt;
+    char content[128];
+    int content_len;
+
+    if (!page->active) {
+        return -1;
+    }
+
+    if (!page->stream_started && pdf_start_stream(pdf, &page->info) != 0) {
+        return -1;
+    }
+
+    if (pdf->page_count == pdf->page_capacity) {
+        capacity = pdf->page_capacity ? pdf->page_capacity * 2 : 16;
+        pages = realloc(pdf->pages, capacity * sizeof(*pages));
+        if (pages == NULL) {
+            LOG_ERR("Failed to realloc pdf page table.\n");
+            return -1;
+        }
+
+        pdf->pages = pages;
+        pdf->page_capacity = capacity;
+    }
+
+    stream_len = spool_size(pdf->spool) - page->stream_offset;
+    width_pt = page->info.width * 72.0 / (page->info.dpi_x ? page->info.dpi_x : 72);
+    height_pt = page->info.height * 72.0 / (page->info.dpi_y ? page->info.dpi_y : 72);
+
+    content_len = snprintf(content, sizeof(content),
+                           "q %.2f 0 0 %.2f 0 0 cm /Im0 Do Q\n",
+                           width_pt, height_pt);
+    if (content_len < 0 || (size_t) content_len >= sizeof(content)) {
+        return -1;
+    }
+
+    if (pdf_printf(pdf, "\nendstream\nendobj\n") != 0 ||
+        pdf_begin_obj(pdf, page->first_obj + 1) != 0 ||
+        pdf_printf(pdf, "%zu\nendobj\n", stream_len) != 0 ||
+        pdf_begin_obj(pdf, page->first_obj + 2) != 0 ||
+        pdf_printf(pdf, "<< /Length %d >>\nstream\n%sendstream\nendobj\n",
+                   content_len, content) != 0 ||
+        pdf_begin_obj(pdf, page->first_obj + 3) != 0 ||
+        pdf_printf(pdf, "<< /Type /Page /Parent %u 0 R"
+                   " /MediaBox [0 0 %.2f %.2f]"
+                   " /Resources << /XObject << /Im0 %u 0 R >> >>"
+                   " /Contents %u 0 R >>\nendobj\n",
+                   PDF_OBJ_PAGES, width_pt, height_pt,
+                   page->first_obj, page->first_obj + 2) != 0) {
+        return -1;
+    }
+
+    pdf->pages[pdf->page_count++] = page->first_obj + 3;
+    page->active = false;
+    return 0;
+}
+
+int
+pdf_writer_page_offset(struct pdf_writer *pdf, size_t *offset)
+{
+    struct pdf_page *page = &pdf->page;
+
+    if (!page->active) {
+        return -1;
+    }
+
+    if (!page->stream_started && pdf_start_stream(pdf, &page->info) != 0) {
+        return -1;
+    }
+
+    *offset = page->stream_offset;
+    return 0;
+}
+
+void
+pdf_writer_drop_page(struct pdf_writer *pdf)
+{
+    struct pdf_page *page = &pdf->page;
+
+    if (!page->active) {
+        return;
+    }
+
+    pdf->obj_count = page->first_obj - 1;
+    free(page->header);
+    memset(page, 0, sizeof(*page));
+}
+
+unsigned
+pdf_writer_page_count(struct pdf_writer *pdf)
+{
+    return pdf->page_count;
+}
+
+int
+pdf_writer_finish(struct pdf_writer *pdf)
+{
+    struct pdf_page *page = &pdf->page;
+    size_t xref_offset;
+    unsigned i;
+
+    if (page->active) {
+        /* drop the objects of an unfinished page, its data stays unreferenced */
+        pdf_writer_drop_page(pdf);
+    }
+
+    if (pdf_begin_obj(pdf, PDF_OBJ_PAGES) != 0 ||
+        pdf_printf(pdf, "<< /Type /Pages /Kids [") != 0) {
+        return -1;
+    }
+
+    for (i = 0; i < pdf->page_count; ++i) {
+        if (pdf_printf(pdf, "%s%u 0 R", i ? " " : "", pdf->pages[i]) != 0) {
+            return -1;
+        }
+    }
+
+    if (pdf_printf(pdf, "] /Count %u >>\nendobj\n", pdf->page_count) != 0 ||
+        pdf_begin_obj(pdf, PDF_OBJ_CATALOG) != 0 ||
+        pdf_printf(pdf, "<< /Type /Catalog /Pages %u 0 R >>\nendobj\n",
+                   PDF_OBJ_PAGES) != 0) {
+        return -1;
+    }
+
+    xref_offset = spool_size(pdf->spool);
+    if (pdf_printf(pdf, "xref\n0 %u\n0000000000 65535 f \n", pdf->obj_count + 1) != 0) {
+        return -1;
+    }
+
+    for (i = 1; i <= pdf->obj_count; ++i) {
+        if (pdf_printf(pdf, "%010zu 00000 n \n", pdf->offsets[i]) != 0) {
+            return -1;
+        }
+    }
+
+    return pdf_printf(pdf, "trailer\n<< /Size %u /Root %u 0 R >>\n"
+                      "startxref\n%zu\n%%%%EOF\n", pdf->obj_count + 1,
+                      PDF_OBJ_CATALOG, xref_offset);
+}
+
+void
+pdf_writer_free(struct pdf_writer *pdf)
+{
+    free(pdf->page.header);
+    free(pdf->pages);
+    free(pdf->offsets);
+    free(pdf);
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#ifndef BROTHER_PDF_H
+#define BROTHER_PDF_H
+
+#include <stddef.h>
+
+struct spool;
+struct pdf_writer;
+
+/*
+ * Page geometry negotiated with the scanner. Used only if the
+ * JPEG stream itself doesn't say otherwise.
+ */
+struct pdf_page_info {
+    unsigned dpi_x;
+    unsigned dpi_y;
+    unsigned width;
+    unsigned height;
+    unsigned components;
+};
+
+/**
+ * Start a PDF document in the given spool. JPEG pages are embedded
+ * as they are received, without decoding.
+ */
+struct pdf_writer *pdf_writer_create(struct spool *spool);
+int pdf_writer_begin_page(struct pdf_writer *pdf, const struct pdf_page_info *info);
+int pdf_writer_page_data(struct pdf_writer *pdf, const void *buf, size_t len);
+int pdf_writer_end_page(struct pdf_writer *pdf);
+
+/**
+ * Get the spool offset of the JPEG data of the current page. The data
+ * extends up to the current spool size.
+ */
+int pdf_writer_page_offset(struct pdf_writer *pdf, size_t *offset);
+
+/**
+ * Leave the current page out of the document. Its data stays in the
+ * file, unreferenced.
+ */
+void pdf_writer_drop_page(struct pdf_writer *pdf);
+unsigned pdf_writer_page_count(struct pdf_writer *pdf);
+
+/**
+ * Write the page tree and the cross-reference table. An unfinished
+ * page is left out of the document.
+ */
+int pdf_writer_finish(struct pdf_writer *pdf);
+void pdf_writer_free(struct pdf_writer *pdf);
+
+#endif //BROTHER_PDF_H
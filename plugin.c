@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include "plugin.h"
+#include "log.h"
+
+struct plugin {
+    char *path;
+    void *handle;
+    int (*page_start)(struct brother_plugin_page *page);
+    int (*page_data)(struct brother_plugin_page *page, const void *data, size_t len);
+    int (*page_end)(struct brother_plugin_page *page);
+    TAILQ_ENTRY(plugin) tailq;
+};
+
+static pthread_mutex_t g_plugins_lock = PTHREAD_MUTEX_INITIALIZER;
+static TAILQ_HEAD(, plugin) g_plugins = TAILQ_HEAD_INITIALIZER(g_plugins);
+
+static void *
+plugin_sym(struct plugin *plugin, const char *name)
+{
+    void *sym;
+
+    sym = dlsym(plugin->handle, name);
+    if (sym == NULL) {
+        LOG_ERR("Plugin '%s' does not export '%s'.\n", plugin->path, name);
+    }
+
+    return sym;
+}
+
+struct plugin *
+plugin_load(const char *path)
+{
+    struct plugin *plugin;
+
+    pthread_mutex_lock(&g_plugins_lock);
+    TAILQ_FOREACH(plugin, &g_plugins, tailq) {
+        if (strcmp(plugin->path, path) == 0) {
+            pthread_mutex_unlock(&g_plugins_lock);
+            return plugin;
+        }
+    }
+
+    plugin = calloc(1, sizeof(*plugin));
+    if (plugin == NULL) {
+        LOG_ERR("Failed to calloc plugin.\n");
+        goto err;
+    }
+
+    plugin->path = strdup(path);
+    plugin->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (plugin->path == NULL || plugin->handle == NULL) {
+        LOG_ERR("Cannot load plugin '%s': %s\n", path, dlerror());
+        goto free_err;
+    }
+
+    /* function pointers can't be cast from void * in ISO C */
+    *(void **) &plugin->page_start = plugin_sym(plugin, "brother_plugin_page_start");
+    *(void **) &plugin->page_data = plugin_sym(plugin, "brother_plugin_page_data");
+    *(void **) &plugin->page_end = plugin_sym(plugin, "brother_plugin_page_end");
+    if (!plugin->page_start || !plugin->page_data || !plugin->page_end) {
+        dlclose(plugin->handle);
+        goto free_err;
+    }
+
+    TAILQ_INSERT_TAIL(&g_plugins, plugin, tailq);
+    pthread_mutex_unlock(&g_plugins_lock);
+    LOG_INFO("Loaded plugin '%s'.\n", path);
+    return plugin;
+
+free_err:
+    free(plugin->path);
+    free(plugin);
+err:
+    pthread_mutex_unlock(&g_plugins_lock);
+    return NULL;
+}
+
+int
+plugin_page_start(struct plugin *plugin, struct brother_plugin_page *page)
+{
+    return plugin->page_start(page);
+}
+
+int
+plugin_page_data(struct plugin *plugin, struct brother_plugin_page *page,
+                 const void *data, size_t len)
+{
+    return plugin->page_data(page, data, len);
+}
+
+int
+plugin_page_end(struct plugin *plugin, struct brother_plugin_page *page)
+{
+    return plugin->page_end(page);
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#ifndef BROTHER_PLUGIN_H
+#define BROTHER_PLUGIN_H
+
+#include <stddef.h>
+#include "config.h"
+
+/*
+ * In-process page consumers, loaded with 'scan.plugin FUNC path.so'.
+ * A plugin exports the following symbols, all called from the receiving
+ * thread of the device:
+ *
+ *   int brother_plugin_page_start(struct brother_plugin_page *page);
+ *   int brother_plugin_page_data(struct brother_plugin_page *page,
+ *                                const void *data, size_t len);
+ *   int brother_plugin_page_end(struct brother_plugin_page *page);
+ *
+ * page_data gets the page bytes as they arrive from the network.
+ * page_end is called with page->path set to the published file, or
+ * NULL if the page was not received completely. With pdf output, path
+ * is the document the page was added to, which is published only at
+ * the end of the batch. Blank pages dropped with scan.blank end with
+ * NULL path and page->blank set. Once any callback
+ * returns non-zero, no more callbacks are made for that page.
+ * The callbacks must not block for long.
+ */
+
+struct brother_plugin_page {
+    const struct device_config *config;
+    /* negotiated params, CONFIG_SCAN_MAX_PARAMS entries */
+    const struct scan_param *params;
+    const char *func;
+    unsigned page_id;
+    const char *path;
+    /* free for the plugin to use */
+    void *ctx;
+    /* "<type>:<hex>" digest of the page in page_end, if scan.hash is set */
+    const char *digest;
+    /* in page_end, 1 if scan.blank found the page blank, 0 if not, -1 if unchecked */
+    int blank;
+};
+
+struct plugin;
+
+/**
+ * Load a plugin, or get the already loaded one with the same path.
+ */
+struct plugin *plugin_load(const char *path);
+int plugin_page_start(struct plugin *plugin, struct brother_plugin_page *page);
+int plugin_page_data(struct plugin *plugin, struct brother_plugin_page *page,
+                     const void *data, size_t len);
+int plugin_page_end(struct plugin *plugin, struct brother_plugin_page *page);
+
+#endif //BROTHER_PLUGIN_H
@@ -0,0 +1,326 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "profile_cache.h"
+#include "log.h"
+
+#define PROFILE_CACHE_MAGIC 0x43505242 /* "BRPC" */
+#define PROFILE_CACHE_VERSION 2
+#define PROFILE_CACHE_MAX_ENTRIES 256
+
+#define PROFILE_CACHE_ENTRY_FREE 0
+/* locked by a thread that's accessing it */
+#define PROFILE_CACHE_ENTRY_BUSY 1
+#define PROFILE_CACHE_ENTRY_VALID 2
+/* the lock holders never block, so something's wrong if it takes longer */
+#define PROFILE_CACHE_LOCK_ATTEMPTS 1000
+
+struct profile_cache_file {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t num_entries;
+    struct profile_cache_entry entries[PROFILE_CACHE_MAX_ENTRIES];
+};
+
+static struct profile_cache_file *g_cache;
+
+static bool
+is_valid_file(struct profile_cache_file *file)
+{
+    return file->magic == PROFILE_CACHE_MAGIC &&
+           file->version == PROFILE_CACHE_VERSION &&
+           file->entry_size == sizeof(struct profile_cache_entry) &&
+           file->num_entries == PROFILE_CACHE_MAX_ENTRIES;
+}
+
+int
+profile_cache_init(const char *path)
+{
+    struct profile_cache_file *file;
+    struct stat st;
+    unsigned i;
+    int fd, rc = -1;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG_ERR("Cannot open profile cache '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(fd, &st) != 0) {
+        LOG_ERR("Cannot stat profile cache '%s': %s\n", path, strerror(errno));
+        goto out;
+    }
+
+    if ((size_t) st.st_size != sizeof(*file) &&
+        ftruncate(fd, sizeof(*file)) != 0) {
+        LOG_ERR("Cannot resize profile cache '%s': %s\n", path, strerror(errno));
+        goto out;
+    }
+
+    file = mmap(NULL, sizeof(*file), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (file == MAP_FAILED) {
+        LOG_ERR("Cannot map profile cache '%s': %s\n", path, strerror(errno));
+        goto out;
+    }
+
+    if (!is_valid_file(file)) {
+        if (st.st_size > 0) {
+            LOG_WARN("Profile cache '%s' is of an unknown format, starting over.\n",
+                     path);
+        }
+
+        memset(file, 0, sizeof(*file));
+        file->magic = PROFILE_CACHE_MAGIC;
+        file->version = PROFILE_CACHE_VERSION;
+        file->entry_size = sizeof(struct profile_cache_entry);
+        file->num_entries = PROFILE_CACHE_MAX_ENTRIES;
+    }
+
+    /* left locked by a process that died, the key may be half written */
+    for (i = 0; i < PROFILE_CACHE_MAX_ENTRIES; ++i) {
+        if (atomic_load(&file->entries[i].state) == PROFILE_CACHE_ENTRY_BUSY) {
+            LOG_WARN("Profile cache entry %u was left locked, dropping it.\n", i);
+            atomic_fetch_add(&file->entries[i].generation, 1);
+            atomic_store(&file->entries[i].state, PROFILE_CACHE_ENTRY_FREE);
+        }
+    }
+
+    g_cache = file;
+    rc = 0;
+
+out:
+    close(fd);
+    return rc;
+}
+
+void
+profile_cache_shutdown(void)
+{
+    if (g_cache == NULL) {
+        return;
+    }
+
+    munmap(g_cache, sizeof(*g_cache));
+    g_cache = NULL;
+}
+
+/* returns false if the entry is free, or stays locked for too long */
+static bool
+lock_entry(struct profile_cache_entry *entry)
+{
+    unsigned i, state;
+
+    for (i = 0; i < PROFILE_CACHE_LOCK_ATTEMPTS; ++i) {
+        state = PROFILE_CACHE_ENTRY_VALID;
+        if (atomic_compare_exchange_weak(&entry->state, &state,
+                                         PROFILE_CACHE_ENTRY_BUSY)) {
+            return true;
+        }
+
+        if (state == PROFILE_CACHE_ENTRY_FREE) {
+            return false;
+        }
+        sched_yield();
+    }
+
+    return false;
+}
+
+static void
+unlock_entry(struct profile_cache_entry *entry)
+{
+    atomic_store(&entry->state, PROFILE_CACHE_ENTRY_VALID);
+}
+
+/* lock the entry if it's still the one the ref was made for */
+static bool
+lock_ref(struct profile_cache_ref *ref)
+{
+    if (ref->entry == NULL || !lock_entry(ref->entry)) {
+        return false;
+    }
+
+    if (atomic_load(&ref->entry->generation) != ref->generation) {
+        unlock_entry(ref->entry);
+        ref->entry = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+static bool
+entry_matches(struct profile_cache_entry *entry, in_addr_t ip, int func,
+              const char *resolution, const char *color_mode)
+{
+    return entry->ip == ip && entry->func == (uint32_t) func &&
+           strncmp(entry->resolution, resolution, sizeof(entry->resolution)) == 0 &&
+           strncmp(entry->color_mode, color_mode, sizeof(entry->color_mode)) == 0;
+}
+
+static int
+lookup(in_addr_t ip, int func, const char *resolution, const char *color_mode,
+       struct profile_cache_ref *ref)
+{
+    struct profile_cache_entry *entry;
+    unsigned i;
+
+    for (i = 0; i < PROFILE_CACHE_MAX_ENTRIES; ++i) {
+        entry = &g_cache->entries[i];
+        /* don't lock the ones that can't match */
+        if (atomic_load(&entry->state) == PROFILE_CACHE_ENTRY_FREE ||
+            entry->ip != ip || !lock_entry(entry)) {
+            continue;
+        }
+
+        if (entry_matches(entry, ip, func, resolution, color_mode)) {
+            entry->last_used = time(NULL);
+            ref->entry = entry;
+            ref->generation = atomic_load(&entry->generation);
+            unlock_entry(entry);
+            return 0;
+        }
+        unlock_entry(entry);
+    }
+
+    return -1;
+}
+
+/* a free entry, or the least recently used one. Returns it locked */
+static struct profile_cache_entry *
+claim_entry(void)
+{
+    struct profile_cache_entry *entry, *lru;
+    unsigned i, state;
+
+    do {
+        lru = NULL;
+        for (i = 0; i < PROFILE_CACHE_MAX_ENTRIES; ++i) {
+            entry = &g_cache->entries[i];
+            state = atomic_load(&entry->state);
+            if (state == PROFILE_CACHE_ENTRY_FREE) {
+                lru = entry;
+                break;
+            }
+
+            if (state == PROFILE_CACHE_ENTRY_VALID &&
+                (lru == NULL || entry->last_used < lru->last_used)) {
+                lru = entry;
+            }
+        }
+
+        if (lru == NULL) {
+            return NULL;
+        }
+
+        state = atomic_load(&lru->state);
+        /* another worker might have taken it meanwhile, look again then */
+    } while (state == PROFILE_CACHE_ENTRY_BUSY ||
+             !atomic_compare_exchange_strong(&lru->state, &state,
+                                             PROFILE_CACHE_ENTRY_BUSY));
+
+    /* invalidate the refs to the previous key */
+    atomic_fetch_add(&lru->generation, 1);
+    return lru;
+}
+
+int
+profile_cache_get(in_addr_t ip, int func, const char *resolution,
+                  const char *color_mode, struct profile_cache_ref *ref)
+{
+    struct profile_cache_entry *entry;
+
+    ref->entry = NULL;
+    if (g_cache == NULL) {
+        return -1;
+    }
+
+    if (lookup(ip, func, resolution, color_mode, ref) == 0) {
+        return 0;
+    }
+
+    entry = claim_entry();
+    if (entry == NULL) {
+        return -1;
+    }
+
+    entry->ip = ip;
+    entry->func = (uint32_t) func;
+    memset(entry->resolution, 0, sizeof(entry->resolution));
+    strncpy(entry->resolution, resolution, sizeof(entry->resolution) - 1);
+    memset(entry->color_mode, 0, sizeof(entry->color_mode));
+    strncpy(entry->color_mode, color_mode, sizeof(entry->color_mode) - 1);
+    memset(&entry->data, 0, sizeof(entry->data));
+    entry->last_used = time(NULL);
+
+    ref->entry = entry;
+    ref->generation = atomic_load(&entry->generation);
+    unlock_entry(entry);
+    return 0;
+}
+
+int
+profile_cache_load(struct profile_cache_ref *ref, struct profile_cache_data *data)
+{
+    if (!lock_ref(ref)) {
+        return -1;
+    }
+
+    *data = ref->entry->data;
+    unlock_entry(ref->entry);
+    return 0;
+}
+
+void
+profile_cache_set_scan_params(struct profile_cache_ref *ref,
+                              const int32_t scan_params[PROFILE_CACHE_NUM_SCAN_PARAMS])
+{
+    if (!lock_ref(ref)) {
+        return;
+    }
+
+    memcpy(ref->entry->data.scan_params, scan_params,
+           sizeof(ref->entry->data.scan_params));
+    unlock_entry(ref->entry);
+}
+
+void
+profile_cache_add_page(struct profile_cache_ref *ref, size_t bytes)
+{
+    struct profile_cache_data *data;
+    int64_t diff;
+
+    if (!lock_ref(ref)) {
+        return;
+    }
+
+    data = &ref->entry->data;
+    diff = (int64_t) bytes - (int64_t) data->page_bytes;
+    if (data->pages == 0) {
+        data->page_bytes = bytes;
+    } else {
+        /* weigh the recent pages more, a device's settings may change */
+        data->page_bytes = (uint64_t) ((int64_t) data->page_bytes + diff / 8);
+    }
+
+    if (data->pages < UINT32_MAX) {
+        data->pages++;
+    }
+    unlock_entry(ref->entry);
+}
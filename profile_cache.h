@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#ifndef BROTHER_PROFILE_CACHE_H
+#define BROTHER_PROFILE_CACHE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+
+#define PROFILE_CACHE_NUM_SCAN_PARAMS 7
+
+struct profile_cache_data {
+    /* dpi, scan area in mm/10 and pixels, as received in exchange_params2() */
+    int32_t scan_params[PROFILE_CACHE_NUM_SCAN_PARAMS];
+    /* running average */
+    uint64_t page_bytes;
+    uint32_t pages;
+};
+
+/*
+ * What a scanner settled on for a scan function and the resolution and
+ * color mode it proposed. The entries live in a file mapped by all
+ * workers, and may be reused for another key at any time.
+ */
+struct profile_cache_entry {
+    /* PROFILE_CACHE_ENTRY_*, see profile_cache.c */
+    atomic_uint state;
+    /* bumped whenever the entry is reused for another key */
+    atomic_uint generation;
+    in_addr_t ip;
+    uint32_t func;
+    char resolution[16];
+    char color_mode[16];
+    struct profile_cache_data data;
+    int64_t last_used;
+};
+
+/*
+ * An entry as it was found. Once the entry gets reused, all accesses
+ * through the ref fail.
+ */
+struct profile_cache_ref {
+    struct profile_cache_entry *entry;
+    uint32_t generation;
+};
+
+/**
+ * Map the cache file at path, creating it if necessary. Must be called
+ * before the workers are forked, so they all share the same mapping.
+ * Without a call, all lookups miss.
+ */
+int profile_cache_init(const char *path);
+void profile_cache_shutdown(void);
+
+/**
+ * Get the entry for given key, creating it, possibly in place of the least
+ * recently used one, if there's none. Returns -1 if the cache is disabled
+ * or all entries are busy.
+ */
+int profile_cache_get(in_addr_t ip, int func, const char *resolution,
+                      const char *color_mode, struct profile_cache_ref *ref);
+
+/**
+ * Copy the data of the entry. Returns -1 if the entry was reused
+ * meanwhile, or ref is empty.
+ */
+int profile_cache_load(struct profile_cache_ref *ref, struct profile_cache_data *data);
+
+void profile_cache_set_scan_params(struct profile_cache_ref *ref,
+                                   const int32_t scan_params[PROFILE_CACHE_NUM_SCAN_PARAMS]);
+void profile_cache_add_page(struct profile_cache_ref *ref, size_t bytes);
+
+#endif //BROTHER_PROFILE_CACHE_H
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#include <stdlib.h>
+#include "ring_buf.h"
+
+int
+ring_buf_init(struct ring_buf *ring, size_t size)
+{
+    size_t pow2 = 1;
+
+    while (pow2 < size) {
+        pow2 <<= 1;
+    }
+
+    ring->data = malloc(pow2);
+    if (ring->data == NULL) {
+        return -1;
+    }
+
+    ring->size = pow2;
+    ring_buf_reset(ring);
+    return 0;
+}
+
+void
+ring_buf_free(struct ring_buf *ring)
+{
+    free(ring->data);
+    ring->data = NULL;
+}
+
+void
+ring_buf_reset(struct ring_buf *ring)
+{
+    ring->head = ring->tail = 0;
+}
+
+size_t
+ring_buf_len(const struct ring_buf *ring)
+{
+    return ring->tail - ring->head;
+}
+
+int
+ring_buf_get_free_iov(struct ring_buf *ring, struct iovec iov[2])
+{
+    size_t free_len = ring->size - ring_buf_len(ring);
+    size_t off = ring->tail & (ring->size - 1);
+    size_t first = ring->size - off;
+
+    if (free_len == 0) {
+        return 0;
+    }
+
+    iov[0].iov_base = ring->data + off;
+    if (first >= free_len) {
+        iov[0].iov_len = free_len;
+        return 1;
+    }
+
+    iov[0].iov_len = first;
+    iov[1].iov_base = ring->data;
+    iov[1].iov_len = free_len - first;
+    return 2;
+}
+
+void
+ring_buf_produce(struct ring_buf *ring, size_t len)
+{
+    ring->tail += len;
+}
+
+size_t
+ring_buf_peek(struct ring_buf *ring, uint8_t **data)
+{
+    size_t len = ring_buf_len(ring);
+    size_t off = ring->head & (ring->size - 1);
+
+    *data = ring->data + off;
+    return len < ring->size - off ? len : ring->size - off;
+}
+
+void
+ring_buf_consume(struct ring_buf *ring, size_t len)
+{
+    ring->head += len;
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#ifndef BROTHER_RING_BUF_H
+#define BROTHER_RING_BUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* byte ring of power-of-two size, for a single reader and writer */
+struct ring_buf {
+    uint8_t *data;
+    size_t size;
+    size_t head;
+    size_t tail;
+};
+
+int ring_buf_init(struct ring_buf *ring, size_t size);
+void ring_buf_free(struct ring_buf *ring);
+void ring_buf_reset(struct ring_buf *ring);
+size_t ring_buf_len(const struct ring_buf *ring);
+
+/**
+ * Fill iov with the free space of the ring. Returns the number of
+ * iovecs used (0-2).
+ */
+int ring_buf_get_free_iov(struct ring_buf *ring, struct iovec iov[2]);
+void ring_buf_produce(struct ring_buf *ring, size_t len);
+
+/**
+ * Get the longest contiguous readable span. Returns its length.
+ */
+size_t ring_buf_peek(struct ring_buf *ring, uint8_t **data);
+void ring_buf_consume(struct ring_buf *ring, size_t len);
+
+#endif //BROTHER_RING_BUF_H
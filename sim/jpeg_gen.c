@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "jpeg_gen.h"
+#include "../log.h"
+
+/* every coefficient of a textured block is coded, in the worst case stuffed */
+#define SIM_JPEG_MAX_BLOCK_SIZE 64
+#define SIM_JPEG_MAX_HEADER_SIZE 1024
+#define SIM_JPEG_QUANT 16
+
+/* the "typical" luminance tables from the JPEG spec, Annex K */
+static const uint8_t g_dc_counts[16] = {
+    0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0
+};
+static const uint8_t g_dc_vals[12] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11
+};
+static const uint8_t g_ac_counts[16] = {
+    0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d
+};
+static const uint8_t g_ac_vals[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12,
+    0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+    0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16,
+    0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
+    0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+    0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79,
+    0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98,
+    0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+    0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4,
+    0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea,
+    0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa
+};
+
+/*
+ * Codes of the few symbols that are used, as given by the tables above.
+ * DC difference of 0, end of block, and an AC value of magnitude 2-3.
+ */
+#define SIM_JPEG_DC_ZERO 0x0, 2
+#define SIM_JPEG_AC_EOB 0xa, 4
+#define SIM_JPEG_AC_SIZE2 0x1, 2
+
+struct bit_writer {
+    uint8_t *p;
+    uint32_t buf;
+    int bits;
+};
+
+static void
+put_bits(struct bit_writer *w, uint32_t code, int len)
+{
+    uint8_t byte;
+
+    w->buf = w->buf << len | code;
+    w->bits += len;
+
+    while (w->bits >= 8) {
+        w->bits -= 8;
+        byte = (uint8_t) (w->buf >> w->bits);
+        *w->p++ = byte;
+        if (byte == 0xFF) {
+            *w->p++ = 0x00;
+        }
+    }
+}
+
+static void
+flush_bits(struct bit_writer *w)
+{
+    if (w->bits > 0) {
+        /* pad with ones */
+        put_bits(w, (1u << (8 - w->bits)) - 1, 8 - w->bits);
+    }
+}
+
+static uint8_t *
+put_be16(uint8_t *p, unsigned val)
+{
+    *p++ = (uint8_t) (val >> 8);
+    *p++ = (uint8_t) val;
+    return p;
+}
+
+static uint8_t *
+put_marker(uint8_t *p, uint8_t marker, unsigned len)
+{
+    *p++ = 0xFF;
+    *p++ = marker;
+    return len ? put_be16(p, len + 2) : p;
+}
+
+static uint8_t *
+put_headers(struct sim_jpeg *jpeg, uint8_t *p, unsigned width, unsigned height,
+            unsigned dpi)
+{
+    unsigned i;
+
+    p = put_marker(p, 0xD8, 0);
+
+    p = put_marker(p, 0xE0, 14);
+    memcpy(p, "JFIF\0\x01\x01\x01", 8);
+    p += 8;
+    p = put_be16(p, dpi);
+    p = put_be16(p, dpi);
+    *p++ = 0;
+    *p++ = 0;
+
+    p = put_marker(p, 0xFE, SIM_JPEG_TAG_LEN);
+    jpeg->tag_offset = (size_t) (p - jpeg->data);
+    memset(p, ' ', SIM_JPEG_TAG_LEN);
+    p += SIM_JPEG_TAG_LEN;
+
+    p = put_marker(p, 0xDB, 65);
+    *p++ = 0;
+    for (i = 0; i < 64; ++i) {
+        *p++ = SIM_JPEG_QUANT;
+    }
+
+    p = put_marker(p, 0xC0, 9);
+    *p++ = 8;
+    p = put_be16(p, height);
+    p = put_be16(p, width);
+    *p++ = 1;
+    *p++ = 1;
+    *p++ = 0x11;
+    *p++ = 0;
+
+    p = put_marker(p, 0xC4, 1 + 16 + sizeof(g_dc_vals) + 1 + 16 + sizeof(g_ac_vals));
+    *p++ = 0x00;
+    memcpy(p, g_dc_counts, sizeof(g_dc_counts));
+    p += sizeof(g_dc_counts);
+    memcpy(p, g_dc_vals, sizeof(g_dc_vals));
+    p += sizeof(g_dc_vals);
+    *p++ = 0x10;
+    memcpy(p, g_ac_counts, sizeof(g_ac_counts));
+    p += sizeof(g_ac_counts);
+    memcpy(p, g_ac_vals, sizeof(g_ac_vals));
+    p += sizeof(g_ac_vals);
+
+    p = put_marker(p, 0xDA, 6);
+    *p++ = 1;
+    *p++ = 1;
+    *p++ = 0x00;
+    *p++ = 0;
+    *p++ = 63;
+    *p++ = 0;
+
+    return p;
+}
+
+int
+sim_jpeg_generate(struct sim_jpeg *jpeg, unsigned width, unsigned height,
+                  unsigned dpi, unsigned content, unsigned seed)
+{
+    struct bit_writer w = { 0 };
+    size_t num_blocks, i, max_len;
+    uint32_t rand_state = seed * 2654435761u + 1;
+    unsigned k;
+    uint8_t *data;
+
+    if (width == 0 || height == 0 || width > 0xFFFF || height > 0xFFFF) {
+        LOG_ERR("Invalid image size %ux%u.\n", width, height);
+        return -1;
+    }
+
+    num_blocks = (size_t) ((width + 7) / 8) * ((height + 7) / 8);
+    max_len = SIM_JPEG_MAX_HEADER_SIZE + num_blocks * SIM_JPEG_MAX_BLOCK_SIZE;
+    jpeg->data = malloc(max_len);
+    if (jpeg->data == NULL) {
+        LOG_ERR("Failed to malloc %zu bytes for a jpeg.\n", max_len);
+        return -1;
+    }
+
+    w.p = put_headers(jpeg, jpeg->data, width, height, dpi);
+    for (i = 0; i < num_blocks; ++i) {
+        put_bits(&w, SIM_JPEG_DC_ZERO);
+
+        rand_state = rand_state * 1103515245u + 12345u;
+        if ((rand_state >> 16) % 100 >= content) {
+            put_bits(&w, SIM_JPEG_AC_EOB);
+            continue;
+        }
+
+        for (k = 1; k < 64; ++k) {
+            rand_state = rand_state * 1103515245u + 12345u;
+            put_bits(&w, SIM_JPEG_AC_SIZE2);
+            put_bits(&w, rand_state >> 30, 2);
+        }
+    }
+
+    flush_bits(&w);
+    w.p = put_marker(w.p, 0xD9, 0);
+    jpeg->len = (size_t) (w.p - jpeg->data);
+
+    data = realloc(jpeg->data, jpeg->len);
+    if (data != NULL) {
+        jpeg->data = data;
+    }
+
+    return 0;
+}
+
+void
+sim_jpeg_free(struct sim_jpeg *jpeg)
+{
+    free(jpeg->data);
+    jpeg->data = NULL;
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#ifndef BROTHER_SIM_JPEG_GEN_H
+#define BROTHER_SIM_JPEG_GEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* length of the text in the comment segment that is free to overwrite */
+#define SIM_JPEG_TAG_LEN 48
+
+struct sim_jpeg {
+    uint8_t *data;
+    size_t len;
+    /* offset of the SIM_JPEG_TAG_LEN bytes of comment text */
+    size_t tag_offset;
+};
+
+/**
+ * Generate a grayscale baseline JPEG of given size in pixels. content
+ * is the percentage of 8x8 blocks with texture in them, the rest are
+ * plain background. The image contains a comment that can be changed
+ * in place to make the data of every page unique.
+ */
+int sim_jpeg_generate(struct sim_jpeg *jpeg, unsigned width, unsigned height,
+                      unsigned dpi, unsigned content, unsigned seed);
+void sim_jpeg_free(struct sim_jpeg *jpeg);
+
+#endif //BROTHER_SIM_JPEG_GEN_H
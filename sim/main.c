@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <getopt.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <arpa/inet.h>
+#include <sys/inotify.h>
+#include "scanner.h"
+#include "stats.h"
+#include "../config.h"
+#include "../log.h"
+
+#define SIM_DEFAULT_ADDR "127.0.1.1"
+#define SIM_MAX_SCANNERS 1024
+#define SIM_WATCH_INTERVAL_MS 200
+
+static atomic_bool g_watch_stop;
+
+static void
+sig_handler(int signo)
+{
+    sim_scanner_interrupt();
+}
+
+static void
+print_usage(void)
+{
+    printf("Usage: brother-sim [options]\n"
+           "  -n NUM      number of virtual scanners (default 1)\n"
+           "  -a ADDR     address of the first scanner, the next ones get\n"
+           "              consecutive addresses (default " SIM_DEFAULT_ADDR ")\n"
+           "  -b NUM      button presses per scanner (default 10)\n"
+           "  -p NUM      pages per button press (default 2)\n"
+           "  -i MSEC     pause between button presses (default 0)\n"
+           "  -f FUNC     scan function to press (default: first registered)\n"
+           "  -r DPI      scan resolution, pages are A4 (default 300)\n"
+           "  -C PERCENT  part of the page with content (default 5)\n"
+           "  -s BYTES    chunk payload size (default 32768)\n"
+           "  -t SEC      network timeout (default 35)\n"
+           "  -w DIR      measure button->file latency of jpeg pages\n"
+           "              published in DIR, the driver's output directory\n"
+           "  -g          print the driver config for the scanners and exit\n");
+}
+
+static void
+print_driver_config(in_addr_t first_addr, unsigned num, const char *func)
+{
+    struct in_addr addr;
+    unsigned i;
+
+    printf("# generated by brother-sim\n"
+           "hostname brother-sim\n");
+    for (i = 0; i < num; ++i) {
+        addr.s_addr = htonl(ntohl(first_addr) + i);
+        printf("\nip %s\n"
+               "scan.func %s true\n"
+               "network.timeout 3\n"
+               "network.page.init.timeout 35\n"
+               "network.page.finish.timeout 35\n",
+               inet_ntoa(addr), func ? func : "FILE");
+    }
+}
+
+/* count the pages being published in the driver's output dir */
+static void *
+watch_thread_fn(void *arg)
+{
+    const char *dir = arg;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    struct pollfd pfd;
+    ssize_t len;
+    char *p;
+    int fd;
+
+    fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, dir, IN_CREATE | IN_MOVED_TO) < 0) {
+        LOG_ERR("Cannot watch directory '%s'.\n", dir);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (!atomic_load(&g_watch_stop)) {
+        if (poll(&pfd, 1, SIM_WATCH_INTERVAL_MS) <= 0) {
+            continue;
+        }
+
+        len = read(fd, buf, sizeof(buf));
+        for (p = buf; len > 0 && p < buf + len; p += sizeof(*event) + event->len) {
+            event = (const struct inotify_event *) (void *) p;
+            if (event->len == 0 || event->name[0] == '.' ||
+                strstr(event->name, ".jpg") == NULL) {
+                continue;
+            }
+
+            sim_stats_page_published(sim_time());
+        }
+    }
+
+    close(fd);
+    return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct sim_config config = {
+        .batches = 10,
+        .pages = 2,
+        .dpi = 300,
+        .content = 5,
+        .chunk_size = 32768,
+        .timeout = 35,
+    };
+    struct sim_scanner **scanners;
+    const char *addr_str = SIM_DEFAULT_ADDR;
+    char *watch_dir = NULL;
+    unsigned num = 1, i, started = 0;
+    bool gen_config = false;
+    double deadline;
+    pthread_t watch_thread;
+    in_addr_t addr;
+    int option;
+
+    while ((option = getopt(argc, argv, "n:a:b:p:i:f:r:C:s:t:w:gh")) != -1) {
+        switch (option) {
+        case 'n':
+            num = (unsigned) atoi(optarg);
+            break;
+        case 'a':
+            addr_str = optarg;
+            break;
+        case 'b':
+            config.batches = (unsigned) atoi(optarg);
+            break;
+        case 'p':
+            config.pages = (unsigned) atoi(optarg);
+            break;
+        case 'i':
+            config.interval_ms = (unsigned) atoi(optarg);
+            break;
+        case 'f':
+            config.func = optarg;
+            break;
+        case 'r':
+            config.dpi = (unsigned) atoi(optarg);
+            break;
+        case 'C':
+            config.content = (unsigned) atoi(optarg);
+            break;
+        case 's':
+            config.chunk_size = (unsigned) atoi(optarg);
+            break;
+        case 't':
+            config.timeout = (unsigned) atoi(optarg);
+            break;
+        case 'w':
+            watch_dir = optarg;
+            break;
+        case 'g':
+            gen_config = true;
+            break;
+        default:
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    addr = inet_addr(addr_str);
+    if (addr == INADDR_NONE || num == 0 || num > SIM_MAX_SCANNERS ||
+        config.dpi == 0 || config.dpi > 1200 || config.content > 100 ||
+        config.chunk_size == 0 || config.chunk_size > 0xFFF0) {
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+
+    if (gen_config) {
+        print_driver_config(addr, num, config.func);
+        return 0;
+    }
+
+    if (signal(SIGINT, sig_handler) == SIG_ERR) {
+        fprintf(stderr, "Failed to bind SIGINT handler.\n");
+        return 1;
+    }
+
+    scanners = calloc(num, sizeof(*scanners));
+    if (scanners == NULL) {
+        fprintf(stderr, "Failed to calloc scanners.\n");
+        return 1;
+    }
+
+    sim_stats_init(watch_dir != NULL);
+    if (watch_dir != NULL &&
+        pthread_create(&watch_thread, NULL, watch_thread_fn, watch_dir) != 0) {
+        fprintf(stderr, "Failed to start the directory watcher.\n");
+        return 1;
+    }
+
+    for (i = 0; i < num; ++i) {
+        scanners[i] = sim_scanner_start(htonl(ntohl(addr) + i), &config);
+        if (scanners[i] == NULL) {
+            fprintf(stderr, "Failed to start scanner %u. Binding to port 161 "
+                    "requires CAP_NET_BIND_SERVICE.\n", i);
+            sim_scanner_interrupt();
+            break;
+        }
+        ++started;
+    }
+
+    printf("%u scanners waiting for the driver to register\n", started);
+    for (i = 0; i < started; ++i) {
+        sim_scanner_wait(scanners[i]);
+    }
+
+    if (watch_dir != NULL) {
+        /* give the driver time to publish the last pages */
+        deadline = sim_time() + config.timeout;
+        while (sim_stats_pending_pages() > 0 && sim_time() < deadline) {
+            usleep(SIM_WATCH_INTERVAL_MS * 1000);
+        }
+
+        atomic_store(&g_watch_stop, true);
+        pthread_join(watch_thread, NULL);
+    }
+
+    for (i = 0; i < started; ++i) {
+        sim_scanner_free(scanners[i]);
+    }
+    free(scanners);
+
+    sim_stats_print();
+    return 0;
+}
@@ -0,0 +1,803 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "scanner.h"
+#include "jpeg_gen.h"
+#include "stats.h"
+#include "../config.h"
+#include "../log.h"
+
+#define SIM_SNMP_PORT 161
+#define SIM_DATA_PORT 54921
+#define SIM_POLL_INTERVAL_MS 200
+#define SIM_MAX_MSG_SIZE 2048
+#define SIM_PRINTER_STATUS_READY 10001
+#define SIM_CHUNK_HEADER_SIZE 12
+#define SIM_PAGE_END_HEADER_SIZE 10
+#define SIM_CHUNK_MAX_PROGRESS 0x1000
+/* A4 */
+#define SIM_PAGE_WIDTH_MM 210
+#define SIM_PAGE_HEIGHT_MM 297
+
+#define BER_INTEGER 0x02
+#define BER_OCTET_STRING 0x04
+#define BER_OID 0x06
+#define BER_SEQUENCE 0x30
+#define SNMP_PDU_GET_REQUEST 0xA0
+#define SNMP_PDU_GET_RESPONSE 0xA2
+#define SNMP_PDU_SET_REQUEST 0xA3
+
+struct sim_scanner {
+    char ip[16];
+    struct sockaddr_in addr;
+    const struct sim_config *config;
+    int snmp_fd;
+    int button_fd;
+    int listen_fd;
+    pthread_t snmp_thread;
+    pthread_t thread;
+    atomic_bool stop;
+
+    /* registration state, set by the snmp thread */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned registered_funcs;
+    struct sockaddr_in host;
+    char user[32];
+    unsigned appnum;
+
+    unsigned button_seq;
+    unsigned pages_sent;
+    unsigned width;
+    unsigned height;
+    struct sim_jpeg page;
+};
+
+/* encoded 1.3.6.1.4.1.2435.2.3.9.2.11.1.{1,2}.0 */
+static const uint8_t g_register_oid[] = {
+    0x2b, 0x06, 0x01, 0x04, 0x01, 0x93, 0x03, 0x02, 0x03, 0x09, 0x02, 0x0b,
+    0x01, 0x01, 0x00
+};
+static const uint8_t g_unregister_oid[] = {
+    0x2b, 0x06, 0x01, 0x04, 0x01, 0x93, 0x03, 0x02, 0x03, 0x09, 0x02, 0x0b,
+    0x01, 0x02, 0x00
+};
+
+static atomic_bool g_interrupted;
+
+/*
+ * Read a BER tag and length. Returns a pointer to the value and sets
+ * tag and len, or returns NULL if the data is malformed.
+ */
+static const uint8_t *
+ber_read(const uint8_t *p, const uint8_t *end, uint8_t *tag, size_t *len)
+{
+    size_t n, i;
+
+    if (end - p < 2) {
+        return NULL;
+    }
+
+    *tag = p[0];
+    n = p[1];
+    p += 2;
+    if (n & 0x80) {
+        i = n & 0x7f;
+        if (i == 0 || i > 2 || (size_t) (end - p) < i) {
+            return NULL;
+        }
+
+        for (n = 0; i > 0; --i) {
+            n = n << 8 | *p++;
+        }
+    }
+
+    if ((size_t) (end - p) < n) {
+        return NULL;
+    }
+
+    *len = n;
+    return p;
+}
+
+static size_t
+ber_header_size(size_t len)
+{
+    return len < 0x80 ? 2 : len <= 0xFF ? 3 : 4;
+}
+
+static uint8_t *
+ber_put_header(uint8_t *p, uint8_t tag, size_t len)
+{
+    *p++ = tag;
+    if (len >= 0x100) {
+        *p++ = 0x82;
+        *p++ = (uint8_t) (len >> 8);
+    } else if (len >= 0x80) {
+        *p++ = 0x81;
+    }
+
+    *p++ = (uint8_t) len;
+    return p;
+}
+
+static void
+handle_registration(struct sim_scanner *scanner, const uint8_t *data, size_t len,
+                    bool enabled)
+{
+    char msg[256], func[8], host[16];
+    unsigned port, i;
+    const char *str;
+
+    if (len >= sizeof(msg)) {
+        return;
+    }
+
+    memcpy(msg, data, len);
+    msg[len] = 0;
+
+    str = strstr(msg, "FUNC=");
+    if (str == NULL || sscanf(str, "FUNC=%7[^;]", func) != 1) {
+        LOG_WARN("%s: registration without a scan function: %s\n", scanner->ip, msg);
+        return;
+    }
+
+    for (i = 0; i < CONFIG_SCAN_MAX_FUNCS; ++i) {
+        if (strcmp(func, g_scan_func_str[i]) == 0) {
+            break;
+        }
+    }
+
+    if (i == CONFIG_SCAN_MAX_FUNCS) {
+        LOG_WARN("%s: registration of unknown function %s\n", scanner->ip, func);
+        return;
+    }
+
+    pthread_mutex_lock(&scanner->lock);
+    if (!enabled) {
+        scanner->registered_funcs &= ~(1u << i);
+        pthread_mutex_unlock(&scanner->lock);
+        return;
+    }
+
+    str = strstr(msg, "HOST=");
+    if (str == NULL || sscanf(str, "HOST=%15[0-9.]:%u", host, &port) != 2 ||
+        inet_pton(AF_INET, host, &scanner->host.sin_addr) != 1) {
+        pthread_mutex_unlock(&scanner->lock);
+        LOG_WARN("%s: registration without a valid host: %s\n", scanner->ip, msg);
+        return;
+    }
+
+    scanner->host.sin_family = AF_INET;
+    scanner->host.sin_port = htons((uint16_t) port);
+
+    str = strstr(msg, "USER=\"");
+    if (str == NULL || sscanf(str, "USER=\"%31[^\"]", scanner->user) != 1) {
+        scanner->user[0] = 0;
+    }
+
+    str = strstr(msg, "APPNUM=");
+    if (str == NULL || sscanf(str, "APPNUM=%u", &scanner->appnum) != 1) {
+        scanner->appnum = 0;
+    }
+
+    scanner->registered_funcs |= 1u << i;
+    pthread_cond_broadcast(&scanner->cond);
+    pthread_mutex_unlock(&scanner->lock);
+}
+
+/*
+ * Build the response varbind to given request varbind. The request
+ * can only be a printer status query or a (un)registration.
+ */
+static size_t
+snmp_build_varbind(struct sim_scanner *scanner, uint8_t pdu_type,
+                   const uint8_t *varbind, const uint8_t *varbind_end,
+                   uint8_t *out)
+{
+    static const uint8_t status_value[] = {
+        BER_INTEGER, 0x02, SIM_PRINTER_STATUS_READY >> 8,
+        SIM_PRINTER_STATUS_READY & 0xFF
+    };
+    const uint8_t *oid, *value, *value_end;
+    size_t oid_len, value_len, len;
+    uint8_t tag;
+    uint8_t *p;
+
+    oid = ber_read(varbind, varbind_end, &tag, &oid_len);
+    if (oid == NULL || tag != BER_OID) {
+        return 0;
+    }
+
+    value = ber_read(oid + oid_len, varbind_end, &tag, &value_len);
+    if (value == NULL) {
+        return 0;
+    }
+
+    value_end = value + value_len;
+    if (pdu_type == SNMP_PDU_SET_REQUEST && tag == BER_OCTET_STRING) {
+        if (oid_len == sizeof(g_register_oid) &&
+            memcmp(oid, g_register_oid, oid_len) == 0) {
+            handle_registration(scanner, value, value_len, true);
+        } else if (oid_len == sizeof(g_unregister_oid) &&
+                   memcmp(oid, g_unregister_oid, oid_len) == 0) {
+            handle_registration(scanner, value, value_len, false);
+        }
+    }
+
+    /* oid as it was, the printer status for a get and an echo for a set */
+    len = (size_t) (oid + oid_len - varbind);
+    if (pdu_type == SNMP_PDU_GET_REQUEST) {
+        len += sizeof(status_value);
+    } else {
+        len += (size_t) (value_end - (oid + oid_len));
+    }
+
+    p = ber_put_header(out, BER_SEQUENCE, len);
+    memcpy(p, varbind, (size_t) (oid + oid_len - varbind));
+    p += oid + oid_len - varbind;
+    if (pdu_type == SNMP_PDU_GET_REQUEST) {
+        memcpy(p, status_value, sizeof(status_value));
+        p += sizeof(status_value);
+    } else {
+        memcpy(p, oid + oid_len, (size_t) (value_end - (oid + oid_len)));
+        p += value_end - (oid + oid_len);
+    }
+
+    return (size_t) (p - out);
+}
+
+/* returns the length of the response in out, or 0 if there's none */
+static size_t
+snmp_handle_request(struct sim_scanner *scanner, const uint8_t *req, size_t req_len,
+                    uint8_t *out, size_t out_size)
+{
+    const uint8_t *end = req + req_len, *msg, *pdu, *field, *varbinds, *varbind;
+    const uint8_t *header_end, *request_id_end = NULL;
+    uint8_t varbind_buf[SIM_MAX_MSG_SIZE];
+    size_t len, varbinds_len = 0, pdu_len, msg_len, vb_len;
+    uint8_t tag, pdu_type;
+    uint8_t *p;
+    int i;
+
+    msg = ber_read(req, end, &tag, &len);
+    if (msg == NULL || tag != BER_SEQUENCE) {
+        return 0;
+    }
+
+    end = msg + len;
+
+    /* version and community */
+    field = msg;
+    for (i = 0; i < 2; ++i) {
+        field = ber_read(field, end, &tag, &len);
+        if (field == NULL) {
+            return 0;
+        }
+        field += len;
+    }
+    header_end = field;
+
+    pdu = ber_read(header_end, end, &pdu_type, &len);
+    if (pdu == NULL ||
+        (pdu_type != SNMP_PDU_GET_REQUEST && pdu_type != SNMP_PDU_SET_REQUEST)) {
+        return 0;
+    }
+
+    end = pdu + len;
+
+    /* request id, error status and error index */
+    field = pdu;
+    for (i = 0; i < 3; ++i) {
+        field = ber_read(field, end, &tag, &len);
+        if (field == NULL || tag != BER_INTEGER) {
+            return 0;
+        }
+        field += len;
+        if (i == 0) {
+            request_id_end = field;
+        }
+    }
+
+    varbinds = ber_read(field, end, &tag, &len);
+    if (varbinds == NULL || tag != BER_SEQUENCE) {
+        return 0;
+    }
+
+    for (field = varbinds; field < varbinds + len; field = varbind + vb_len) {
+        varbind = ber_read(field, varbinds + len, &tag, &vb_len);
+        if (varbind == NULL || tag != BER_SEQUENCE ||
+            varbinds_len + vb_len + 16 > sizeof(varbind_buf)) {
+            return 0;
+        }
+
+        varbinds_len += snmp_build_varbind(scanner, pdu_type, varbind, varbind + vb_len,
+                                           varbind_buf + varbinds_len);
+    }
+
+    pdu_len = (size_t) (request_id_end - pdu) + 6 + ber_header_size(varbinds_len) +
+              varbinds_len;
+    msg_len = (size_t) (header_end - msg) + ber_header_size(pdu_len) + pdu_len;
+    if (ber_header_size(msg_len) + msg_len > out_size) {
+        return 0;
+    }
+
+    p = ber_put_header(out, BER_SEQUENCE, msg_len);
+    memcpy(p, msg, (size_t) (header_end - msg));
+    p += header_end - msg;
+    p = ber_put_header(p, SNMP_PDU_GET_RESPONSE, pdu_len);
+    memcpy(p, pdu, (size_t) (request_id_end - pdu));
+    p += request_id_end - pdu;
+    memcpy(p, "\x02\x01\x00\x02\x01\x00", 6);
+    p += 6;
+    p = ber_put_header(p, BER_SEQUENCE, varbinds_len);
+    memcpy(p, varbind_buf, varbinds_len);
+    p += varbinds_len;
+
+    return (size_t) (p - out);
+}
+
+static void *
+snmp_thread_fn(void *arg)
+{
+    struct sim_scanner *scanner = arg;
+    uint8_t req[SIM_MAX_MSG_SIZE], resp[SIM_MAX_MSG_SIZE];
+    struct pollfd pfd = { .fd = scanner->snmp_fd, .events = POLLIN };
+    struct sockaddr_in src;
+    socklen_t src_len;
+    ssize_t req_len;
+    size_t resp_len;
+
+    while (!atomic_load(&scanner->stop)) {
+        if (poll(&pfd, 1, SIM_POLL_INTERVAL_MS) <= 0) {
+            continue;
+        }
+
+        src_len = sizeof(src);
+        req_len = recvfrom(scanner->snmp_fd, req, sizeof(req), 0,
+                           (struct sockaddr *) &src, &src_len);
+        if (req_len <= 0) {
+            continue;
+        }
+
+        resp_len = snmp_handle_request(scanner, req, (size_t) req_len, resp, sizeof(resp));
+        if (resp_len == 0) {
+            LOG_WARN("%s: ignoring invalid SNMP request\n", scanner->ip);
+            continue;
+        }
+
+        if (sendto(scanner->snmp_fd, resp, resp_len, 0, (struct sockaddr *) &src,
+                   src_len) < 0) {
+            LOG_WARN("%s: cannot send SNMP response: %s\n", scanner->ip, strerror(errno));
+        }
+    }
+
+    return NULL;
+}
+
+static bool
+is_stopped(struct sim_scanner *scanner)
+{
+    return atomic_load(&scanner->stop) || atomic_load(&g_interrupted);
+}
+
+/* wait for the driver to register, returns the func to press or -1 */
+static int
+wait_for_registration(struct sim_scanner *scanner)
+{
+    struct timespec ts;
+    uint64_t ns;
+    int func = -1, i;
+
+    pthread_mutex_lock(&scanner->lock);
+    while (!is_stopped(scanner)) {
+        for (i = 0; i < CONFIG_SCAN_MAX_FUNCS; ++i) {
+            if (!(scanner->registered_funcs & (1u << i))) {
+                continue;
+            }
+
+            if (scanner->config->func == NULL ||
+                strcmp(scanner->config->func, g_scan_func_str[i]) == 0) {
+                func = i;
+                break;
+            }
+        }
+
+        if (func >= 0) {
+            break;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ns = (uint64_t) ts.tv_nsec + SIM_POLL_INTERVAL_MS * 1000000ull;
+        ts.tv_sec += (time_t) (ns / 1000000000ull);
+        ts.tv_nsec = (long) (ns % 1000000000ull);
+        pthread_cond_timedwait(&scanner->cond, &scanner->lock, &ts);
+    }
+    pthread_mutex_unlock(&scanner->lock);
+
+    return func;
+}
+
+static int
+press_button(struct sim_scanner *scanner, int func)
+{
+    char msg[256], host_ip[16];
+    struct sockaddr_in host;
+    int len;
+
+    pthread_mutex_lock(&scanner->lock);
+    host = scanner->host;
+    inet_ntop(AF_INET, &host.sin_addr, host_ip, sizeof(host_ip));
+    len = snprintf(msg, sizeof(msg),
+                   "TYPE=BR;BUTTON=SCAN;USER=\"%s\";FUNC=%s;HOST=%s:%u;APPNUM=%u;"
+                   "P1=0;P2=0;P3=0;P4=0;REGID=%u;SEQ=%u;",
+                   scanner->user, g_scan_func_str[func], host_ip,
+                   ntohs(host.sin_port), scanner->appnum, scanner->appnum,
+                   ++scanner->button_seq);
+    pthread_mutex_unlock(&scanner->lock);
+
+    if (sendto(scanner->button_fd, msg, (size_t) len, 0, (struct sockaddr *) &host,
+               sizeof(host)) != len) {
+        LOG_ERR("%s: cannot send button event: %s\n", scanner->ip, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* wait for the driver to connect to the data port, ignoring the button event echo */
+static int
+accept_data_conn(struct sim_scanner *scanner)
+{
+    struct pollfd pfds[2] = {
+        { .fd = scanner->listen_fd, .events = POLLIN },
+        { .fd = scanner->button_fd, .events = POLLIN },
+    };
+    struct timeval tv = { .tv_sec = scanner->config->timeout };
+    double deadline = sim_time() + scanner->config->timeout;
+    char buf[SIM_MAX_MSG_SIZE];
+    int fd;
+
+    while (!is_stopped(scanner) && sim_time() < deadline) {
+        if (poll(pfds, 2, SIM_POLL_INTERVAL_MS) <= 0) {
+            continue;
+        }
+
+        if (pfds[1].revents) {
+            recv(scanner->button_fd, buf, sizeof(buf), MSG_DONTWAIT);
+        }
+
+        if (pfds[0].revents) {
+            fd = accept(scanner->listen_fd, NULL, NULL);
+            if (fd < 0) {
+                continue;
+            }
+
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            return fd;
+        }
+    }
+
+    return -1;
+}
+
+static int
+send_all(int fd, const void *buf, size_t len, int flags)
+{
+    const uint8_t *p = buf;
+    ssize_t rc;
+
+    while (len > 0) {
+        rc = send(fd, p, len, flags | MSG_NOSIGNAL);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return -1;
+        }
+
+        p += rc;
+        len -= (size_t) rc;
+    }
+
+    return 0;
+}
+
+/* receive a driver message, all of which end with 0x80 */
+static int
+recv_msg(int fd, uint8_t *buf, size_t size)
+{
+    size_t len = 0;
+    ssize_t rc;
+
+    do {
+        rc = recv(fd, buf + len, size - len, 0);
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (rc <= 0) {
+            return -1;
+        }
+
+        len += (size_t) rc;
+    } while (buf[len - 1] != 0x80 && len < size);
+
+    return (int) len;
+}
+
+static int
+send_page(struct sim_scanner *scanner, int fd, unsigned page_id)
+{
+    const struct sim_config *config = scanner->config;
+    uint8_t header[SIM_CHUNK_HEADER_SIZE] = { 0x64, 0x07, 0x00 };
+    char tag[SIM_JPEG_TAG_LEN + 1];
+    size_t offset = 0, len;
+    unsigned progress;
+
+    /* make every page unique, e.g. for scan.dedup.dir */
+    snprintf(tag, sizeof(tag), "brother-sim %s page %u", scanner->ip,
+             ++scanner->pages_sent);
+    memset(scanner->page.data + scanner->page.tag_offset, ' ', SIM_JPEG_TAG_LEN);
+    memcpy(scanner->page.data + scanner->page.tag_offset, tag, strlen(tag));
+
+    header[3] = (uint8_t) page_id;
+    header[4] = (uint8_t) (page_id >> 8);
+
+    while (offset < scanner->page.len) {
+        len = scanner->page.len - offset;
+        if (len > config->chunk_size) {
+            len = config->chunk_size;
+        }
+
+        progress = (unsigned) ((offset + len) * SIM_CHUNK_MAX_PROGRESS / scanner->page.len);
+        header[6] = (uint8_t) progress;
+        header[7] = (uint8_t) (progress >> 8);
+        header[10] = (uint8_t) len;
+        header[11] = (uint8_t) (len >> 8);
+
+        if (send_all(fd, header, sizeof(header), MSG_MORE) != 0 ||
+            send_all(fd, scanner->page.data + offset, len, 0) != 0) {
+            return -1;
+        }
+
+        offset += len;
+    }
+
+    header[0] = 0x82;
+    return send_all(fd, header, SIM_PAGE_END_HEADER_SIZE, 0);
+}
+
+static int
+serve_batch(struct sim_scanner *scanner, int fd, int func, double button_time)
+{
+    const struct sim_config *config = scanner->config;
+    uint8_t buf[SIM_MAX_MSG_SIZE];
+    unsigned page;
+    int len;
+
+    if (send_all(fd, "+OK 200\r\n", 9, 0) != 0 ||
+        recv_msg(fd, buf, sizeof(buf)) < 4 || buf[0] != 0x1b || buf[1] != 'K') {
+        LOG_ERR("%s: invalid reply to the welcome message\n", scanner->ip);
+        return -1;
+    }
+
+    len = snprintf((char *) buf, sizeof(buf),
+                   "\x30\x15\x30" "F=%s\nD=SIN\nE=SHO\nM=CGRAY\nR=%u\n\x80",
+                   g_scan_func_str[func], config->dpi);
+    if (send_all(fd, buf, (size_t) len, 0) != 0 ||
+        recv_msg(fd, buf, sizeof(buf)) < 4 || buf[0] != 0x1b || buf[1] != 'I') {
+        LOG_ERR("%s: invalid reply to the initial scan params\n", scanner->ip);
+        return -1;
+    }
+
+    /* dpi x and y, then the scan area in mm/10 and pixels */
+    len = snprintf((char *) buf + 3, sizeof(buf) - 3, "%u,%u,2,%u,%u,%u,%u,",
+                   config->dpi, config->dpi, SIM_PAGE_WIDTH_MM * 10, scanner->width,
+                   SIM_PAGE_HEIGHT_MM * 10, scanner->height);
+    buf[0] = 0x00;
+    buf[1] = (uint8_t) (len + 1);
+    buf[2] = 0x00;
+    buf[3 + len] = 0x00;
+    if (send_all(fd, buf, (size_t) len + 4, 0) != 0 ||
+        recv_msg(fd, buf, sizeof(buf)) < 4 || buf[0] != 0x1b || buf[1] != 'X') {
+        LOG_ERR("%s: invalid reply to the scan params\n", scanner->ip);
+        return -1;
+    }
+
+    for (page = 1; page <= config->pages; ++page) {
+        if (send_page(scanner, fd, page) != 0) {
+            LOG_ERR("%s: failed to send page %u: %s\n", scanner->ip, page,
+                    strerror(errno));
+            return -1;
+        }
+
+        sim_stats_add_page(scanner->page.len, button_time);
+    }
+
+    /* no more documents to scan */
+    if (send_all(fd, "\x80", 1, 0) != 0) {
+        return -1;
+    }
+
+    sim_stats_add_latency(SIM_LATENCY_BATCH, button_time, sim_time());
+    return 0;
+}
+
+static void *
+scanner_thread_fn(void *arg)
+{
+    struct sim_scanner *scanner = arg;
+    const struct sim_config *config = scanner->config;
+    double button_time;
+    unsigned batch;
+    int func, fd, rc;
+
+    for (batch = 0; batch < config->batches; ++batch) {
+        func = wait_for_registration(scanner);
+        if (func < 0) {
+            break;
+        }
+
+        if (batch > 0 && config->interval_ms > 0) {
+            usleep(config->interval_ms * 1000);
+        }
+
+        button_time = sim_time();
+        if (press_button(scanner, func) != 0) {
+            sim_stats_add_batch(false);
+            continue;
+        }
+
+        fd = accept_data_conn(scanner);
+        if (fd < 0) {
+            if (!is_stopped(scanner)) {
+                LOG_ERR("%s: the driver didn't connect after a button press\n",
+                        scanner->ip);
+                sim_stats_add_batch(false);
+            }
+            continue;
+        }
+
+        sim_stats_add_latency(SIM_LATENCY_CONNECT, button_time, sim_time());
+        rc = serve_batch(scanner, fd, func, button_time);
+        close(fd);
+        sim_stats_add_batch(rc == 0);
+    }
+
+    return NULL;
+}
+
+static int
+open_socket(struct sim_scanner *scanner, int type, in_port_t port)
+{
+    struct sockaddr_in addr = scanner->addr;
+    int fd, one = 1;
+
+    fd = socket(AF_INET, type | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        LOG_ERR("%s: cannot create a socket: %s\n", scanner->ip, strerror(errno));
+        return -1;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        LOG_ERR("%s: cannot bind to port %u: %s\n", scanner->ip, port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+struct sim_scanner *
+sim_scanner_start(in_addr_t addr, const struct sim_config *config)
+{
+    struct sim_scanner *scanner;
+
+    scanner = calloc(1, sizeof(*scanner));
+    if (scanner == NULL) {
+        LOG_ERR("Failed to calloc a scanner.\n");
+        return NULL;
+    }
+
+    scanner->config = config;
+    scanner->addr.sin_family = AF_INET;
+    scanner->addr.sin_addr.s_addr = addr;
+    inet_ntop(AF_INET, &scanner->addr.sin_addr, scanner->ip, sizeof(scanner->ip));
+    scanner->snmp_fd = scanner->button_fd = scanner->listen_fd = -1;
+    pthread_mutex_init(&scanner->lock, NULL);
+    pthread_cond_init(&scanner->cond, NULL);
+
+    scanner->width = SIM_PAGE_WIDTH_MM * config->dpi * 10 / 254;
+    scanner->height = SIM_PAGE_HEIGHT_MM * config->dpi * 10 / 254;
+    if (sim_jpeg_generate(&scanner->page, scanner->width, scanner->height, config->dpi,
+                          config->content, ntohl(addr)) != 0) {
+        goto err;
+    }
+
+    scanner->snmp_fd = open_socket(scanner, SOCK_DGRAM, SIM_SNMP_PORT);
+    scanner->button_fd = open_socket(scanner, SOCK_DGRAM, 0);
+    scanner->listen_fd = open_socket(scanner, SOCK_STREAM, SIM_DATA_PORT);
+    if (scanner->snmp_fd < 0 || scanner->button_fd < 0 || scanner->listen_fd < 0) {
+        goto err;
+    }
+
+    if (listen(scanner->listen_fd, 1) != 0) {
+        LOG_ERR("%s: cannot listen: %s\n", scanner->ip, strerror(errno));
+        goto err;
+    }
+
+    if (pthread_create(&scanner->snmp_thread, NULL, snmp_thread_fn, scanner) != 0) {
+        LOG_ERR("%s: cannot create the SNMP thread.\n", scanner->ip);
+        goto err;
+    }
+
+    if (pthread_create(&scanner->thread, NULL, scanner_thread_fn, scanner) != 0) {
+        LOG_ERR("%s: cannot create the scanner thread.\n", scanner->ip);
+        atomic_store(&scanner->stop, true);
+        pthread_join(scanner->snmp_thread, NULL);
+        goto err;
+    }
+
+    return scanner;
+
+err:
+    if (scanner->snmp_fd >= 0) {
+        close(scanner->snmp_fd);
+    }
+    if (scanner->button_fd >= 0) {
+        close(scanner->button_fd);
+    }
+    if (scanner->listen_fd >= 0) {
+        close(scanner->listen_fd);
+    }
+    sim_jpeg_free(&scanner->page);
+    free(scanner);
+    return NULL;
+}
+
+void
+sim_scanner_wait(struct sim_scanner *scanner)
+{
+    pthread_join(scanner->thread, NULL);
+}
+
+void
+sim_scanner_free(struct sim_scanner *scanner)
+{
+    atomic_store(&scanner->stop, true);
+    pthread_join(scanner->snmp_thread, NULL);
+
+    close(scanner->snmp_fd);
+    close(scanner->button_fd);
+    close(scanner->listen_fd);
+    sim_jpeg_free(&scanner->page);
+    pthread_cond_destroy(&scanner->cond);
+    pthread_mutex_destroy(&scanner->lock);
+    free(scanner);
+}
+
+void
+sim_scanner_interrupt(void)
+{
+    atomic_store(&g_interrupted, true);
+}
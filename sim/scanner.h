@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#ifndef BROTHER_SIM_SCANNER_H
+#define BROTHER_SIM_SCANNER_H
+
+#include <netinet/in.h>
+
+struct sim_config {
+    /* scan function to press, or NULL for the first one registered */
+    const char *func;
+    unsigned batches;
+    unsigned pages;
+    unsigned interval_ms;
+    unsigned dpi;
+    /* percentage of page blocks with content */
+    unsigned content;
+    unsigned chunk_size;
+    unsigned timeout;
+};
+
+struct sim_scanner;
+
+/**
+ * Start a virtual scanner at given address. It answers SNMP requests
+ * right away, and once the driver registers, it presses the scan
+ * button for config->batches times.
+ */
+struct sim_scanner *sim_scanner_start(in_addr_t addr, const struct sim_config *config);
+
+/**
+ * Wait until the scanner is done scanning. It keeps answering SNMP
+ * requests until it's freed.
+ */
+void sim_scanner_wait(struct sim_scanner *scanner);
+
+/* must be called after sim_scanner_wait() */
+void sim_scanner_free(struct sim_scanner *scanner);
+
+/**
+ * Make all scanners stop pressing the button. Safe to call from
+ * a signal handler.
+ */
+void sim_scanner_interrupt(void);
+
+#endif //BROTHER_SIM_SCANNER_H
@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "stats.h"
+#include "../log.h"
+
+struct sample_list {
+    double *samples;
+    size_t count;
+    size_t capacity;
+};
+
+struct sim_stats {
+    pthread_mutex_t lock;
+    bool track_files;
+
+    struct sample_list latencies[SIM_LATENCY_MAX];
+    /* button times of the pages not matched with a file yet */
+    struct sample_list pending;
+    size_t pending_head;
+
+    unsigned batches;
+    unsigned failed_batches;
+    unsigned pages;
+    size_t bytes;
+    double first_time;
+    double last_time;
+};
+
+static struct sim_stats g_stats = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static const char *g_latency_str[SIM_LATENCY_MAX] = {
+    [SIM_LATENCY_CONNECT] = "button->connect",
+    [SIM_LATENCY_BATCH] = "button->batch end",
+    [SIM_LATENCY_FILE] = "button->file",
+};
+
+double
+sim_time(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+static void
+sample_list_add(struct sample_list *list, double sample)
+{
+    double *samples;
+    size_t capacity;
+
+    if (list->count == list->capacity) {
+        capacity = list->capacity ? list->capacity * 2 : 256;
+        samples = realloc(list->samples, capacity * sizeof(*samples));
+        if (samples == NULL) {
+            LOG_ERR("Failed to realloc stats samples.\n");
+            return;
+        }
+
+        list->samples = samples;
+        list->capacity = capacity;
+    }
+
+    list->samples[list->count++] = sample;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x > y) - (x < y);
+}
+
+/* p-th percentile of sorted samples, nearest rank */
+static double
+percentile(const struct sample_list *list, unsigned p)
+{
+    size_t rank = (list->count * p + 99) / 100;
+
+    return list->samples[rank ? rank - 1 : 0];
+}
+
+void
+sim_stats_init(bool track_files)
+{
+    g_stats.track_files = track_files;
+}
+
+void
+sim_stats_add_latency(enum sim_latency type, double start, double end)
+{
+    pthread_mutex_lock(&g_stats.lock);
+    sample_list_add(&g_stats.latencies[type], (end - start) * 1000.0);
+
+    if (g_stats.first_time <= 0 || start < g_stats.first_time) {
+        g_stats.first_time = start;
+    }
+
+    if (end > g_stats.last_time) {
+        g_stats.last_time = end;
+    }
+    pthread_mutex_unlock(&g_stats.lock);
+}
+
+void
+sim_stats_add_batch(bool ok)
+{
+    pthread_mutex_lock(&g_stats.lock);
+    g_stats.batches++;
+    if (!ok) {
+        g_stats.failed_batches++;
+    }
+    pthread_mutex_unlock(&g_stats.lock);
+}
+
+void
+sim_stats_add_page(size_t len, double button_time)
+{
+    pthread_mutex_lock(&g_stats.lock);
+    g_stats.pages++;
+    g_stats.bytes += len;
+    if (g_stats.track_files) {
+        sample_list_add(&g_stats.pending, button_time);
+    }
+    pthread_mutex_unlock(&g_stats.lock);
+}
+
+unsigned
+sim_stats_page_published(double time)
+{
+    unsigned pending;
+
+    pthread_mutex_lock(&g_stats.lock);
+    if (g_stats.pending_head < g_stats.pending.count) {
+        sample_list_add(&g_stats.latencies[SIM_LATENCY_FILE],
+                        (time - g_stats.pending.samples[g_stats.pending_head++]) * 1000.0);
+        if (time > g_stats.last_time) {
+            g_stats.last_time = time;
+        }
+    } else {
+        LOG_WARN("Page file created with no page sent.\n");
+    }
+
+    pending = (unsigned) (g_stats.pending.count - g_stats.pending_head);
+    pthread_mutex_unlock(&g_stats.lock);
+    return pending;
+}
+
+unsigned
+sim_stats_pending_pages(void)
+{
+    unsigned pending;
+
+    pthread_mutex_lock(&g_stats.lock);
+    pending = (unsigned) (g_stats.pending.count - g_stats.pending_head);
+    pthread_mutex_unlock(&g_stats.lock);
+    return pending;
+}
+
+void
+sim_stats_print(void)
+{
+    struct sample_list *list;
+    double elapsed;
+    int i;
+
+    pthread_mutex_lock(&g_stats.lock);
+    elapsed = g_stats.last_time - g_stats.first_time;
+
+    printf("batches: %u (%u failed), pages: %u, data: %.1f MB in %.2f s\n",
+           g_stats.batches, g_stats.failed_batches, g_stats.pages,
+           (double) g_stats.bytes / (1024 * 1024), elapsed);
+    if (elapsed > 0) {
+        printf("throughput: %.2f pages/s, %.2f MB/s\n", g_stats.pages / elapsed,
+               (double) g_stats.bytes / (1024 * 1024) / elapsed);
+    }
+
+    printf("%-18s %8s %8s %8s %8s %8s\n", "latency [ms]", "count", "p50", "p90",
+           "p99", "max");
+    for (i = 0; i < SIM_LATENCY_MAX; ++i) {
+        list = &g_stats.latencies[i];
+        if (list->count == 0) {
+            continue;
+        }
+
+        qsort(list->samples, list->count, sizeof(*list->samples), cmp_double);
+        printf("%-18s %8zu %8.1f %8.1f %8.1f %8.1f\n", g_latency_str[i], list->count,
+               percentile(list, 50), percentile(list, 90), percentile(list, 99),
+               list->samples[list->count - 1]);
+    }
+
+    if (g_stats.pending_head < g_stats.pending.count) {
+        printf("%zu pages never showed up in the watched directory\n",
+               g_stats.pending.count - g_stats.pending_head);
+    }
+    pthread_mutex_unlock(&g_stats.lock);
+}
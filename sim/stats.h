@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#ifndef BROTHER_SIM_STATS_H
+#define BROTHER_SIM_STATS_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+enum sim_latency {
+    /* button event sent -> data connection accepted */
+    SIM_LATENCY_CONNECT,
+    /* button event sent -> whole batch sent */
+    SIM_LATENCY_BATCH,
+    /* button event sent -> page file created in the watched dir */
+    SIM_LATENCY_FILE,
+    SIM_LATENCY_MAX,
+};
+
+/* monotonic time in seconds */
+double sim_time(void);
+
+void sim_stats_init(bool track_files);
+void sim_stats_add_latency(enum sim_latency type, double start, double end);
+void sim_stats_add_batch(bool ok);
+
+/**
+ * Account for a page that was sent completely. button_time is kept
+ * for the page file to be matched against, in the order of sending.
+ */
+void sim_stats_add_page(size_t len, double button_time);
+
+/**
+ * Match a newly created page file with the oldest sent page.
+ * Returns the number of pages still waiting for their file.
+ */
+unsigned sim_stats_page_published(double time);
+unsigned sim_stats_pending_pages(void);
+void sim_stats_print(void);
+
+#endif //BROTHER_SIM_STATS_H
@@ -9,150 +9,491 @@
 #include <stdio.h>
 #include <stdatomic.h>
 #include <stdbool.h>
-#include "ber/snmp.h"
+#include <pthread.h>
 #include "log.h"
 #include "config.h"
 #include "connection.h"
+#include "snmp.h"
 
 #define SNMP_PORT 161
 
-static atomic_int g_request_id;
-static uint32_t g_brInfoPrinterUStatusOID[] =
-{ 1, 3, 6, 1, 4, 1, 2435, 2, 3, 9, 4, 2, 1, 5, 5, 6, 0, SNMP_MSG_OID_END };
-static uint32_t g_brRegisterKeyInfoOID[] =
-{ 1, 3, 6, 1, 4, 1, 2435, 2, 3, 9, 2, 11, 1, 1, 0, SNMP_MSG_OID_END };
-static uint32_t g_brUnregisterKeyInfoOID[] =
-{ 1, 3, 6, 1, 4, 1, 2435, 2, 3, 9, 2, 11, 1, 2, 0, SNMP_MSG_OID_END };
+#define BER_INTEGER 0x02
+#define BER_OCTET_STRING 0x04
+#define BER_NULL 0x05
+#define BER_OID 0x06
+#define BER_SEQUENCE 0x30
+
+#define SNMP_PDU_GET_REQUEST 0xA0
+#define SNMP_PDU_GET_RESPONSE 0xA2
+#define SNMP_PDU_SET_REQUEST 0xA3
+
+/*
+ * Request ids are kept within [2^24, 2^31), so their minimal encoding is
+ * always 4 bytes long and can be patched into a prebuilt message.
+ */
+#define SNMP_REQUEST_ID_MIN 0x01000000u
+#define SNMP_REQUEST_ID_RANGE (0x80000000u - SNMP_REQUEST_ID_MIN)
+#define SNMP_REQUEST_ID_LEN 4
+
+#define SNMP_MAX_VARBINDS 4
+
+/* a constant part of a message, encoded once */
+struct snmp_template {
+    uint8_t data[64];
+    size_t len;
+};
+
+struct snmp_varbind {
+    const struct snmp_template *oid;
+    uint8_t value_type;
+    const void *value;
+    size_t value_len;
+};
+
+static atomic_uint g_request_id;
+static const uint32_t g_brInfoPrinterUStatusOID[] =
+{ 1, 3, 6, 1, 4, 1, 2435, 2, 3, 9, 4, 2, 1, 5, 5, 6, 0 };
+static const uint32_t g_brRegisterKeyInfoOID[] =
+{ 1, 3, 6, 1, 4, 1, 2435, 2, 3, 9, 2, 11, 1, 1, 0 };
+static const uint32_t g_brUnregisterKeyInfoOID[] =
+{ 1, 3, 6, 1, 4, 1, 2435, 2, 3, 9, 2, 11, 1, 2, 0 };
+
+static pthread_once_t g_templates_once = PTHREAD_ONCE_INIT;
+/* version and community TLVs */
+static struct snmp_template g_public_header;
+static struct snmp_template g_internal_header;
+/* OID TLVs */
+static struct snmp_template g_status_oid;
+static struct snmp_template g_register_oid;
+static struct snmp_template g_unregister_oid;
+/* the whole status request, only its request id changes */
+static struct snmp_template g_status_request;
+static size_t g_status_request_id_offset;
+
+static size_t
+ber_len_size(size_t len)
+{
+    return len < 0x80 ? 1 : len < 0x100 ? 2 : 3;
+}
+
+static size_t
+ber_tlv_size(size_t len)
+{
+    return 1 + ber_len_size(len) + len;
+}
+
+static uint8_t *
+ber_put_header(uint8_t *p, uint8_t tag, size_t len)
+{
+    *p++ = tag;
+    if (len >= 0x100) {
+        *p++ = 0x82;
+        *p++ = (uint8_t) (len >> 8);
+    } else if (len >= 0x80) {
+        *p++ = 0x81;
+    }
+    *p++ = (uint8_t) len;
+    return p;
+}
+
+/*
+ * Read a BER tag and length, making sure the value fits before end.
+ * Returns a pointer to the value, or NULL if the data is malformed.
+ */
+static const uint8_t *
+ber_read(const uint8_t *p, const uint8_t *end, uint8_t tag, size_t *len)
+{
+    size_t i, n;
+
+    if (end - p < 2 || p[0] != tag) {
+        return NULL;
+    }
+
+    n = p[1];
+    p += 2;
+    if (n & 0x80) {
+        i = n & 0x7F;
+        if (i == 0 || i > 2 || (size_t) (end - p) < i) {
+            return NULL;
+        }
+
+        for (n = 0; i > 0; --i) {
+            n = (n << 8) | *p++;
+        }
+    }
+
+    if ((size_t) (end - p) < n) {
+        return NULL;
+    }
+
+    *len = n;
+    return p;
+}
+
+static int
+ber_read_int(const uint8_t *p, size_t len, int *value)
+{
+    uint32_t v;
+    size_t i;
+
+    if (len == 0 || len > 4) {
+        return -1;
+    }
+
+    /* sign extend */
+    v = (p[0] & 0x80) ? UINT32_MAX : 0;
+    for (i = 0; i < len; ++i) {
+        v = (v << 8) | p[i];
+    }
+
+    *value = (int) v;
+    return 0;
+}
+
+static void
+template_put_oid(struct snmp_template *tmpl, const uint32_t *oid, size_t count)
+{
+    uint8_t body[sizeof(tmpl->data)];
+    uint32_t arc;
+    size_t i, len = 0;
+    int shift;
+
+    body[len++] = (uint8_t) (oid[0] * 40 + oid[1]);
+    for (i = 2; i < count; ++i) {
+        arc = oid[i];
+        for (shift = 28; shift > 0 && (arc >> shift) == 0; shift -= 7);
+        for (; shift > 0; shift -= 7) {
+            body[len++] = (uint8_t) (0x80 | ((arc >> shift) & 0x7F));
+        }
+        body[len++] = (uint8_t) (arc & 0x7F);
+    }
+
+    tmpl->len = (size_t) (ber_put_header(tmpl->data, BER_OID, len) - tmpl->data);
+    memcpy(tmpl->data + tmpl->len, body, len);
+    tmpl->len += len;
+}
+
+static void
+template_put_header(struct snmp_template *tmpl, const char *community)
+{
+    size_t len = strlen(community);
+    uint8_t *p = tmpl->data;
+
+    p = ber_put_header(p, BER_INTEGER, 1);
+    *p++ = 0; /* SNMPv1 */
+    p = ber_put_header(p, BER_OCTET_STRING, len);
+    memcpy(p, community, len);
+    tmpl->len = (size_t) (p - tmpl->data) + len;
+}
+
+/*
+ * Encode a whole message. Returns its length, or -1 if it doesn't fit.
+ * request_id_offset receives the position of the request id bytes.
+ */
+static int
+snmp_encode(uint8_t *buf, size_t buf_len, const struct snmp_template *header,
+            uint8_t pdu_type, uint32_t request_id,
+            const struct snmp_varbind *varbinds, unsigned count,
+            size_t *request_id_offset)
+{
+    size_t vb_len[SNMP_MAX_VARBINDS];
+    size_t list_len = 0, pdu_len, msg_len;
+    uint8_t *p = buf;
+    unsigned i;
+
+    for (i = 0; i < count; ++i) {
+        vb_len[i] = varbinds[i].oid->len + ber_tlv_size(varbinds[i].value_len);
+        list_len += ber_tlv_size(vb_len[i]);
+    }
+
+    pdu_len = ber_tlv_size(SNMP_REQUEST_ID_LEN) + 2 * ber_tlv_size(1) +
+              ber_tlv_size(list_len);
+    msg_len = header->len + ber_tlv_size(pdu_len);
+    if (ber_tlv_size(msg_len) > buf_len) {
+        return -1;
+    }
+
+    p = ber_put_header(p, BER_SEQUENCE, msg_len);
+    memcpy(p, header->data, header->len);
+    p += header->len;
+    p = ber_put_header(p, pdu_type, pdu_len);
+
+    p = ber_put_header(p, BER_INTEGER, SNMP_REQUEST_ID_LEN);
+    if (request_id_offset) {
+        *request_id_offset = (size_t) (p - buf);
+    }
+    *p++ = (uint8_t) (request_id >> 24);
+    *p++ = (uint8_t) (request_id >> 16);
+    *p++ = (uint8_t) (request_id >> 8);
+    *p++ = (uint8_t) request_id;
+
+    /* error status and index */
+    p = ber_put_header(p, BER_INTEGER, 1);
+    *p++ = 0;
+    p = ber_put_header(p, BER_INTEGER, 1);
+    *p++ = 0;
+
+    p = ber_put_header(p, BER_SEQUENCE, list_len);
+    for (i = 0; i < count; ++i) {
+        p = ber_put_header(p, BER_SEQUENCE, vb_len[i]);
+        memcpy(p, varbinds[i].oid->data, varbinds[i].oid->len);
+        p += varbinds[i].oid->len;
+        p = ber_put_header(p, varbinds[i].value_type, varbinds[i].value_len);
+        if (varbinds[i].value_len > 0) {
+            memcpy(p, varbinds[i].value, varbinds[i].value_len);
+            p += varbinds[i].value_len;
+        }
+    }
+
+    return (int) (p - buf);
+}
 
 static void
-init_msg_header(struct snmp_msg_header *msg_header, const char *community,
-                enum snmp_data_type type)
+snmp_init_templates(void)
+{
+    struct snmp_varbind varbind = { &g_status_oid, BER_NULL, NULL, 0 };
+    int len;
+
+    template_put_header(&g_public_header, "public");
+    template_put_header(&g_internal_header, "internal");
+    template_put_oid(&g_status_oid, g_brInfoPrinterUStatusOID,
+                     sizeof(g_brInfoPrinterUStatusOID) / sizeof(uint32_t));
+    template_put_oid(&g_register_oid, g_brRegisterKeyInfoOID,
+                     sizeof(g_brRegisterKeyInfoOID) / sizeof(uint32_t));
+    template_put_oid(&g_unregister_oid, g_brUnregisterKeyInfoOID,
+                     sizeof(g_brUnregisterKeyInfoOID) / sizeof(uint32_t));
+
+    len = snmp_encode(g_status_request.data, sizeof(g_status_request.data),
+                      &g_public_header, SNMP_PDU_GET_REQUEST, SNMP_REQUEST_ID_MIN,
+                      &varbind, 1, &g_status_request_id_offset);
+    g_status_request.len = (size_t) len;
+}
+
+static uint32_t
+next_request_id(void)
 {
-    msg_header->snmp_ver = 0;
-    msg_header->community = community;
-    msg_header->pdu_type = type;
-    msg_header->request_id = atomic_fetch_add(&g_request_id, 1);
+    return SNMP_REQUEST_ID_MIN + atomic_fetch_add(&g_request_id, 1) % SNMP_REQUEST_ID_RANGE;
 }
 
 int
-snmp_get_printer_status(struct brother_conn *conn, uint8_t *buf, size_t buf_len,
-                        in_addr_t dest_addr)
+snmp_decode_response(uint8_t *buf, size_t len, int *request_id, int *value)
 {
-    uint8_t *buf_end = buf + buf_len - 1;
-    struct snmp_msg_header msg_header = {0};
-    struct snmp_varbind varbind = {0};
-    size_t snmp_len;
-    uint8_t *out;
-    int msg_len, rc = -1;
-    uint32_t varbind_num = 1;
+    const uint8_t *end = buf + len, *p, *field;
+    size_t field_len;
+    int error_status;
 
-    init_msg_header(&msg_header, "public", SNMP_DATA_T_PDU_GET_REQUEST);
-    memcpy(varbind.oid, g_brInfoPrinterUStatusOID,
-           sizeof(g_brInfoPrinterUStatusOID));
-    varbind.value_type = SNMP_DATA_T_NULL;
+    *request_id = -1;
 
-    out = snmp_encode_msg(buf_end, &msg_header, varbind_num, &varbind);
-    snmp_len = buf_end - out + 1;
+    /* message, version, community, then the response pdu */
+    p = ber_read(buf, end, BER_SEQUENCE, &field_len);
+    if (p == NULL) {
+        return -1;
+    }
+    end = p + field_len;
 
-    msg_len = brother_conn_sendto(conn, out, snmp_len, dest_addr, htons(SNMP_PORT));
-    if (msg_len < 0 || (size_t) msg_len != snmp_len) {
-        perror("sendto");
+    field = ber_read(p, end, BER_INTEGER, &field_len);
+    if (field == NULL) {
         return -1;
     }
 
-    rc = brother_conn_poll(conn, 3);
-    if (rc <= 0) {
-        LOG_ERR("Failed to receive SNMP status reponse.\n");
+    field = ber_read(field + field_len, end, BER_OCTET_STRING, &field_len);
+    if (field == NULL) {
         return -1;
     }
 
-    msg_len = brother_conn_receive(conn, buf, buf_len);
-    if (msg_len < 6) {
-        perror("recvfrom");
+    p = ber_read(field + field_len, end, SNMP_PDU_GET_RESPONSE, &field_len);
+    if (p == NULL) {
         return -1;
     }
+    end = p + field_len;
 
-    snmp_decode_msg(buf, msg_len, &msg_header, &varbind_num, &varbind);
-    if (msg_header.error_index != 0 && msg_header.error_status != 0) {
-        LOG_ERR("Received invalid printer status SNMP response\n");
-        DUMP_ERR(buf, (size_t) msg_len);
+    field = ber_read(p, end, BER_INTEGER, &field_len);
+    if (field == NULL || ber_read_int(field, field_len, request_id) != 0) {
+        return -1;
+    }
+
+    field = ber_read(field + field_len, end, BER_INTEGER, &field_len);
+    if (field == NULL || ber_read_int(field, field_len, &error_status) != 0 ||
+        error_status != 0) {
+        return -1;
+    }
+
+    if (value == NULL) {
+        return 0;
+    }
+
+    /* skip the error index, then take the value of the first varbind */
+    field = ber_read(field + field_len, end, BER_INTEGER, &field_len);
+    if (field == NULL) {
+        return -1;
+    }
+
+    p = ber_read(field + field_len, end, BER_SEQUENCE, &field_len);
+    if (p == NULL || (p = ber_read(p, p + field_len, BER_SEQUENCE, &field_len)) == NULL) {
+        return -1;
+    }
+    end = p + field_len;
+
+    field = ber_read(p, end, BER_OID, &field_len);
+    if (field == NULL) {
         return -1;
     }
 
-    rc = (int) varbind.value.i;
-    return rc;
+    field = ber_read(field + field_len, end, BER_INTEGER, &field_len);
+    if (field == NULL || ber_read_int(field, field_len, value) != 0) {
+        *value = -1;
+    }
+
+    return 0;
+}
+
+static int
+snmp_send(struct brother_conn *conn, const uint8_t *msg, size_t msg_len,
+          in_addr_t dest_addr)
+{
+    int sent;
+
+    sent = brother_conn_sendto(conn, msg, msg_len, dest_addr, htons(SNMP_PORT));
+    if (sent < 0 || (size_t) sent != msg_len) {
+        perror("sendto");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* wait for the response to given request, skipping any stale ones */
+static int
+snmp_receive(struct brother_conn *conn, uint8_t *buf, size_t buf_len,
+             int request_id, int *value)
+{
+    int msg_len, rc, id;
+
+    while (true) {
+        rc = brother_conn_poll(conn, 3);
+        if (rc <= 0) {
+            LOG_ERR("Failed to receive SNMP status reponse.\n");
+            return -1;
+        }
+
+        msg_len = brother_conn_receive(conn, buf, buf_len);
+        if (msg_len < 6) {
+            perror("recvfrom");
+            return -1;
+        }
+
+        if (brother_conn_get_client_port(conn) != htons(SNMP_PORT)) {
+            continue;
+        }
+
+        rc = snmp_decode_response(buf, (size_t) msg_len, &id, value);
+        if (id == request_id) {
+            return rc == 0 ? msg_len : -1;
+        }
+    }
 }
 
 int
-snmp_register_scanner_driver(struct brother_conn *conn, bool enabled,
-                             uint8_t *buf, size_t buf_len,
-                             const char **functions,
-                             in_addr_t dest_addr)
+snmp_send_printer_status(struct brother_conn *conn, uint8_t *buf, size_t buf_len,
+                         in_addr_t dest_addr, int *request_id)
 {
-    uint8_t *buf_end = buf + buf_len - 1;
+    uint32_t id = next_request_id();
+    uint8_t *p;
+
+    pthread_once(&g_templates_once, snmp_init_templates);
+    if (buf_len < g_status_request.len) {
+        return -1;
+    }
+
+    memcpy(buf, g_status_request.data, g_status_request.len);
+    p = buf + g_status_request_id_offset;
+    p[0] = (uint8_t) (id >> 24);
+    p[1] = (uint8_t) (id >> 16);
+    p[2] = (uint8_t) (id >> 8);
+    p[3] = (uint8_t) id;
 
-    struct snmp_msg_header msg_header = {0};
-    struct snmp_varbind varbind[CONFIG_SCAN_MAX_FUNCS] = {0};
-    va_list args;
-    size_t snmp_len;
-    uint8_t *out;
-    uint32_t i, varbind_num;
-    int msg_len, rc = -1;
+    *request_id = (int) id;
+    return snmp_send(conn, buf, g_status_request.len, dest_addr);
+}
+
+int
+snmp_send_register_scanner_driver(struct brother_conn *conn, bool enabled,
+                                  uint8_t *buf, size_t buf_len,
+                                  const char *functions[4],
+                                  in_addr_t dest_addr, int *request_id)
+{
+    struct snmp_varbind varbind[SNMP_MAX_VARBINDS];
+    uint32_t id = next_request_id();
+    unsigned i;
+    int len;
 
-    init_msg_header(&msg_header, "internal", SNMP_DATA_T_PDU_SET_REQUEST);
+    pthread_once(&g_templates_once, snmp_init_templates);
 
-    for (i = 0; i < 4; ++i) {
+    for (i = 0; i < SNMP_MAX_VARBINDS; ++i) {
         if (functions[i] == NULL || functions[i][0] == 0) {
             break;
         }
 
-        if (enabled) {
-            memcpy(varbind[i].oid, g_brRegisterKeyInfoOID,
-                   sizeof(g_brRegisterKeyInfoOID));
-        } else {
-            memcpy(varbind[i].oid, g_brUnregisterKeyInfoOID,
-                   sizeof(g_brUnregisterKeyInfoOID));
-        }
+        varbind[i].oid = enabled ? &g_register_oid : &g_unregister_oid;
+        varbind[i].value_type = BER_OCTET_STRING;
+        varbind[i].value = functions[i];
+        varbind[i].value_len = strlen(functions[i]);
+    }
 
-        varbind[i].value_type = SNMP_DATA_T_OCTET_STRING;
-        varbind[i].value.s = functions[i];
+    len = snmp_encode(buf, buf_len, &g_internal_header, SNMP_PDU_SET_REQUEST, id,
+                      varbind, i, NULL);
+    if (len < 0) {
+        LOG_ERR("SNMP register message doesn't fit in %zu bytes.\n", buf_len);
+        return -1;
     }
 
-    varbind_num = i;
-    out = snmp_encode_msg(buf_end, &msg_header, varbind_num, varbind);
-    snmp_len = buf_end - out + 1;
+    *request_id = (int) id;
+    return snmp_send(conn, buf, (size_t) len, dest_addr);
+}
 
-    msg_len = brother_conn_sendto(conn, out, snmp_len, dest_addr, htons(SNMP_PORT));
-    if (msg_len < 0 || (size_t) msg_len != snmp_len) {
-        perror("sendto");
+int
+snmp_get_printer_status(struct brother_conn *conn, uint8_t *buf, size_t buf_len,
+                        in_addr_t dest_addr)
+{
+    int msg_len, request_id, status;
+
+    if (snmp_send_printer_status(conn, buf, buf_len, dest_addr, &request_id) != 0) {
         return -1;
     }
 
-    rc = brother_conn_poll(conn, 3);
-    if (rc <= 0) {
-        LOG_ERR("Failed to receive SNMP status reponse.\n");
+    msg_len = snmp_receive(conn, buf, buf_len, request_id, &status);
+    if (msg_len < 0) {
+        LOG_ERR("Received invalid printer status SNMP response\n");
         return -1;
     }
 
-    msg_len = brother_conn_receive(conn, buf, buf_len);
-    if (msg_len < 6) {
-        perror("recvfrom");
+    return status;
+}
+
+int
+snmp_register_scanner_driver(struct brother_conn *conn, bool enabled,
+                             uint8_t *buf, size_t buf_len,
+                             const char *functions[4],
+                             in_addr_t dest_addr)
+{
+    int msg_len, request_id;
+
+    if (snmp_send_register_scanner_driver(conn, enabled, buf, buf_len, functions,
+                                          dest_addr, &request_id) != 0) {
         return -1;
     }
 
+    msg_len = snmp_receive(conn, buf, buf_len, request_id, NULL);
     if (!enabled) {
         /* unregister msg is not implemented for some scanners,
          * ignore all errors */
         return 0;
     }
 
-    snmp_decode_msg(buf, msg_len, &msg_header, &varbind_num, varbind);
-    if (msg_header.error_index != 0 && msg_header.error_status != 0) {
+    if (msg_len < 0) {
         LOG_ERR("Received invalid register SNMP response\n");
-        DUMP_ERR(buf, (size_t) msg_len);
         return -1;
     }
 
-    rc = msg_len;
-    return rc;
+    return msg_len;
 }
@@ -16,4 +16,22 @@ int snmp_register_scanner_driver(struct brother_conn *conn, bool enabled,
                                  uint8_t *buf, size_t buf_len,
                                  const char *functions[4], in_addr_t dest_addr);
 
+/**
+ * Send a request without waiting for the response. The response can be
+ * matched with given request_id once it's decoded with snmp_decode_response().
+ */
+int snmp_send_printer_status(struct brother_conn *conn, uint8_t *buf, size_t buf_len,
+                             in_addr_t dest_addr, int *request_id);
+int snmp_send_register_scanner_driver(struct brother_conn *conn, bool enabled,
+                                      uint8_t *buf, size_t buf_len,
+                                      const char *functions[4], in_addr_t dest_addr,
+                                      int *request_id);
+
+/**
+ * Decode a received response. Returns -1 if the device reported an error,
+ * without logging it.
+ * value receives the first integer varbind, and may be NULL.
+ */
+int snmp_decode_response(uint8_t *buf, size_t len, int *request_id, int *value);
+
 #endif //BROTHER_SNMP_H
@@ -0,0 +1,913 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include "spool.h"
+#include "config.h"
+#include "log.h"
+
+#define SPOOL_FILE_MODE 0644
+/* granularity of memory budget reservations */
+#define SPOOL_MEMORY_CHUNK 0x10000
+#define SPOOL_WRITER_BUF_SIZE 0x10000
+/* disk space is allocated ahead of the writer in steps of this size */
+#define SPOOL_PREALLOC_CHUNK (1024 * 1024)
+
+struct spool_buf {
+    struct spool *spool;
+    /* where the data goes in the file */
+    size_t offset;
+    size_t len;
+    uint8_t *data;
+    /* allocated past the pool, freed once written */
+    bool extra;
+    TAILQ_ENTRY(spool_buf) tailq;
+};
+
+struct spool {
+    int fd;
+    char *dir;
+    /* set only if the fs doesn't support O_TMPFILE */
+    char *tmp_path;
+    size_t size;
+
+    /* data is kept in a memfd until it outgrows mem_limit */
+    bool in_memory;
+    size_t mem_limit;
+    size_t mem_reserved;
+
+    /* disk writes are done by the writer thread */
+    bool async;
+    /* buffer being filled, queued once full */
+    struct spool_buf *buf;
+    /* buffers queued for the writer, guarded by g_writer.lock */
+    unsigned pending;
+    /* signalled once the writer frees a buffer, see spool_writable() */
+    int wait_fd;
+    bool waiting;
+    TAILQ_ENTRY(spool) wait_tailq;
+    atomic_int error;
+    atomic_bool discard;
+    /* the writer's progress, touched by others only with nothing pending */
+    size_t written;
+    size_t synced;
+    size_t allocated;
+    /* expected final size, allocated on disk ahead of the data */
+    atomic_size_t prealloc_size;
+};
+
+/*
+ * Writes the disk spools from a pool of buffers. The receiving threads
+ * check spool_writable() before reading more data, and stop reading
+ * while the pool is used up. Whatever doesn't fit in the pool anyway
+ * goes to an extra buffer, so the receiving threads never touch the
+ * disk themselves.
+ */
+struct spool_writer {
+    bool running;
+    pthread_t thread;
+
+    /* everything below is guarded by the lock */
+    pthread_mutex_t lock;
+    pthread_cond_t queued;
+    pthread_cond_t written;
+    TAILQ_HEAD(, spool_buf) queue;
+    /* queued or being written */
+    unsigned num_queued;
+    bool stopping;
+    struct spool_buf *bufs;
+    uint8_t *data;
+    struct spool_buf **free_bufs;
+    unsigned num_free;
+    /* spools waiting for a free buffer */
+    TAILQ_HEAD(, spool) waiters;
+
+    unsigned long writes;
+    /* buffers allocated past the pool */
+    unsigned long extra_bufs;
+};
+
+/* memory held by all in-memory spools */
+static atomic_size_t g_memory_used;
+/* makes the temporary names of concurrent publishes unique */
+static atomic_uint g_publish_seq;
+static struct spool_writer g_writer;
+
+static char *
+hidden_path(const char *path, const char *suffix)
+{
+    const char *base;
+    char *ret;
+    int rc;
+
+    base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+
+    rc = asprintf(&ret, "%.*s.%s%s", (int)(base - path), path, base, suffix);
+    return rc < 0 ? NULL : ret;
+}
+
+/* open an unnamed file in spool->dir */
+static int
+open_disk_file(struct spool *spool)
+{
+    char *tmp_path;
+    int fd;
+
+    fd = open(spool->dir, O_TMPFILE | O_RDWR | O_CLOEXEC, SPOOL_FILE_MODE);
+    if (fd >= 0) {
+        return fd;
+    }
+
+    if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL) {
+        LOG_ERR("Cannot create spool file in '%s': %s\n", spool->dir, strerror(errno));
+        return -1;
+    }
+
+    /* fall back to a hidden file that will be renamed on publish */
+    if (asprintf(&tmp_path, "%s/.scan.XXXXXX", spool->dir) < 0) {
+        return -1;
+    }
+
+    fd = mkostemp(tmp_path, O_CLOEXEC);
+    if (fd < 0) {
+        LOG_ERR("Cannot create spool file '%s': %s\n", tmp_path, strerror(errno));
+        free(tmp_path);
+        return -1;
+    }
+
+    fchmod(fd, SPOOL_FILE_MODE);
+    spool->tmp_path = tmp_path;
+    return fd;
+}
+
+static void
+release_memory(struct spool *spool)
+{
+    atomic_fetch_sub(&g_memory_used, spool->mem_reserved);
+    spool->mem_reserved = 0;
+}
+
+/* make sure the memory budget covers size bytes of data */
+static bool
+reserve_memory(struct spool *spool, size_t size)
+{
+    size_t reserve, used;
+
+    if (size <= spool->mem_reserved) {
+        return true;
+    }
+
+    if (size > spool->mem_limit) {
+        return false;
+    }
+
+    reserve = (size + SPOOL_MEMORY_CHUNK - 1) & ~(size_t) (SPOOL_MEMORY_CHUNK - 1);
+    if (reserve > spool->mem_limit) {
+        reserve = spool->mem_limit;
+    }
+
+    reserve -= spool->mem_reserved;
+    used = atomic_fetch_add(&g_memory_used, reserve) + reserve;
+    if (used > g_config.spool_memory_budget) {
+        atomic_fetch_sub(&g_memory_used, reserve);
+        return false;
+    }
+
+    spool->mem_reserved += reserve;
+    return true;
+}
+
+/* make sure size bytes are allocated. Not done by the receiving thread for async spools */
+static void
+preallocate(struct spool *spool, size_t size)
+{
+    if (spool->allocated == SIZE_MAX || size <= spool->allocated) {
+        return;
+    }
+
+    if (fallocate(spool->fd, 0, (off_t) spool->allocated,
+                  (off_t) (size - spool->allocated)) == 0) {
+        spool->allocated = size;
+    } else {
+        /* most likely unsupported by the fs, don't try again */
+        spool->allocated = SIZE_MAX;
+    }
+}
+
+/* move the data from memory to a file in the destination directory */
+static int
+spill_to_disk(struct spool *spool)
+{
+    off_t offset = 0;
+    ssize_t rc;
+    int fd;
+
+    fd = open_disk_file(spool);
+    if (fd < 0) {
+        return -1;
+    }
+
+    while ((size_t) offset < spool->size) {
+        rc = sendfile(fd, spool->fd, &offset, spool->size - (size_t) offset);
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (rc <= 0) {
+            LOG_ERR("Failed to copy spool file to disk: %s\n", strerror(errno));
+            close(fd);
+            if (spool->tmp_path) {
+                unlink(spool->tmp_path);
+                free(spool->tmp_path);
+                spool->tmp_path = NULL;
+            }
+            return -1;
+        }
+    }
+
+    close(spool->fd);
+    spool->fd = fd;
+    spool->in_memory = false;
+    spool->async = g_writer.running;
+    spool->written = spool->synced = spool->allocated = spool->size;
+    release_memory(spool);
+    if (!spool->async) {
+        preallocate(spool, atomic_load(&spool->prealloc_size));
+    }
+    return 0;
+}
+
+/* write len bytes at offset, retrying short writes */
+static int
+write_at(int fd, const uint8_t *data, size_t len, size_t offset)
+{
+    ssize_t rc;
+
+    while (len > 0) {
+        rc = pwrite(fd, data, len, (off_t) offset);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            LOG_ERR("Failed to write spool file: %s\n", strerror(errno));
+            return -1;
+        }
+
+        data += rc;
+        len -= (size_t) rc;
+        offset += (size_t) rc;
+    }
+
+    return 0;
+}
+
+/* returns NULL only if the pool is exhausted and malloc() fails */
+static struct spool_buf *
+writer_get_buf(void)
+{
+    struct spool_buf *buf = NULL;
+
+    pthread_mutex_lock(&g_writer.lock);
+    if (g_writer.num_free > 0) {
+        buf = g_writer.free_bufs[--g_writer.num_free];
+    } else {
+        g_writer.extra_bufs++;
+    }
+    pthread_mutex_unlock(&g_writer.lock);
+
+    if (buf == NULL) {
+        buf = calloc(1, sizeof(*buf) + SPOOL_WRITER_BUF_SIZE);
+        if (buf == NULL) {
+            LOG_ERR("Failed to calloc spool writer buffer.\n");
+            return NULL;
+        }
+        buf->data = (uint8_t *) (buf + 1);
+        buf->extra = true;
+    }
+
+    return buf;
+}
+
+/* must be called with g_writer.lock held */
+static void
+writer_put_buf(struct spool_buf *buf)
+{
+    struct spool *spool;
+    uint64_t one = 1;
+
+    if (buf->extra) {
+        free(buf);
+    } else {
+        buf->spool = NULL;
+        buf->len = 0;
+        g_writer.free_bufs[g_writer.num_free++] = buf;
+    }
+
+    /* even with nothing freed to the pool, the waiter may go past it now */
+    while ((spool = TAILQ_FIRST(&g_writer.waiters)) != NULL) {
+        TAILQ_REMOVE(&g_writer.waiters, spool, wait_tailq);
+        spool->waiting = false;
+        if (write(spool->wait_fd, &one, sizeof(one)) < 0) {
+            LOG_ERR("Failed to signal spool wait fd: %s\n", strerror(errno));
+        }
+    }
+}
+
+static void
+writer_submit(struct spool *spool)
+{
+    struct spool_buf *buf = spool->buf;
+
+    spool->buf = NULL;
+    pthread_mutex_lock(&g_writer.lock);
+    spool->pending++;
+    g_writer.num_queued++;
+    TAILQ_INSERT_TAIL(&g_writer.queue, buf, tailq);
+    pthread_cond_signal(&g_writer.queued);
+    pthread_mutex_unlock(&g_writer.lock);
+}
+
+/* wait until all data written so far reached the file */
+static int
+writer_flush(struct spool *spool)
+{
+    if (!spool->async) {
+        return 0;
+    }
+
+    if (spool->buf) {
+        writer_submit(spool);
+    }
+
+    pthread_mutex_lock(&g_writer.lock);
+    while (spool->pending > 0) {
+        pthread_cond_wait(&g_writer.written, &g_writer.lock);
+    }
+    pthread_mutex_unlock(&g_writer.lock);
+
+    return atomic_load(&spool->error);
+}
+
+static void
+writer_write(struct spool_buf *buf)
+{
+    struct spool *spool = buf->spool;
+    size_t end = buf->offset + buf->len, alloc;
+
+    if (atomic_load(&spool->error) != 0 || atomic_load(&spool->discard)) {
+        return;
+    }
+
+    if (end > spool->allocated) {
+        /* fewer, larger extents. The excess is trimmed on publish */
+        alloc = (end + SPOOL_PREALLOC_CHUNK - 1) & ~(size_t) (SPOOL_PREALLOC_CHUNK - 1);
+        if (alloc < atomic_load(&spool->prealloc_size)) {
+            alloc = atomic_load(&spool->prealloc_size);
+        }
+        preallocate(spool, alloc);
+    }
+
+    if (write_at(spool->fd, buf->data, buf->len, buf->offset) != 0) {
+        atomic_store(&spool->error, -1);
+        return;
+    }
+
+    if (end > spool->written) {
+        spool->written = end;
+    }
+
+    if (g_config.spool_writer_sync > 0 &&
+        spool->written - spool->synced >= g_config.spool_writer_sync) {
+        fdatasync(spool->fd);
+        spool->synced = spool->written;
+    }
+}
+
+static void *
+writer_thread_fn(void *arg)
+{
+    struct spool_buf *buf;
+    struct spool *spool;
+
+    pthread_mutex_lock(&g_writer.lock);
+    while (true) {
+        while (TAILQ_EMPTY(&g_writer.queue) && !g_writer.stopping) {
+            pthread_cond_wait(&g_writer.queued, &g_writer.lock);
+        }
+
+        /* all spools are closed by the time it's stopped */
+        buf = TAILQ_FIRST(&g_writer.queue);
+        if (buf == NULL) {
+            break;
+        }
+
+        TAILQ_REMOVE(&g_writer.queue, buf, tailq);
+        pthread_mutex_unlock(&g_writer.lock);
+
+        writer_write(buf);
+
+        spool = buf->spool;
+        pthread_mutex_lock(&g_writer.lock);
+        g_writer.writes++;
+        g_writer.num_queued--;
+        writer_put_buf(buf);
+        if (--spool->pending == 0) {
+            pthread_cond_broadcast(&g_writer.written);
+        }
+    }
+    pthread_mutex_unlock(&g_writer.lock);
+
+    return NULL;
+}
+
+static int
+write_async(struct spool *spool, const uint8_t *data, size_t len)
+{
+    struct spool_buf *buf;
+    size_t copy_len;
+
+    if (atomic_load(&spool->error) != 0) {
+        return -1;
+    }
+
+    while (len > 0) {
+        if (spool->buf == NULL) {
+            spool->buf = writer_get_buf();
+            if (spool->buf == NULL) {
+                atomic_store(&spool->error, -1);
+                return -1;
+            }
+            spool->buf->spool = spool;
+            spool->buf->offset = spool->size;
+        }
+
+        buf = spool->buf;
+        copy_len = SPOOL_WRITER_BUF_SIZE - buf->len;
+        if (copy_len > len) {
+            copy_len = len;
+        }
+
+        memcpy(buf->data + buf->len, data, copy_len);
+        buf->len += copy_len;
+        data += copy_len;
+        len -= copy_len;
+        spool->size += copy_len;
+
+        if (buf->len == SPOOL_WRITER_BUF_SIZE) {
+            writer_submit(spool);
+        }
+    }
+
+    return 0;
+}
+
+/* hardlink src at path, replacing whatever is there */
+static int
+link_replace(const char *src, int flags, const char *path)
+{
+    char suffix[32];
+    char *tmp_path;
+    int rc;
+
+    if (linkat(AT_FDCWD, src, AT_FDCWD, path, flags) == 0) {
+        return 0;
+    }
+
+    if (errno != EEXIST) {
+        LOG_ERR("Cannot link '%s' to '%s': %s\n", src, path, strerror(errno));
+        return -1;
+    }
+
+    /*
+     * linkat() won't replace files, go through a temporary name. Other
+     * devices may be publishing to the same path at the same time.
+     */
+    snprintf(suffix, sizeof(suffix), ".%d.%u.tmp", (int) getpid(),
+             atomic_fetch_add(&g_publish_seq, 1));
+    tmp_path = hidden_path(path, suffix);
+    if (tmp_path == NULL) {
+        return -1;
+    }
+
+    unlink(tmp_path);
+    rc = linkat(AT_FDCWD, src, AT_FDCWD, tmp_path, flags);
+    if (rc == 0) {
+        rc = rename(tmp_path, path);
+        /* rename() is a no-op if both are links to the same file already */
+        unlink(tmp_path);
+    }
+
+    if (rc != 0) {
+        LOG_ERR("Cannot publish '%s' to '%s': %s\n", src, path, strerror(errno));
+    }
+
+    free(tmp_path);
+    return rc;
+}
+
+struct spool *
+spool_open(const char *dir, size_t mem_limit)
+{
+    struct spool *spool;
+
+    spool = calloc(1, sizeof(*spool));
+    if (spool == NULL) {
+        LOG_ERR("Failed to calloc spool.\n");
+        return NULL;
+    }
+
+    spool->wait_fd = -1;
+    spool->dir = strdup(dir);
+    if (spool->dir == NULL) {
+        free(spool);
+        return NULL;
+    }
+
+    if (mem_limit > 0 && g_config.spool_memory_budget > 0) {
+        spool->fd = memfd_create("spool", MFD_CLOEXEC);
+        if (spool->fd >= 0) {
+            spool->in_memory = true;
+            spool->mem_limit = mem_limit;
+            return spool;
+        }
+
+        LOG_WARN("Cannot create in-memory spool: %s\n", strerror(errno));
+    }
+
+    spool->fd = open_disk_file(spool);
+    if (spool->fd < 0) {
+        free(spool->dir);
+        free(spool);
+        return NULL;
+    }
+
+    spool->async = g_writer.running;
+    return spool;
+}
+
+void
+spool_preallocate(struct spool *spool, size_t size)
+{
+    atomic_store(&spool->prealloc_size, size);
+    /* otherwise done on spill, or by the writer with the next write */
+    if (!spool->in_memory && !spool->async) {
+        preallocate(spool, size);
+    }
+}
+
+bool
+spool_writable(struct spool *spool, size_t len)
+{
+    size_t room = 0;
+    size_t needed;
+    uint64_t cnt;
+    bool writable;
+
+    if (!spool->async) {
+        return true;
+    }
+
+    if (spool->buf) {
+        room = SPOOL_WRITER_BUF_SIZE - spool->buf->len;
+    }
+
+    if (len <= room) {
+        return true;
+    }
+
+    needed = (len - room + SPOOL_WRITER_BUF_SIZE - 1) / SPOOL_WRITER_BUF_SIZE;
+    if (spool->wait_fd < 0) {
+        spool->wait_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (spool->wait_fd < 0) {
+            LOG_WARN("Cannot create spool wait fd: %s\n", strerror(errno));
+            return true;
+        }
+    }
+
+    /* reset before checking, so a buffer freed in between isn't missed */
+    if (read(spool->wait_fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN) {
+        LOG_ERR("Failed to read spool wait fd: %s\n", strerror(errno));
+    }
+
+    /*
+     * Only the queued buffers are ever freed. With none, the rest of the
+     * pool is held by spools still being filled, so go past it instead.
+     */
+    pthread_mutex_lock(&g_writer.lock);
+    writable = g_writer.num_free >= needed || g_writer.num_queued == 0;
+    if (!writable && !spool->waiting) {
+        TAILQ_INSERT_TAIL(&g_writer.waiters, spool, wait_tailq);
+        spool->waiting = true;
+    }
+    pthread_mutex_unlock(&g_writer.lock);
+
+    return writable;
+}
+
+int
+spool_wait_fd(struct spool *spool)
+{
+    return spool->wait_fd;
+}
+
+int
+spool_write(struct spool *spool, const void *buf, size_t len)
+{
+    if (spool->in_memory && !reserve_memory(spool, spool->size + len)) {
+        LOG_DEBUG("Spool of %zu bytes exceeds the memory limit, moving to disk.\n",
+                  spool->size + len);
+        if (spill_to_disk(spool) != 0) {
+            return -1;
+        }
+    }
+
+    if (spool->async) {
+        return write_async(spool, buf, len);
+    }
+
+    if (write_at(spool->fd, buf, len, spool->size) != 0) {
+        return -1;
+    }
+
+    spool->size += len;
+    return 0;
+}
+
+int
+spool_splice(struct spool *spool, int pipe_fd, size_t len)
+{
+    loff_t offset;
+    ssize_t rc;
+
+    if (spool->in_memory && !reserve_memory(spool, spool->size + len)) {
+        LOG_DEBUG("Spool of %zu bytes exceeds the memory limit, moving to disk.\n",
+                  spool->size + len);
+        if (spill_to_disk(spool) != 0) {
+            return -1;
+        }
+    }
+
+    /* the data after the splice must go to a new buffer */
+    if (spool->async && spool->buf) {
+        writer_submit(spool);
+    }
+
+    if (atomic_load(&spool->error) != 0) {
+        return -1;
+    }
+
+    while (len > 0) {
+        offset = (loff_t) spool->size;
+        rc = splice(pipe_fd, NULL, spool->fd, &offset, len, SPLICE_F_MOVE);
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (rc <= 0) {
+            LOG_ERR("Failed to splice into spool file: %s\n",
+                    rc < 0 ? strerror(errno) : "pipe drained");
+            return -1;
+        }
+
+        len -= (size_t) rc;
+        spool->size += (size_t) rc;
+    }
+
+    spool->written = spool->size;
+    return 0;
+}
+
+size_t
+spool_size(struct spool *spool)
+{
+    return spool->size;
+}
+
+const void *
+spool_map(struct spool *spool, size_t offset, size_t *len)
+{
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    size_t map_offset = offset & ~(page_size - 1);
+    uint8_t *data;
+
+    if (offset >= spool->size || writer_flush(spool) != 0) {
+        return NULL;
+    }
+
+    data = mmap(NULL, spool->size - map_offset, PROT_READ, MAP_SHARED, spool->fd,
+                (off_t) map_offset);
+    if (data == MAP_FAILED) {
+        LOG_ERR("Cannot map spool file: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    *len = spool->size - offset;
+    return data + (offset - map_offset);
+}
+
+void
+spool_unmap(const void *data, size_t len)
+{
+    size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    uintptr_t addr = (uintptr_t) data;
+    uintptr_t map_addr = addr & ~(uintptr_t) (page_size - 1);
+
+    munmap((void *) map_addr, len + (addr - map_addr));
+}
+
+bool
+spool_equals(struct spool *spool, const char *path)
+{
+    const void *data;
+    void *other = MAP_FAILED;
+    struct stat st;
+    size_t len = 0;
+    bool equal = false;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size != spool->size ||
+        spool->size == 0) {
+        goto out;
+    }
+
+    other = mmap(NULL, spool->size, PROT_READ, MAP_SHARED, fd, 0);
+    data = spool_map(spool, 0, &len);
+    if (other != MAP_FAILED && data != NULL) {
+        equal = memcmp(data, other, len) == 0;
+    }
+
+    if (data != NULL) {
+        spool_unmap(data, len);
+    }
+    if (other != MAP_FAILED) {
+        munmap(other, spool->size);
+    }
+
+out:
+    close(fd);
+    return equal;
+}
+
+int
+spool_publish(struct spool *spool, const char *path)
+{
+    char proc_path[32];
+
+    if (spool->in_memory && spill_to_disk(spool) != 0) {
+        return -1;
+    }
+
+    if (writer_flush(spool) != 0) {
+        return -1;
+    }
+
+    if (spool->allocated != SIZE_MAX && spool->allocated > spool->size &&
+        ftruncate(spool->fd, (off_t) spool->size) != 0) {
+        LOG_ERR("Cannot trim spool file: %s\n", strerror(errno));
+        return -1;
+    }
+
+    if (spool->tmp_path) {
+        if (rename(spool->tmp_path, path) != 0) {
+            LOG_ERR("Cannot rename '%s' to '%s': %s\n", spool->tmp_path, path,
+                    strerror(errno));
+            return -1;
+        }
+
+        free(spool->tmp_path);
+        spool->tmp_path = NULL;
+        return 0;
+    }
+
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", spool->fd);
+    return link_replace(proc_path, AT_SYMLINK_FOLLOW, path);
+}
+
+int
+spool_link(const char *src, const char *path)
+{
+    return link_replace(src, 0, path);
+}
+
+void
+spool_close(struct spool *spool)
+{
+    if (spool->async) {
+        /* the queued data is of no use anymore */
+        atomic_store(&spool->discard, true);
+        pthread_mutex_lock(&g_writer.lock);
+        if (spool->waiting) {
+            TAILQ_REMOVE(&g_writer.waiters, spool, wait_tailq);
+            spool->waiting = false;
+        }
+        if (spool->buf) {
+            writer_put_buf(spool->buf);
+            spool->buf = NULL;
+        }
+        pthread_mutex_unlock(&g_writer.lock);
+        writer_flush(spool);
+    }
+
+    if (spool->wait_fd >= 0) {
+        close(spool->wait_fd);
+    }
+
+    if (spool->tmp_path) {
+        unlink(spool->tmp_path);
+        free(spool->tmp_path);
+    }
+
+    release_memory(spool);
+    close(spool->fd);
+    free(spool->dir);
+    free(spool);
+}
+
+int
+spool_lib_init(void)
+{
+    unsigned num_bufs = g_config.spool_writer_buffers;
+    unsigned i;
+    int rc;
+
+    if (num_bufs == 0) {
+        return 0;
+    }
+
+    g_writer.bufs = calloc(num_bufs, sizeof(*g_writer.bufs));
+    g_writer.free_bufs = calloc(num_bufs, sizeof(*g_writer.free_bufs));
+    g_writer.data = malloc((size_t) num_bufs * SPOOL_WRITER_BUF_SIZE);
+    if (g_writer.bufs == NULL || g_writer.free_bufs == NULL || g_writer.data == NULL) {
+        LOG_FATAL("Failed to allocate %u spool writer buffers.\n", num_bufs);
+        return -1;
+    }
+
+    for (i = 0; i < num_bufs; ++i) {
+        g_writer.bufs[i].data = g_writer.data + (size_t) i * SPOOL_WRITER_BUF_SIZE;
+        g_writer.free_bufs[i] = &g_writer.bufs[i];
+    }
+    g_writer.num_free = num_bufs;
+    TAILQ_INIT(&g_writer.queue);
+    TAILQ_INIT(&g_writer.waiters);
+
+    pthread_mutex_init(&g_writer.lock, NULL);
+    pthread_cond_init(&g_writer.queued, NULL);
+    pthread_cond_init(&g_writer.written, NULL);
+
+    rc = pthread_create(&g_writer.thread, NULL, writer_thread_fn, NULL);
+    if (rc != 0) {
+        LOG_FATAL("pthread_create() failed: %s.\n", strerror(rc));
+        return -1;
+    }
+
+    g_writer.running = true;
+    return 0;
+}
+
+/* all spools must be closed by now */
+void
+spool_lib_shutdown(void)
+{
+    if (!g_writer.running) {
+        return;
+    }
+
+    pthread_mutex_lock(&g_writer.lock);
+    g_writer.stopping = true;
+    pthread_cond_signal(&g_writer.queued);
+    pthread_mutex_unlock(&g_writer.lock);
+    pthread_join(g_writer.thread, NULL);
+    g_writer.running = false;
+
+    LOG_INFO("Spool writer: %lu buffers written, %lu allocated past the pool.\n",
+             g_writer.writes, g_writer.extra_bufs);
+
+    free(g_writer.data);
+    free(g_writer.free_bufs);
+    free(g_writer.bufs);
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#ifndef BROTHER_SPOOL_H
+#define BROTHER_SPOOL_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+struct spool;
+
+/**
+ * Start the writer thread if spool.writer.buffers is set. The disk
+ * writes are queued to it from then on, so they don't hold up the
+ * receiving of data. Writes never block, see spool_writable() for
+ * keeping them within the buffer pool. Must be called before any spool
+ * is opened.
+ */
+int spool_lib_init(void);
+void spool_lib_shutdown(void);
+
+/**
+ * Open an unnamed file for the page data inside the destination
+ * directory, so that it can be published without copying.
+ *
+ * With a non-zero mem_limit, the data is kept in memory instead
+ * for as long as it fits both mem_limit and the global
+ * spool.memory.budget, and is only written to dir on publish.
+ */
+struct spool *spool_open(const char *dir, size_t mem_limit);
+
+/**
+ * Allocate the disk space for a spool expected to grow to size bytes
+ * at once, so it's not fragmented by the small writes. Whatever isn't
+ * used is freed on publish.
+ */
+void spool_preallocate(struct spool *spool, size_t size);
+
+/**
+ * Check if len more bytes can be written without running out of the
+ * writer's buffers. If not, the caller should stop reading the data
+ * until spool_wait_fd() becomes readable, then check again. Always true
+ * for spools that aren't handled by the writer.
+ */
+bool spool_writable(struct spool *spool, size_t len);
+
+/**
+ * An fd that becomes readable once the writer frees a buffer after
+ * spool_writable() returned false.
+ */
+int spool_wait_fd(struct spool *spool);
+int spool_write(struct spool *spool, const void *buf, size_t len);
+
+/**
+ * Move len bytes from the read end of a pipe to the spool without
+ * copying them through userspace. The pipe must hold that many bytes.
+ */
+int spool_splice(struct spool *spool, int pipe_fd, size_t len);
+size_t spool_size(struct spool *spool);
+
+/**
+ * Map the spooled data from offset up to the current size read-only.
+ * len is set to the size of the mapping. Returns NULL on error.
+ */
+const void *spool_map(struct spool *spool, size_t offset, size_t *len);
+void spool_unmap(const void *data, size_t len);
+
+/**
+ * Check if the file at path has exactly the spooled data.
+ */
+bool spool_equals(struct spool *spool, const char *path);
+
+/**
+ * Atomically give the spooled data its final name. Any existing
+ * file at path is replaced.
+ */
+int spool_publish(struct spool *spool, const char *path);
+
+/**
+ * Atomically make path a hard link to an already published file.
+ */
+int spool_link(const char *src, const char *path);
+void spool_close(struct spool *spool);
+
+#endif //BROTHER_SPOOL_H
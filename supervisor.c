@@ -0,0 +1,332 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#include "supervisor.h"
+#include "config.h"
+#include "connection.h"
+#include "device_handler.h"
+#include "log.h"
+#include "notify.h"
+
+#define SUPERVISOR_RESTART_MIN_DELAY_MS 1000
+#define SUPERVISOR_RESTART_MAX_DELAY_MS 60000
+/* workers that crash sooner than this are restarted with a growing delay */
+#define SUPERVISOR_STABLE_RUN_MS 30000
+/* how long the workers have to unregister their devices on shutdown */
+#define SUPERVISOR_STOP_TIMEOUT_MS 10000
+#define SUPERVISOR_MAX_BUTTON_CONNS (CONFIG_MAX_WORKERS * CONFIG_BUTTON_MAX_THREADS)
+
+struct worker {
+    unsigned index;
+    /* 0 if not running */
+    pid_t pid;
+    uint64_t start_ms;
+    uint64_t restart_ms;
+    unsigned restart_delay_ms;
+    /* registered its devices, at least once */
+    bool ready;
+};
+
+struct supervisor {
+    struct worker workers[CONFIG_MAX_WORKERS];
+    unsigned num_workers;
+    unsigned num_running;
+    unsigned num_ready;
+    /* the button sockets of all workers, worker n uses the n-th slice */
+    struct brother_conn *button_conns[SUPERVISOR_MAX_BUTTON_CONNS];
+    unsigned num_button_conns;
+    pid_t pid;
+    sigset_t sigmask;
+    sigset_t old_sigmask;
+};
+
+static struct supervisor g_supervisor;
+
+static uint64_t
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+static bool
+worker_owns_device(struct worker *worker, struct device_config *config)
+{
+    unsigned index;
+
+    index = brother_conn_reuseport_index(inet_addr(config->ip),
+                                         g_supervisor.num_button_conns);
+    return index / g_config.button_threads == worker->index;
+}
+
+/* runs in the freshly forked worker */
+static void
+worker_init(struct worker *worker)
+{
+    struct device_config *config, *next;
+    unsigned first_conn = worker->index * g_config.button_threads;
+    unsigned n, num_devices = 0;
+
+    /* quit with the supervisor, however it died */
+    prctl(PR_SET_PDEATHSIG, SIGINT);
+    if (getppid() != g_supervisor.pid) {
+        _exit(EXIT_FAILURE);
+    }
+
+    sigprocmask(SIG_SETMASK, &g_supervisor.old_sigmask, NULL);
+    notify_use_parent();
+
+    for (config = TAILQ_FIRST(&g_config.devices); config != NULL; config = next) {
+        next = TAILQ_NEXT(config, tailq);
+        if (worker_owns_device(worker, config)) {
+            ++num_devices;
+        } else {
+            TAILQ_REMOVE(&g_config.devices, config, tailq);
+        }
+    }
+
+    for (n = 0; n < g_supervisor.num_button_conns; ++n) {
+        if (n < first_conn || n >= first_conn + g_config.button_threads) {
+            brother_conn_close(g_supervisor.button_conns[n]);
+        }
+    }
+
+    device_handler_set_button_conns(&g_supervisor.button_conns[first_conn],
+                                    g_config.button_threads);
+    LOG_INFO("Worker %u serves %u devices.\n", worker->index, num_devices);
+}
+
+/* returns 0 in the new worker */
+static int
+worker_start(struct worker *worker)
+{
+    pid_t pid;
+
+    /* don't let the worker flush our buffers again */
+    fflush(stdout);
+    fflush(stderr);
+
+    pid = fork();
+    if (pid == 0) {
+        worker_init(worker);
+        return 0;
+    }
+
+    if (pid < 0) {
+        LOG_ERR("Cannot fork worker %u: %s\n", worker->index, strerror(errno));
+        worker->restart_ms = now_ms() + worker->restart_delay_ms;
+        return -1;
+    }
+
+    worker->pid = pid;
+    worker->start_ms = now_ms();
+    g_supervisor.num_running++;
+    return 1;
+}
+
+static void
+worker_exited(struct worker *worker, int status, bool stopping)
+{
+    uint64_t now = now_ms();
+
+    worker->pid = 0;
+    g_supervisor.num_running--;
+    if (stopping) {
+        return;
+    }
+
+    if (now - worker->start_ms >= SUPERVISOR_STABLE_RUN_MS) {
+        worker->restart_delay_ms = SUPERVISOR_RESTART_MIN_DELAY_MS;
+    }
+    worker->restart_ms = now + worker->restart_delay_ms;
+
+    if (WIFSIGNALED(status)) {
+        LOG_ERR("Worker %u was killed by signal %d, restarting in %u ms.\n",
+                worker->index, WTERMSIG(status), worker->restart_delay_ms);
+    } else {
+        LOG_ERR("Worker %u exited with status %d, restarting in %u ms.\n",
+                worker->index, WEXITSTATUS(status), worker->restart_delay_ms);
+    }
+
+    /* back off if it keeps crashing */
+    worker->restart_delay_ms *= 2;
+    if (worker->restart_delay_ms > SUPERVISOR_RESTART_MAX_DELAY_MS) {
+        worker->restart_delay_ms = SUPERVISOR_RESTART_MAX_DELAY_MS;
+    }
+}
+
+static void
+reap_workers(bool stopping)
+{
+    unsigned i;
+    pid_t pid;
+    int status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (i = 0; i < g_supervisor.num_workers; ++i) {
+            if (g_supervisor.workers[i].pid == pid) {
+                worker_exited(&g_supervisor.workers[i], status, stopping);
+                break;
+            }
+        }
+    }
+}
+
+static void
+worker_ready(pid_t pid)
+{
+    struct worker *worker;
+    unsigned i;
+
+    for (i = 0; i < g_supervisor.num_workers; ++i) {
+        worker = &g_supervisor.workers[i];
+        if (worker->pid != pid || worker->ready) {
+            continue;
+        }
+
+        worker->ready = true;
+        /* restarted workers don't count, we're ready just once */
+        if (++g_supervisor.num_ready == g_supervisor.num_workers) {
+            LOG_INFO("All %u workers are ready.\n", g_supervisor.num_workers);
+            notify_ready();
+        }
+        break;
+    }
+}
+
+static void
+signal_workers(int signo)
+{
+    unsigned i;
+
+    for (i = 0; i < g_supervisor.num_workers; ++i) {
+        if (g_supervisor.workers[i].pid != 0) {
+            kill(g_supervisor.workers[i].pid, signo);
+        }
+    }
+}
+
+/* wait for a signal, at most until the next worker is due to restart */
+static int
+supervisor_wait(uint64_t deadline_ms, bool stopping, siginfo_t *info)
+{
+    struct timespec timeout;
+    uint64_t now = now_ms(), wait_ms = 1000;
+    unsigned i;
+
+    for (i = 0; i < g_supervisor.num_workers; ++i) {
+        if (!stopping && g_supervisor.workers[i].pid == 0 &&
+            g_supervisor.workers[i].restart_ms < now + wait_ms) {
+            wait_ms = g_supervisor.workers[i].restart_ms > now ?
+                      g_supervisor.workers[i].restart_ms - now : 0;
+        }
+    }
+
+    if (deadline_ms != 0 && deadline_ms < now + wait_ms) {
+        wait_ms = deadline_ms > now ? deadline_ms - now : 0;
+    }
+
+    timeout.tv_sec = (time_t) (wait_ms / 1000);
+    timeout.tv_nsec = (long) (wait_ms % 1000) * 1000000;
+    return sigtimedwait(&g_supervisor.sigmask, info, &timeout);
+}
+
+int
+supervisor_run(void)
+{
+    struct worker *worker;
+    siginfo_t info;
+    uint64_t stop_deadline_ms = 0;
+    bool stopping = false;
+    unsigned i;
+    int signo, rc = -1;
+
+    g_supervisor.pid = getpid();
+    g_supervisor.num_workers = g_config.workers;
+    g_supervisor.num_button_conns = g_config.workers * g_config.button_threads;
+
+    /* the signals are handled synchronously below */
+    sigemptyset(&g_supervisor.sigmask);
+    sigaddset(&g_supervisor.sigmask, SIGINT);
+    sigaddset(&g_supervisor.sigmask, SIGTERM);
+    sigaddset(&g_supervisor.sigmask, SIGCHLD);
+    sigaddset(&g_supervisor.sigmask, NOTIFY_WORKER_READY_SIGNAL);
+    sigprocmask(SIG_BLOCK, &g_supervisor.sigmask, &g_supervisor.old_sigmask);
+
+    if (device_handler_open_button_conns(g_supervisor.button_conns,
+                                         g_supervisor.num_button_conns) != 0) {
+        goto out;
+    }
+
+    for (i = 0; i < g_supervisor.num_workers; ++i) {
+        worker = &g_supervisor.workers[i];
+        worker->index = i;
+        worker->restart_delay_ms = SUPERVISOR_RESTART_MIN_DELAY_MS;
+        if (worker_start(worker) == 0) {
+            return 0;
+        }
+    }
+
+    while (!stopping || g_supervisor.num_running > 0) {
+        signo = supervisor_wait(stop_deadline_ms, stopping, &info);
+        if (signo == NOTIFY_WORKER_READY_SIGNAL && !stopping) {
+            worker_ready(info.si_pid);
+            continue;
+        }
+
+        if ((signo == SIGINT || signo == SIGTERM) && !stopping) {
+            LOG_INFO("Stopping %u workers.\n", g_supervisor.num_running);
+            stopping = true;
+            stop_deadline_ms = now_ms() + SUPERVISOR_STOP_TIMEOUT_MS;
+            /* workers shut down on SIGINT */
+            signal_workers(SIGINT);
+        }
+
+        reap_workers(stopping);
+
+        if (stopping) {
+            if (now_ms() >= stop_deadline_ms && g_supervisor.num_running > 0) {
+                LOG_ERR("Workers didn't stop in time, killing them.\n");
+                signal_workers(SIGKILL);
+                stop_deadline_ms = UINT64_MAX;
+            }
+            continue;
+        }
+
+        for (i = 0; i < g_supervisor.num_workers; ++i) {
+            worker = &g_supervisor.workers[i];
+            if (worker->pid == 0 && worker->restart_ms <= now_ms() &&
+                worker_start(worker) == 0) {
+                return 0;
+            }
+        }
+    }
+
+    rc = 1;
+    for (i = 0; i < g_supervisor.num_button_conns; ++i) {
+        brother_conn_close(g_supervisor.button_conns[i]);
+    }
+
+out:
+    sigprocmask(SIG_SETMASK, &g_supervisor.old_sigmask, NULL);
+    return rc;
+}
@@ -0,0 +1,23 @@
+/*
+ * Copyright (c) 2017 Dariusz Stojaczyk. All Rights Reserved.
+ * The following source code is released under an MIT-style license,
+ * that can be found in the LICENSE file.
+ */
+
+#ifndef BROTHER_SUPERVISOR_H
+#define BROTHER_SUPERVISOR_H
+
+/**
+ * Fork g_config.workers worker processes, each serving its own part of
+ * the devices, and restart the ones that exit. The button sockets of all
+ * workers are opened here and outlive the workers, so a restarted worker
+ * gets the same devices and the events sent in the meantime.
+ *
+ * Returns 0 in a worker, which should carry on starting up as a single
+ * process would. Returns 1 in the supervisor once it was interrupted and
+ * all workers are gone, or -1 if the workers couldn't be started.
+ * Must be called before any threads are started.
+ */
+int supervisor_run(void);
+
+#endif //BROTHER_SUPERVISOR_H